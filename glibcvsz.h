@@ -0,0 +1,81 @@
+/*
+ * Memory map introspection of the calling process, built from the same code
+ * as glibcVSZPlayground (make lib). Snapshots read /proc/self/smaps and
+ * classify every mapping as main heap, arena heap, thread stack or other,
+ * with the registered threads and allocations as owners. Arena heaps are
+ * recognised from the map layout alone, the service keeps allocating while
+ * it is inspected, so no allocator memory is read.
+ *
+ * All functions return 0 or a pointer on success and -1 or NULL with errno
+ * set on failure. They are thread-safe; only the registration functions are
+ * meant for hot threads and take no lock other threads hold for long.
+ */
+#ifndef GLIBCVSZ_H
+#define GLIBCVSZ_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GLIBCVSZ_API __attribute__((visibility("default")))
+
+enum glibcvsz_region_kind {
+    GLIBCVSZ_OTHER,
+    GLIBCVSZ_MAIN_HEAP,
+    GLIBCVSZ_ARENA_HEAP,
+    GLIBCVSZ_THREAD_STACK
+};
+
+enum glibcvsz_format {
+    GLIBCVSZ_TEXT,   // human readable, on stdout only
+    GLIBCVSZ_JSON,
+    GLIBCVSZ_CSV,
+    GLIBCVSZ_BINARY  // the records described in the README
+};
+
+struct glibcvsz_mapping {
+    unsigned long long start;
+    unsigned long long end;
+    int rss_kbytes;
+    int dirty_kbytes;
+    int swap_kbytes;
+    char perms[4];               // "rwx" with '-' for missing permissions
+    enum glibcvsz_region_kind kind;
+    long thread;                 // registered id owning a stack, -1 otherwise
+    const char *name;            // path or [ anon ], valid until the snapshot is freed
+};
+
+struct glibcvsz_snapshot;
+
+// Registers the calling thread with its stack under the given id
+GLIBCVSZ_API int glibcvsz_register_thread(long id);
+GLIBCVSZ_API void glibcvsz_unregister_thread(void);
+
+// Attributes a block to the calling thread, which has to be registered
+GLIBCVSZ_API int glibcvsz_register_allocation(const void *ptr, size_t size);
+GLIBCVSZ_API void glibcvsz_unregister_allocation(const void *ptr);
+
+GLIBCVSZ_API struct glibcvsz_snapshot *glibcvsz_snapshot_take(void);
+GLIBCVSZ_API size_t glibcvsz_snapshot_mappings(const struct glibcvsz_snapshot *snapshot,
+                                               const struct glibcvsz_mapping **mappings);
+// Writes the full report with owners and totals to fd, which stays open
+GLIBCVSZ_API int glibcvsz_snapshot_write(const struct glibcvsz_snapshot *snapshot, int fd,
+                                         enum glibcvsz_format format);
+GLIBCVSZ_API void glibcvsz_snapshot_free(struct glibcvsz_snapshot *snapshot);
+
+/*
+ * Starts a background thread that writes a snapshot to
+ * <directory>/glibcvsz-<pid>-<n>.<json|csv|bin> for every SIGUSR1. The
+ * signal handler only wakes the thread, so whichever thread the signal
+ * hits is back at work at once.
+ */
+GLIBCVSZ_API int glibcvsz_start_dump_thread(const char *directory, enum glibcvsz_format format);
+GLIBCVSZ_API void glibcvsz_stop_dump_thread(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -11,20 +11,161 @@
 #include <getopt.h>
 #include <limits.h>
 #include <malloc.h>
+#include <time.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <linux/futex.h>
+#include <sys/prctl.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <gnu/libc-version.h>
+#include <linux/perf_event.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "glibcvsz.h"
 
 # if __WORDSIZE == 32
 #  define GLIBC_ARENA_SIZE_IN_KBYTES 512
+#  define GLIBC_HEAP_MAX_SIZE (2 * 512 * 1024UL)
 # else
 #  define GLIBC_ARENA_SIZE_IN_KBYTES (2 * 4 * 1024 * sizeof(long))
+#  define GLIBC_HEAP_MAX_SIZE (2 * 4 * 1024 * 1024 * sizeof(long))
 # endif
+#ifndef MADV_COLLAPSE
+#  define MADV_COLLAPSE 25
+#endif
+#ifndef MADV_POPULATE_WRITE
+#  define MADV_POPULATE_WRITE 23
+#endif
+#define GLIBC_NFASTBINS   10
+#define GLIBC_CHUNK_IS_MMAPPED    0x2
+#define GLIBC_CHUNK_NON_MAIN_ARENA 0x4
+#define GLIBC_CHUNK_FLAGS         0x7
+#define GLIBC_NBINS       128
+#define GLIBC_NSMALLBINS  64
+#define GLIBC_BINMAPSIZE  4
 
 #define DEFAULT_NUM_THREADS 20
 #define DEFAULT_MALLOC_COUNT 1
 #define PMAP_INITIAL_CAPACITY 50
 #define PMAP_MAX_MAPPING_PATH 1024
 #define PMAP_MAX_ADDRESS_LEN  64
+#define DEFAULT_WORKLOAD_SIZE 1024
+#define DEFAULT_REALLOC_GROWTH 2.0
+#define LATENCY_SUB_BUCKETS   16
+#define LATENCY_BUCKETS       (61 * LATENCY_SUB_BUCKETS)
+#define BENCHMARK_WINDOW      64
+#define POOL_CHUNK_SIZE       (64 * 1024)
+#define POOL_CHUNK_HEADER_SIZE 64
+#define POOL_LARGE_THRESHOLD  (16 * 1024)
+#define POOL_SIZE_CLASSES     22
+#define SWEEP_MAX_VALUES      64
+#define SMAPS_MAX_LINE_LEN    (PMAP_MAX_MAPPING_PATH + 128)
+#define SMAPS_READ_BUFFER     (64 * 1024)
+#define OUTPUT_BUFFER_SIZE    (256 * 1024)
+#define STACK_PAINT_PATTERN   0xA5
+#define STACK_PAINT_SAFETY    4096
+#define DEFAULT_STACK_MARGIN  50
+#define PAGEMAP_BATCH_PAGES   4096
+#define PAGEMAP_PFN_MASK      ((1ULL << 55) - 1)
+#define PAGEMAP_SWAPPED       (1ULL << 62)
+#define PAGEMAP_PRESENT       (1ULL << 63)
+#define KPF_THP               22
+#define KPF_ZERO_PAGE         24
+#define PAGE_MAP_MAX_RUNS     32
+#define PAGE_MAP_ROW_PAGES    64
+#define DEFAULT_RECLAIM_PERCENT 50
+#define THP_DEFAULT_PAGE_SIZE (2 * 1024 * 1024)
+#define THP_TOP_PAD_PAGES     8
+#define THP_ACCESS_MAX_PAGES  (1 << 22)
+#define THP_ACCESS_MIN_COUNT  (1 << 24)
+#define THP_TUNABLE_SETTING   "glibc.malloc.hugetlb=1"
+#define THP_TUNABLE_MARKER    "GLIBCVSZ_THP_REEXEC"
+#define NUMA_MAX_NODES        64
+#define REPORT_BINARY_MAGIC   "GVSZ"
+#define REPORT_BINARY_VERSION 1
+#define TRACE_MAGIC           "GVTR"
+#define TRACE_VERSION         1
+#define TRACE_RING_EVENTS     65536 // power of two
+#define TRACE_MAX_ARENAS      1024
+#define TRACE_DRAIN_INTERVAL_NS 200000
+#define TRACE_CALIBRATION_ROUNDS 5
+#define SNAP_MAGIC            "GVSS"
+#define SNAP_VERSION          1
+#define SNAP_MAX_LABEL        1024
+#define TOUCH_MAX_PATTERNS    8
+
+enum stack_usage_method {
+    STACK_USAGE_OFF,
+    STACK_USAGE_MINCORE,
+    STACK_USAGE_PAINT
+};
+
+enum reclaim_strategy {
+    RECLAIM_NONE,
+    RECLAIM_TRIM,
+    RECLAIM_TRIM_THRESHOLD,
+    RECLAIM_DONTNEED,
+    RECLAIM_FREE
+};
+
+enum touch_kind {
+    TOUCH_FULL,
+    TOUCH_PAGE,
+    TOUCH_STRIDE,
+    TOUCH_RANDOM,
+    TOUCH_STREAM,
+    TOUCH_READ
+};
+
+struct touch_pattern {
+    enum touch_kind kind;
+    size_t stride;  // TOUCH_STRIDE
+    int percent;    // TOUCH_RANDOM
+    char name[32];
+};
+
+enum thp_mode {
+    THP_OFF,
+    THP_MADVISE,
+    THP_TUNABLE
+};
+
+enum affinity_mode {
+    AFFINITY_OFF,
+    AFFINITY_COMPACT,
+    AFFINITY_SCATTER
+};
+
+enum reclaim_phase {
+    RECLAIM_PHASE_IDLE,
+    RECLAIM_PHASE_FREE,
+    RECLAIM_PHASE_RETOUCH,
+    RECLAIM_PHASE_STOP
+};
+
+enum page_map_mode {
+    PAGE_MAP_OFF,
+    PAGE_MAP_SUMMARY,
+    PAGE_MAP_FULL
+};
+
+enum output_format {
+    OUTPUT_TEXT,
+    OUTPUT_JSON,
+    OUTPUT_CSV,
+    OUTPUT_BINARY
+};
 
 volatile sig_atomic_t running = 1;
+volatile sig_atomic_t watching = 1;
 int malloc_enabled = 0;
 int malloc_fill_enabled = 0;
 size_t malloc_size = 0;
@@ -32,24 +173,222 @@ int stack_size_given = 0;
 int malloc_count = DEFAULT_MALLOC_COUNT;
 int num_threads = DEFAULT_NUM_THREADS;
 size_t stack_size = 0;
+int watch_interval_ms = 0;
+int attach_pid = 0;
+int malloc_arena_max = 0;
+long benchmark_ops = 0;
+volatile int benchmark_gate = 0; // benchmark threads yet to start
+int pool_arena_limit = 0; // --allocator pool keeps glibc to the main arena, -a was not given
+int malloc_mmap_threshold = 0;
+int sweep_enabled = 0;
+int sweep_jobs = 1;
+double sweep_min_throughput = 0;
+int pool_workers = 0;
+int spawner_count = 0;
+enum reclaim_strategy reclaim_strategy = RECLAIM_NONE;
+size_t reclaim_trim_threshold = 0;
+int reclaim_percent = DEFAULT_RECLAIM_PERCENT;
+int reclaim_participants = 0;
+enum thp_mode thp_mode = THP_OFF;
+size_t thp_collapsed_bytes = 0;
+enum affinity_mode affinity_mode = AFFINITY_OFF;
+int numa_report = 0;
+int stack_pool_enabled = 0;
+size_t stack_guard_size = 0;
+int stack_guard_given = 0;
+int stack_commit_eager = 0;
+double thread_create_seconds = 0.0;
+const char *trace_path = NULL;
+const char *snapshot_path = NULL;
+int fragmentation_report = 0;
+#ifdef GLIBCVSZ_LIBRARY
+// A service keeps allocating while it is inspected, so its arena headers are not read
+int read_arena_headers = 0;
+#else
+int read_arena_headers = 1;
+#endif
+int counters_enabled = 0;
+struct touch_pattern touch_patterns[TOUCH_MAX_PATTERNS] = { { TOUCH_FULL, 0, 0, "full" } };
+int touch_pattern_count = 0;
+int touch_active = 0; // the pattern this process touches the -f blocks with
+const char *compare_paths[2] = { NULL, NULL };
+volatile int reclaim_phase = RECLAIM_PHASE_IDLE;
+volatile int reclaim_acks = 0;
+volatile int threads_ready = 0;
+enum output_format output_format = OUTPUT_TEXT;
+const char *output_path = NULL;
+enum stack_usage_method stack_usage_method = STACK_USAGE_OFF;
+int stack_usage_margin = DEFAULT_STACK_MARGIN;
+enum page_map_mode page_map_mode = PAGE_MAP_OFF;
 
 struct pmap_entry {
     unsigned long long start_address;
+    unsigned long long end_address;
     int kbytes;
     int rss;
     int dirty;
+    int pss;
+    int swap;
+    int anon_huge_pages;
+    int shared_dirty;
+    int private_dirty;
+    int brk_heap;
     char r;
     char w;
     char x;
     char mapping[PMAP_MAX_MAPPING_PATH];
 };
 
+struct smaps_counters {
+    int rss;
+    int pss;
+    int swap;
+    int anon_huge_pages;
+    int shared_dirty;
+    int private_dirty;
+    int lazy_free;
+};
+
+enum size_distribution {
+    SIZE_DIST_FIXED,
+    SIZE_DIST_UNIFORM,
+    SIZE_DIST_LOGNORMAL,
+    SIZE_DIST_HISTOGRAM
+};
+
+struct size_histogram_bucket {
+    size_t size;
+    double cumulative_weight;
+};
+
+struct workload_config {
+    int enabled;
+    long ops;
+    enum size_distribution size_dist;
+    size_t size_min;
+    size_t size_max;
+    double lognormal_mu;
+    double lognormal_sigma;
+    struct size_histogram_bucket *histogram;
+    size_t histogram_count;
+    int free_percent;
+    int realloc_percent;
+    double realloc_growth;
+    long lifetime_ops;
+    long ops_per_sec;
+    int producer_consumer;
+};
+
+struct workload_config workload = {
+    .size_dist = SIZE_DIST_FIXED,
+    .realloc_growth = DEFAULT_REALLOC_GROWTH,
+};
+
+enum workload_role {
+    WORKLOAD_ROLE_SOLO,
+    WORKLOAD_ROLE_PRODUCER,
+    WORKLOAD_ROLE_CONSUMER
+};
+
+struct handoff_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    void **items;
+    size_t head;
+    size_t count;
+    size_t capacity;
+    int producer_done;
+};
+
+struct workload_stats {
+    long allocs;
+    long frees;
+    long reallocs;
+    long remote_frees;
+    long failed;
+    size_t live_objects;
+    size_t live_bytes;
+    size_t peak_live_bytes;
+};
+
+enum sweep_param_index {
+    SWEEP_THREADS,
+    SWEEP_STACK_SIZE,
+    SWEEP_ARENA_MAX,
+    SWEEP_MMAP_THRESHOLD,
+    SWEEP_PARAM_COUNT
+};
+
+struct sweep_param {
+    char key;
+    long values[SWEEP_MAX_VALUES];
+    size_t count;
+};
+
+struct sweep_param sweep_params[SWEEP_PARAM_COUNT] = {
+    [SWEEP_THREADS] = { .key = 'n' },
+    [SWEEP_STACK_SIZE] = { .key = 's' },
+    [SWEEP_ARENA_MAX] = { .key = 'a' },
+    [SWEEP_MMAP_THRESHOLD] = { .key = 't' },
+};
+
+struct latency_histogram {
+    unsigned long long counts[LATENCY_BUCKETS];
+    unsigned long long total;
+};
+
+struct benchmark_result {
+    long ops;
+    long failed;
+    double seconds;
+    struct latency_histogram malloc_latency;
+    struct latency_histogram free_latency;
+    int arrived; // passed or left the start gate
+};
+
 struct malloc_info_entry {
     unsigned long long malloc_start_address;
     size_t malloc_size;
     unsigned long long malloc_end_address;
 };
 
+struct malloc_info_entry *malloc_info_block = NULL;
+
+enum counter_phase {
+    COUNTER_ALLOC,
+    COUNTER_FILL,
+    COUNTER_PHASES
+};
+
+enum counter_event {
+    COUNTER_FAULTS,
+    COUNTER_MAJOR_FAULTS,
+    COUNTER_DTLB_MISSES,
+    COUNTER_CYCLES,
+    COUNTER_EVENTS
+};
+
+enum counter_source {
+    COUNTER_SOURCE_NONE,
+    COUNTER_SOURCE_PERF,
+    COUNTER_SOURCE_PERF_USER, // perf_event_paranoid only allows counting user space
+    COUNTER_SOURCE_RUSAGE
+};
+
+struct phase_counters {
+    unsigned long long wall_ns;
+    unsigned long long cpu_ns;
+    unsigned long long events[COUNTER_EVENTS];
+};
+
+// --counters: what the -m/-f mallocs and the 0xAA fill of one thread cost
+struct thread_counters {
+    struct phase_counters phases[COUNTER_PHASES];
+    enum counter_source source[COUNTER_EVENTS];
+    int fds[COUNTER_EVENTS];
+    struct phase_counters start;
+};
+
 struct thread_info_entry {
     long thread_id;
     pid_t tid;
@@ -58,6 +397,23 @@ struct thread_info_entry {
     unsigned long long stack_end_address;
     struct malloc_info_entry *malloc_info_entries;
     size_t malloc_entry_count;
+    enum workload_role workload_role;
+    struct handoff_queue *handoff;
+    struct workload_stats workload_stats;
+    struct benchmark_result *benchmark;
+    unsigned long long arena_probe_address;
+    size_t stack_peak_bytes;
+    unsigned long long spawn_ns;  // before pthread_create()
+    unsigned long long create_ns; // duration of pthread_create()
+    unsigned long long ready_ns;  // thread reported ready
+    unsigned long long parked_frame; // --reclaim: the stack below is idle
+    unsigned long long retouch_ns;
+    long retouch_faults;
+    struct thread_counters counters;
+    unsigned long long touch_ns;       // -f fill with touch_patterns[touch_active]
+    unsigned long long touch_accessed; // bytes written or read by it
+    int cpu;                      // CPU the thread ran on, -1 if unknown
+    int created;
     int finished;
 };
 
@@ -139,9 +495,16 @@ static struct pmap_entry *parse_pmap_output(FILE *fp, int *count) {
 
         // Fill in the struct
         entries[*count].start_address = start_address;
+        entries[*count].end_address = start_address + (kbytes * 1024ULL);
         entries[*count].kbytes = kbytes;
         entries[*count].rss = rss;
         entries[*count].dirty = dirty;
+        entries[*count].pss = 0;
+        entries[*count].swap = 0;
+        entries[*count].anon_huge_pages = 0;
+        entries[*count].shared_dirty = 0;
+        entries[*count].private_dirty = 0;
+        entries[*count].brk_heap = 0;
         entries[*count].r = r;
         entries[*count].w = w;
         entries[*count].x = x;
@@ -160,445 +523,8307 @@ static struct pmap_entry *parse_pmap_output(FILE *fp, int *count) {
     return entries;
 }
 
-int check_pmap_entry_type(struct pmap_entry *p_current, struct pmap_entry *p_before, struct pmap_entry *p_after, struct thread_info_entry *thread_entries, int thread_entry_count) {
-    if (p_after) {
-        if (p_current->start_address + 0x200000000000 < p_after->start_address) {
-            printf("---------------- Main Thread - HEAP ---------------\n");
-            return 1;
-        }
+FILE *open_smaps_file(int pid, const char *name) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
 
-        // Thread Arena Check - Part 1
-        if (GLIBC_ARENA_SIZE_IN_KBYTES == p_current->kbytes + p_after->kbytes && p_current->r == 'r') {
-            printf("---------------- Thread Arena - HEAP --------------\n");
-        }
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return NULL;
+    }
+    // smaps lines are short, read them in large chunks to keep syscalls low
+    setvbuf(fp, NULL, _IOFBF, SMAPS_READ_BUFFER);
+    return fp;
+}
+
+static int is_smaps_header_line(const char *line) {
+    // Header lines start with the hex start address, field lines with a capitalized key
+    return (line[0] >= '0' && line[0] <= '9') || (line[0] >= 'a' && line[0] <= 'f');
+}
+
+static void set_pmap_entry_mapping(struct pmap_entry *entry, const char *path) {
+    // Mimic the naming of pmap -x: basename for files, "[ stack ]" and "[ anon ]" otherwise
+    if (path[0] == '/') {
+        const char *base = strrchr(path, '/') + 1;
+        strncpy(entry->mapping, base, PMAP_MAX_MAPPING_PATH);
+        entry->mapping[PMAP_MAX_MAPPING_PATH - 1] = '\0';
+    } else if (strcmp(path, "[stack]") == 0) {
+        strcpy(entry->mapping, "[ stack ]");
+    } else {
+        strcpy(entry->mapping, "[ anon ]");
     }
+}
 
-    if (p_before) {
-        // Thread Arena Check - Part 2
-        if (GLIBC_ARENA_SIZE_IN_KBYTES == p_current->kbytes + p_before->kbytes && p_current->r == '-') {
-            return 1;
-        }
+static int parse_smaps_header(char *line, struct pmap_entry *entry) {
+    char *p = line;
+
+    entry->start_address = strtoull(p, &p, 16);
+    if (*p != '-') {
+        return -1;
     }
+    entry->end_address = strtoull(p + 1, &p, 16);
+    while (*p == ' ') p++;
 
-    // Thread Stack Check
-    for (int i = 0; i < thread_entry_count; i++) {
-        struct thread_info_entry t_entry = thread_entries[i];
-        unsigned long long pmap_start = p_current->start_address;
-        unsigned long long pmap_end = p_current->start_address + (p_current->kbytes * 1024ULL);
+    if (strlen(p) < 4) {
+        return -1;
+    }
+    entry->r = (p[0] == 'r') ? 'r' : '-';
+    entry->w = (p[1] == 'w') ? 'w' : '-';
+    entry->x = (p[2] == 'x') ? 'x' : '-';
+    p += 4;
 
-        if (ranges_overlap(pmap_start, pmap_end, 
-                           t_entry.stack_start_address, t_entry.stack_end_address)) {
-            printf("---------------- Thread %ld - STACK ---------------\n", t_entry.thread_id);
-            return 1;
-        }
+    // Skip offset, device and inode to reach the (optional) path
+    for (int field = 0; field < 3; field++) {
+        while (*p == ' ') p++;
+        while (*p != ' ' && *p != '\0' && *p != '\n') p++;
     }
-    return 0;
-}
+    while (*p == ' ') p++;
 
-void print_pmap_entry(struct pmap_entry p_entry) {
-    printf("%llx %8d %8d %8d %c%c%c %s\n",
-           p_entry.start_address,
-           p_entry.kbytes,
-           p_entry.rss,
-           p_entry.dirty,
-           p_entry.r,
-           p_entry.w,
-           p_entry.x,
-           p_entry.mapping);
+    char *nl = strchr(p, '\n');
+    if (nl) {
+        *nl = '\0';
+    }
+    set_pmap_entry_mapping(entry, p);
+    entry->brk_heap = strcmp(p, "[heap]") == 0;
+
+    entry->kbytes = (int)((entry->end_address - entry->start_address) / 1024);
+    return 0;
 }
 
-void print_malloc_entries(struct thread_info_entry thread_entry, unsigned long long pmap_start, unsigned long long pmap_end) {
-    for (size_t j = 0; j < thread_entry.malloc_entry_count; j++) {
-        if (ranges_overlap(pmap_start, pmap_end,
-                           thread_entry.malloc_info_entries[j].malloc_start_address,
-                           thread_entry.malloc_info_entries[j].malloc_end_address)) {
-            printf("    Thread %ld (TID: %d)", thread_entry.thread_id, thread_entry.tid);
-            size_t alloc_size = thread_entry.malloc_info_entries[j].malloc_size;
-            printf(" - Malloc #%ld: [0x%llx - 0x%llx] (size: %zu bytes)\n",
-                   j+1,
-                   thread_entry.malloc_info_entries[j].malloc_start_address,
-                   thread_entry.malloc_info_entries[j].malloc_end_address,
-                   alloc_size);
-        }
+static void parse_smaps_field(const char *line, struct smaps_counters *counters) {
+    const char *colon = strchr(line, ':');
+    if (!colon) {
+        return;
     }
-}
 
-void create_output(struct pmap_entry *pmap_entries, int pmap_entry_count, struct thread_info_entry *thread_entries, int thread_entry_count) {
-    printf("%-12s %8s %8s %8s %s%s%s %s\n",
-           "Address", "Kbytes", "RSS", "Dirty", "R", "W", "X", "Mapping");
-    printf("---------------------------------------------------\n");
-    for (int m = 0; m < pmap_entry_count; m++) {
-        struct pmap_entry *p_current = &pmap_entries[m];
-        struct pmap_entry *p_before = NULL;
-        struct pmap_entry *p_after = NULL;
-        int endline_needed = 0;
+    size_t key_len = (size_t)(colon - line);
+    int *target = NULL;
+#define SMAPS_KEY_IS(name) (key_len == sizeof(name) - 1 && memcmp(line, name, key_len) == 0)
+    if (SMAPS_KEY_IS("Rss")) target = &counters->rss;
+    else if (SMAPS_KEY_IS("Pss")) target = &counters->pss;
+    else if (SMAPS_KEY_IS("Swap")) target = &counters->swap;
+    else if (SMAPS_KEY_IS("AnonHugePages")) target = &counters->anon_huge_pages;
+    else if (SMAPS_KEY_IS("Shared_Dirty")) target = &counters->shared_dirty;
+    else if (SMAPS_KEY_IS("Private_Dirty")) target = &counters->private_dirty;
+    else if (SMAPS_KEY_IS("LazyFree")) target = &counters->lazy_free;
+#undef SMAPS_KEY_IS
 
-        if (m + 1 < pmap_entry_count)
-            p_after = &pmap_entries[m+1];
-        if (m - 1 > 0)
-            p_before = &pmap_entries[m-1];
+    if (target) {
+        *target = (int)strtol(colon + 1, NULL, 10);
+    }
+}
 
-        endline_needed = check_pmap_entry_type(p_current, p_before, p_after, thread_entries, thread_entry_count);
+static void apply_smaps_counters(struct pmap_entry *entry, const struct smaps_counters *counters) {
+    entry->rss = counters->rss;
+    entry->pss = counters->pss;
+    entry->swap = counters->swap;
+    entry->anon_huge_pages = counters->anon_huge_pages;
+    entry->shared_dirty = counters->shared_dirty;
+    entry->private_dirty = counters->private_dirty;
+    entry->dirty = counters->shared_dirty + counters->private_dirty;
+}
 
-        print_pmap_entry(*p_current);
+/*
+ * Parses smaps into entries, which may be a buffer of a previous snapshot that
+ * is reused (and grown if needed). On failure the buffer is freed.
+ */
+static struct pmap_entry *parse_smaps_output(FILE *fp, struct pmap_entry *entries, int *capacity, int *count) {
+    if (!entries) {
+        *capacity = PMAP_INITIAL_CAPACITY;
+        entries = malloc(sizeof(struct pmap_entry) * (*capacity));
+        if (!entries) {
+            fprintf(stderr, "Malloc pmap entries failed!\n");
+            return NULL;
+        }
+    }
 
-        for (int i = 0; i < thread_entry_count; i++) {
-            struct thread_info_entry t_entry = thread_entries[i];
-            unsigned long long pmap_start = p_current->start_address;
-            unsigned long long pmap_end = p_current->start_address + (p_current->kbytes * 1024ULL);
+    char line[SMAPS_MAX_LINE_LEN];
+    struct pmap_entry *current = NULL;
+    struct smaps_counters counters;
+    *count = 0;
 
-            if (ranges_overlap(pmap_start, pmap_end, 
-                               t_entry.stack_start_address, t_entry.stack_end_address)) {
-                printf("    Thread %ld (TID: %d)", t_entry.thread_id, t_entry.tid);
-                printf(" - Stack: [0x%llx - 0x%llx] (size: %zu bytes)\n", 
-                       t_entry.stack_start_address, 
-                       t_entry.stack_end_address, 
-                       t_entry.stack_size);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (is_smaps_header_line(line)) {
+            if (current) {
+                apply_smaps_counters(current, &counters);
+            }
+            if (*count >= *capacity) {
+                entries = resize_entries(entries, capacity);
+                if (!entries) {
+                    return NULL;
+                }
             }
-            print_malloc_entries(t_entry, pmap_start, pmap_end);
+            current = &entries[*count];
+            if (parse_smaps_header(line, current) != 0) {
+                current = NULL;
+                continue; // skip malformed lines
+            }
+            memset(&counters, 0, sizeof(counters));
+            (*count)++;
+        } else if (current) {
+            parse_smaps_field(line, &counters);
         }
+    }
+    if (current) {
+        apply_smaps_counters(current, &counters);
+    }
 
-        if (endline_needed) {
-            printf("---------------------------------------------------\n");
-        }
+    if (*count == 0) {
+        fprintf(stderr, "No output from smaps.\n");
+        free(entries);
+        return NULL;
     }
+    return entries;
 }
 
-int get_stack_info(void **stack_addr, size_t *stack_size, void **stack_end_addr) {
-    pthread_t self = pthread_self();
-    pthread_attr_t attr;
+int read_smaps_rollup(int pid, struct smaps_counters *rollup) {
+    memset(rollup, 0, sizeof(*rollup));
 
-    int ret = pthread_getattr_np(self, &attr);
-    if (ret != 0) {
-        perror("pthread_getattr_np");
+    FILE *fp = open_smaps_file(pid, "smaps_rollup");
+    if (!fp) {
         return -1;
     }
 
-    pthread_attr_getstack(&attr, &*stack_addr, &*stack_size);
-    pthread_attr_destroy(&attr);
+    char line[SMAPS_MAX_LINE_LEN];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (is_smaps_header_line(line)) {
+            continue;
+        }
+        parse_smaps_field(line, rollup);
+    }
+    fclose(fp);
+    return 0;
+}
 
-    *stack_end_addr = (void *)((char *)(*stack_addr) + *(stack_size));
+struct attribution_record {
+    unsigned long long start_address;
+    unsigned long long end_address;
+    int thread_index;
+    long malloc_index; // -1 for the thread stack
+};
 
-    return 0;
+struct attribution_index {
+    struct attribution_record *records;
+    size_t count;
+    size_t cursor;
+    const struct attribution_record **matches;
+    size_t match_count;
+    size_t match_capacity;
+};
+
+static int compare_attribution_by_address(const void *a, const void *b) {
+    const struct attribution_record *ra = a;
+    const struct attribution_record *rb = b;
+    if (ra->start_address != rb->start_address)
+        return (ra->start_address < rb->start_address) ? -1 : 1;
+    return (ra->end_address < rb->end_address) ? -1 : (ra->end_address > rb->end_address);
 }
 
-void** malloc_allocate_function(long thread_id, struct malloc_info_entry *entries) {
-    void **allocated_memory = malloc(malloc_count * sizeof(void*));
-    if (allocated_memory == NULL) {
-        fprintf(stderr, "Thread %ld failed to allocate memory for malloc pointers\n", thread_id);
-        return NULL;
+static int compare_attribution_by_owner(const void *a, const void *b) {
+    const struct attribution_record *ra = *(const struct attribution_record * const *)a;
+    const struct attribution_record *rb = *(const struct attribution_record * const *)b;
+    if (ra->thread_index != rb->thread_index)
+        return (ra->thread_index < rb->thread_index) ? -1 : 1;
+    return (ra->malloc_index < rb->malloc_index) ? -1 : (ra->malloc_index > rb->malloc_index);
+}
+
+int build_attribution_index(struct attribution_index *index, struct thread_info_entry *thread_entries, int thread_entry_count) {
+    memset(index, 0, sizeof(*index));
+
+    size_t capacity = (size_t)thread_entry_count;
+    for (int i = 0; i < thread_entry_count; i++) {
+        capacity += thread_entries[i].malloc_entry_count;
     }
 
-    for (int i = 0; i < malloc_count; i++) {
-        allocated_memory[i] = malloc(malloc_size);
-        if (allocated_memory[i] != NULL) {
-            if (malloc_fill_enabled) {
-                memset(allocated_memory[i], 0xAA, malloc_size);
+    index->records = malloc(sizeof(struct attribution_record) * (capacity ? capacity : 1));
+    if (!index->records) {
+        fprintf(stderr, "Malloc attribution index failed!\n");
+        return -1;
+    }
+
+    for (int i = 0; i < thread_entry_count; i++) {
+        struct thread_info_entry *t_entry = &thread_entries[i];
+        if (t_entry->stack_end_address > t_entry->stack_start_address) {
+            struct attribution_record *rec = &index->records[index->count++];
+            rec->start_address = t_entry->stack_start_address;
+            rec->end_address = t_entry->stack_end_address;
+            rec->thread_index = i;
+            rec->malloc_index = -1;
+        }
+        for (size_t j = 0; j < t_entry->malloc_entry_count; j++) {
+            struct malloc_info_entry *m_entry = &t_entry->malloc_info_entries[j];
+            if (m_entry->malloc_end_address <= m_entry->malloc_start_address) {
+                continue; // failed allocations can never overlap a mapping
             }
-            void *malloc_end_addr = (char *)allocated_memory[i] + malloc_size;
-            entries[i].malloc_start_address = (unsigned long long) allocated_memory[i];
-            entries[i].malloc_size = malloc_size;
-            entries[i].malloc_end_address = (unsigned long long) malloc_end_addr;
-        } else {
-            entries[i].malloc_start_address = 0;
-            entries[i].malloc_size = 0;
-            entries[i].malloc_end_address = 0;
+            struct attribution_record *rec = &index->records[index->count++];
+            rec->start_address = m_entry->malloc_start_address;
+            rec->end_address = m_entry->malloc_end_address;
+            rec->thread_index = i;
+            rec->malloc_index = (long)j;
         }
     }
-    return allocated_memory;
+
+    qsort(index->records, index->count, sizeof(struct attribution_record), compare_attribution_by_address);
+    return 0;
 }
 
-void malloc_deallocate_function(void **allocated_memory) {
-    if (!allocated_memory) return;
-    for (int i = 0; i < malloc_count; i++) {
-         if (allocated_memory[i]) {
-             free(allocated_memory[i]);
-         }
-     }
-     free(allocated_memory);
+void rewind_attribution_index(struct attribution_index *index) {
+    index->cursor = 0;
+    index->match_count = 0;
 }
 
-void* thread_function(void *arg) {
-    struct thread_info_entry *tinfo = (struct thread_info_entry *)arg;
-    long thread_id = tinfo->thread_id;
-    void *stack_addr = NULL;
-    size_t stack_size;
-    void *stack_end_addr = NULL;
-    void **allocated_memory = NULL;
+void free_attribution_index(struct attribution_index *index) {
+    free(index->records);
+    free(index->matches);
+    memset(index, 0, sizeof(*index));
+}
 
-    if (get_stack_info(&stack_addr, &stack_size, &stack_end_addr) != 0) {
-        return NULL;
+/*
+ * Collects all records overlapping [start, end) into index->matches, ordered by
+ * thread and malloc number. Queries have to come in ascending start address
+ * order (as the pmap entries do), so records ending before the current mapping
+ * are skipped once and never looked at again.
+ */
+int query_attribution_index(struct attribution_index *index, unsigned long long start, unsigned long long end) {
+    while (index->cursor < index->count && index->records[index->cursor].end_address <= start) {
+        index->cursor++;
     }
 
-    // Thread Info Entry Init
-    tinfo->thread_id = thread_id;
-    tinfo->tid = syscall(SYS_gettid);
-    tinfo->stack_start_address = (unsigned long long) stack_addr;
-    tinfo->stack_size = stack_size;
-    tinfo->stack_end_address = (unsigned long long) stack_end_addr;
-    if (tinfo->malloc_entry_count > 0 && tinfo->malloc_info_entries == NULL) {
-        fprintf(stderr, "Thread %ld failed to allocate memory for thread_info_entry pointerrs\n", thread_id);
-        return NULL;
+    index->match_count = 0;
+    for (size_t r = index->cursor; r < index->count && index->records[r].start_address < end; r++) {
+        const struct attribution_record *rec = &index->records[r];
+        if (!ranges_overlap(start, end, rec->start_address, rec->end_address)) {
+            continue;
+        }
+        if (index->match_count >= index->match_capacity) {
+            size_t new_capacity = index->match_capacity ? index->match_capacity * 2 : PMAP_INITIAL_CAPACITY;
+            const struct attribution_record **new_matches = realloc(index->matches, sizeof(*new_matches) * new_capacity);
+            if (!new_matches) {
+                perror("realloc");
+                return -1;
+            }
+            index->matches = new_matches;
+            index->match_capacity = new_capacity;
+        }
+        index->matches[index->match_count++] = rec;
     }
 
-    if (malloc_enabled) {
-        allocated_memory = malloc_allocate_function(thread_id, tinfo->malloc_info_entries);
-        if (!allocated_memory) {
-            return NULL;
-        }
+    if (index->match_count > 1) {
+        qsort(index->matches, index->match_count, sizeof(*index->matches), compare_attribution_by_owner);
     }
+    return 0;
+}
 
-    tinfo->finished = 1;
+/*
+ * Mirrors of glibc's heap_info and malloc_state (malloc/arena.c, malloc.c),
+ * only the leading fields that are read here. Both layouts have been stable
+ * since glibc 2.27, which added have_fastchunks; everything read through
+ * them is validated before use.
+ */
+struct glibc_heap_info {
+    struct glibc_malloc_state *ar_ptr;
+    struct glibc_heap_info *prev;
+    size_t size;
+    size_t mprotect_size;
+};
 
-    while (running) {
-        usleep(100000);
-    }
+struct glibc_malloc_state {
+    int mutex;
+    int flags;
+    int have_fastchunks;
+    void *fastbins[GLIBC_NFASTBINS];
+    void *top;
+    void *last_remainder;
+    void *bins[GLIBC_NBINS * 2 - 2];
+    unsigned int binmap[GLIBC_BINMAPSIZE];
+    struct glibc_malloc_state *next;
+    struct glibc_malloc_state *next_free;
+    size_t attached_threads;
+    size_t system_mem;
+    size_t max_system_mem;
+};
 
-    if (allocated_memory != NULL) {
-        malloc_deallocate_function(allocated_memory);
-        allocated_memory = NULL;
-    }
+struct arena_heap {
+    unsigned long long start_address;
+    unsigned long long end_address;
+    unsigned long long prev_address;
+    size_t size;
+    int arena_index;
+    int ordinal; // position in the heap chain of the arena, starting with 1
+};
 
-    return NULL;
+enum bin_class {
+    BIN_FAST,
+    BIN_UNSORTED,
+    BIN_SMALL,
+    BIN_LARGE,
+    BIN_CLASSES
+};
+
+// Free memory of an arena that trimming the top chunk can not give back
+struct arena_fragmentation {
+    size_t free_bytes[BIN_CLASSES];
+    size_t free_chunks[BIN_CLASSES];
+    size_t largest_free;
+    size_t top_bytes;
+    int bins_walked; // 0 if only the mallinfo2() totals are known
+    int valid;
+};
+
+struct arena_info {
+    unsigned long long arena_address; // malloc_state, 0 for the main arena
+    int number;                       // heap nr in malloc_info(), -1 if unknown
+    size_t heap_count;
+    size_t heap_bytes;
+    size_t attached_threads;
+    size_t system_bytes;
+    size_t free_bytes;
+    int stats_valid;
+    struct arena_fragmentation fragmentation;
+};
+
+struct arena_table {
+    struct arena_info *arenas;
+    size_t arena_count;
+    struct arena_heap *heaps; // sorted by address, the brk heap of the main arena included
+    size_t heap_count;
+    int maps_only; // classified without access to the process memory, see scan_arenas_from_maps()
+    double fragmentation_seconds;
+};
+
+enum region_kind {
+    REGION_OTHER,
+    REGION_MAIN_HEAP,
+    REGION_ARENA_HEAP,
+    REGION_THREAD_STACK
+};
+
+struct region_class {
+    enum region_kind kind;
+    int starts_region; // first mapping of the region, the text output prints the banner above it
+    long thread_id;    // owner of a stack, -1 if unknown
+    int arena;         // display number of a thread arena, -1 if unknown
+    int heap_ordinal;
+    int heap_count;
+};
+
+static int find_arena(struct arena_table *table, unsigned long long arena_address) {
+    for (size_t a = 0; a < table->arena_count; a++) {
+        if (table->arenas[a].arena_address == arena_address)
+            return (int)a;
+    }
+    return -1;
 }
 
-int set_malloc_arena_number(int count) {
-    if (mallopt(M_ARENA_MAX, count) == 0) {
-        fprintf(stderr, "ERROR while trying to set MALLOC_ARENA_MAX\n");
-        return 1;
+static int add_arena(struct arena_table *table, unsigned long long arena_address) {
+    struct arena_info *new_arenas = realloc(table->arenas, sizeof(struct arena_info) * (table->arena_count + 1));
+    if (!new_arenas) {
+        perror("realloc");
+        return -1;
     }
-    return 0;
+    table->arenas = new_arenas;
+    memset(&table->arenas[table->arena_count], 0, sizeof(struct arena_info));
+    table->arenas[table->arena_count].arena_address = arena_address;
+    table->arenas[table->arena_count].number = -1;
+    return (int)table->arena_count++;
 }
 
-int set_malloc_mmap_threshold_in_bytes(size_t size) {
-    if (mallopt(M_MMAP_THRESHOLD, size) == 0) {
-        fprintf(stderr, "ERROR while trying to set M_MMAP_THRESHOLD\n");
-        return 1;
+static struct glibc_heap_info *heap_info_candidate(const struct pmap_entry *p_entry) {
+    if (p_entry->start_address % GLIBC_HEAP_MAX_SIZE != 0 || p_entry->r != 'r' || p_entry->w != 'w' ||
+        p_entry->mapping[0] != '[') {
+        return NULL;
     }
-    return 0;
+    struct glibc_heap_info *h = (struct glibc_heap_info *)(uintptr_t)p_entry->start_address;
+    if (h->size == 0 || h->size > GLIBC_HEAP_MAX_SIZE || h->mprotect_size < h->size) {
+        return NULL;
+    }
+    return h;
 }
 
-void print_usage(const char *program_name) {
-    printf("Usage: %s [options]\n", program_name);
-    printf("Options:\n");
-    printf("  -n, --num-threads <num>                   Number of threads (default: %d)\n", DEFAULT_NUM_THREADS);
-    printf("  -s, --thread-stack-size <size>            Stack size for each thread in bytes (default: system default)\n");
-    printf("  -m, --malloc-sparse-inside-thread <size>  Allocate memory inside each thread without initialization\n");
-    printf("  -f, --malloc-filled-inside-thread <size>  Allocate memory inside each thread and fill with 0xAA\n");
-    printf("  -c, --count-of-mallocs <number>           Number of malloc calls inside each thread (default: %d)\n", DEFAULT_MALLOC_COUNT);
-    printf("  -a, --malloc-arena-max <size>             Set number of arenas via MALLOC_ARENA_MAX (default: depends on arch and cpu core count)\n");
+/*
+ * The first heap of an arena holds the malloc_state right behind its
+ * heap_info header, which is 32 or 48 bytes depending on the glibc version.
+ */
+static int is_first_heap(const struct glibc_heap_info *h) {
+    uintptr_t offset = (uintptr_t)h->ar_ptr - (uintptr_t)h;
+    return h->prev == NULL && offset >= sizeof(struct glibc_heap_info) &&
+           offset <= sizeof(struct glibc_heap_info) + 2 * sizeof(size_t);
+}
+
+static int compare_arena_heaps(const void *a, const void *b) {
+    const struct arena_heap *ha = a;
+    const struct arena_heap *hb = b;
+    return (ha->start_address > hb->start_address) - (ha->start_address < hb->start_address);
+}
+
+/*
+ * Numbers the thread arenas the way malloc_info() does: main_arena comes first,
+ * followed by main_arena.next, which is always the newest arena. The newest
+ * arena is the only one no other arena points to with its next pointer.
+ */
+static void number_arenas(struct arena_table *table) {
+    size_t thread_arenas = table->arena_count - 1;
+    if (thread_arenas == 0) {
+        return;
+    }
+
+    int current = -1;
+    for (size_t a = 1; a < table->arena_count && current < 0; a++) {
+        int referenced = 0;
+        for (size_t b = 1; b < table->arena_count; b++) {
+            struct glibc_malloc_state *state = (struct glibc_malloc_state *)(uintptr_t)table->arenas[b].arena_address;
+            if ((unsigned long long)(uintptr_t)state->next == table->arenas[a].arena_address)
+                referenced = 1;
+        }
+        if (!referenced)
+            current = (int)a;
+    }
+
+    for (int nr = 1; current > 0 && (size_t)nr <= thread_arenas; nr++) {
+        if (table->arenas[current].number >= 0) {
+            break; // loop, the layout does not match
+        }
+        table->arenas[current].number = nr;
+        struct glibc_malloc_state *state = (struct glibc_malloc_state *)(uintptr_t)table->arenas[current].arena_address;
+        current = find_arena(table, (unsigned long long)(uintptr_t)state->next);
+    }
+}
+
+static unsigned long long xml_size_attribute(const char *element, const char *end) {
+    const char *size = strstr(element, "size=\"");
+    if (!size || size > end) {
+        return 0;
+    }
+    return strtoull(size + 6, NULL, 10);
+}
+
+/*
+ * Reads free and system bytes per arena from the malloc_info() XML. Only the
+ * <heap nr="N"> sections are looked at, the totals following them are skipped.
+ */
+static void read_malloc_info_stats(struct arena_table *table) {
+    char *xml = NULL;
+    size_t xml_size = 0;
+    FILE *fp = open_memstream(&xml, &xml_size);
+    if (!fp) {
+        return;
+    }
+    int ret = malloc_info(0, fp);
+    fclose(fp);
+    if (ret != 0 || !xml) {
+        free(xml);
+        return;
+    }
+
+    const char *heap = xml;
+    while ((heap = strstr(heap, "<heap nr=\"")) != NULL) {
+        int nr = atoi(heap + 10);
+        const char *end = strstr(heap, "</heap>");
+        if (!end) {
+            break;
+        }
+
+        for (size_t a = 0; a < table->arena_count; a++) {
+            struct arena_info *arena = &table->arenas[a];
+            if (arena->number != nr) {
+                continue;
+            }
+            const char *fast = strstr(heap, "<total type=\"fast\"");
+            const char *rest = strstr(heap, "<total type=\"rest\"");
+            const char *system = strstr(heap, "<system type=\"current\"");
+            arena->free_bytes = xml_size_attribute(fast ? fast : end, end) + xml_size_attribute(rest ? rest : end, end);
+            arena->system_bytes = xml_size_attribute(system ? system : end, end);
+            arena->stats_valid = 1;
+        }
+        heap = end;
+    }
+    free(xml);
+}
+
+void free_arena_table(struct arena_table *table) {
+    free(table->arenas);
+    free(table->heaps);
+    memset(table, 0, sizeof(*table));
+}
+
+struct arena_heap *find_arena_heap(struct arena_table *table, unsigned long long address) {
+    size_t lo = 0, hi = table->heap_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (table->heaps[mid].end_address <= address)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < table->heap_count && table->heaps[lo].start_address <= address) {
+        return &table->heaps[lo];
+    }
+    return NULL;
+}
+
+static int glibc_at_least(int want_major, int want_minor) {
+    int major = 0, minor = 0;
+    sscanf(gnu_get_libc_version(), "%d.%d", &major, &minor);
+    return major > want_major || (major == want_major && minor >= want_minor);
+}
+
+/*
+ * Since glibc 2.32 the fastbin links are mangled with the address they are
+ * stored at (safe-linking, PROTECT_PTR in malloc.c).
+ */
+static int glibc_safe_linking(void) {
+    return glibc_at_least(2, 32);
+}
+
+/*
+ * Returns the size of a free chunk if it lies inside a heap of the arena,
+ * 0 otherwise. Every pointer taken from a bin is checked with this before
+ * it is followed.
+ */
+static size_t free_chunk_size(struct arena_table *table, int arena_index, unsigned long long chunk) {
+    struct arena_heap *heap = find_arena_heap(table, chunk);
+    if (!heap || heap->arena_index != arena_index || chunk % (2 * sizeof(size_t)) != 0) {
+        return 0;
+    }
+    size_t size = ((const size_t *)(uintptr_t)chunk)[1] & ~(size_t)GLIBC_CHUNK_FLAGS;
+    unsigned long long heap_end = heap->arena_index == 0 ? heap->end_address : heap->start_address + heap->size;
+    if (size < 4 * sizeof(size_t) || chunk + size > heap_end) {
+        return 0;
+    }
+    return size;
+}
+
+static void count_free_chunk(struct arena_fragmentation *frag, enum bin_class bin_class, size_t size) {
+    frag->free_bytes[bin_class] += size;
+    frag->free_chunks[bin_class]++;
+    if (size > frag->largest_free) {
+        frag->largest_free = size;
+    }
+}
+
+/*
+ * Walks the fastbins and the unsorted, small and large bins of one arena.
+ * The arenas are quiet while the threads are parked after their workload,
+ * a list that does not check out is cut off instead of trusted, and no list
+ * is followed for more chunks than fit into the arena.
+ */
+static void walk_arena_bins(struct arena_table *table, int arena_index, struct glibc_malloc_state *state,
+                            struct arena_fragmentation *frag) {
+    size_t max_chunks = table->arenas[arena_index].heap_bytes / (4 * sizeof(size_t)) + 1;
+    int safe_linking = glibc_safe_linking();
+
+    for (int i = 0; i < GLIBC_NFASTBINS; i++) {
+        unsigned long long chunk = (unsigned long long)(uintptr_t)state->fastbins[i];
+        for (size_t n = 0; chunk && n < max_chunks; n++) {
+            size_t size = free_chunk_size(table, arena_index, chunk);
+            if (size == 0) {
+                break;
+            }
+            count_free_chunk(frag, BIN_FAST, size);
+            unsigned long long link = chunk + 2 * sizeof(size_t);
+            chunk = *(const unsigned long long *)(uintptr_t)link;
+            if (safe_linking) {
+                chunk ^= link >> 12;
+            }
+        }
+    }
+
+    // bin_at(i) in malloc.c: the fd/bk pair in bins[] is the link field of a fake chunk
+    for (int i = 1; i < GLIBC_NBINS; i++) {
+        unsigned long long bin = (unsigned long long)(uintptr_t)&state->bins[(i - 1) * 2] - 2 * sizeof(size_t);
+        enum bin_class bin_class = i == 1 ? BIN_UNSORTED : (i < GLIBC_NSMALLBINS ? BIN_SMALL : BIN_LARGE);
+        unsigned long long chunk = (unsigned long long)(uintptr_t)state->bins[(i - 1) * 2];
+        for (size_t n = 0; chunk != bin && n < max_chunks; n++) {
+            size_t size = free_chunk_size(table, arena_index, chunk);
+            if (size == 0) {
+                break;
+            }
+            count_free_chunk(frag, bin_class, size);
+            chunk = ((const unsigned long long *)(uintptr_t)chunk)[2];
+        }
+    }
+
+    unsigned long long top = (unsigned long long)(uintptr_t)state->top;
+    struct arena_heap *heap = find_arena_heap(table, top);
+    if (heap && heap->arena_index == arena_index) {
+        frag->top_bytes = ((const size_t *)(uintptr_t)top)[1] & ~(size_t)GLIBC_CHUNK_FLAGS;
+    }
+    frag->bins_walked = 1;
+    frag->valid = 1;
+}
+
+/*
+ * Fills in the fragmentation of every arena. The main arena is the one the
+ * ring of thread arenas points to that is not a thread arena; without any
+ * thread arena mallinfo2() describes the main arena alone and is used instead.
+ */
+static void analyze_arena_fragmentation(struct arena_table *table) {
+    struct glibc_malloc_state *main_state = NULL;
+    for (size_t a = 1; a < table->arena_count; a++) {
+        struct glibc_malloc_state *state = (struct glibc_malloc_state *)(uintptr_t)table->arenas[a].arena_address;
+        walk_arena_bins(table, (int)a, state, &table->arenas[a].fragmentation);
+        if (find_arena(table, (unsigned long long)(uintptr_t)state->next) < 0) {
+            main_state = state->next;
+        }
+    }
+
+    struct arena_fragmentation *frag = &table->arenas[0].fragmentation;
+    if (main_state) {
+        walk_arena_bins(table, 0, main_state, frag);
+    } else if (table->arena_count == 1) {
+        struct mallinfo2 mi = mallinfo2();
+        frag->free_bytes[BIN_FAST] = mi.fsmblks;
+        frag->free_chunks[BIN_FAST] = mi.smblks;
+        frag->free_bytes[BIN_SMALL] = mi.fordblks - mi.fsmblks - mi.keepcost;
+        frag->free_chunks[BIN_SMALL] = mi.ordblks > 0 ? mi.ordblks - 1 : 0;
+        frag->top_bytes = mi.keepcost;
+        frag->valid = 1;
+    }
+}
+
+/*
+ * Finds all glibc arenas of the calling process: the main arena from the brk
+ * [heap] mapping, every thread arena from the heap_info headers at the
+ * HEAP_MAX_SIZE aligned heap bases, grouped by the arena they point to.
+ */
+int scan_arenas(struct arena_table *table, struct pmap_entry *pmap_entries, int pmap_entry_count) {
+    memset(table, 0, sizeof(*table));
+    if (add_arena(table, 0) != 0) {
+        return -1;
+    }
+
+    table->heaps = malloc(sizeof(struct arena_heap) * (pmap_entry_count ? pmap_entry_count : 1));
+    if (!table->heaps) {
+        free_arena_table(table);
+        return -1;
+    }
+
+    /*
+     * Pass 0 takes the brk heap and the first heap of every arena, whose header
+     * proves the arena address. Pass 1 then only accepts further heaps pointing
+     * to one of those arenas, so no unverified arena pointer is ever followed.
+     */
+    for (int pass = 0; pass < 2; pass++) {
+        for (int m = 0; m < pmap_entry_count; m++) {
+            struct pmap_entry *p_entry = &pmap_entries[m];
+            struct arena_heap *heap = &table->heaps[table->heap_count];
+
+            if (p_entry->brk_heap) {
+                if (pass == 0) {
+                    heap->start_address = p_entry->start_address;
+                    heap->end_address = p_entry->end_address;
+                    heap->size = p_entry->end_address - p_entry->start_address;
+                    heap->prev_address = 0;
+                    heap->arena_index = 0;
+                    heap->ordinal = 1;
+                    table->heap_count++;
+                }
+                continue;
+            }
+
+            struct glibc_heap_info *h = heap_info_candidate(p_entry);
+            if (!h || is_first_heap(h) != (pass == 0)) {
+                continue;
+            }
+
+            unsigned long long arena_address = (unsigned long long)(uintptr_t)h->ar_ptr;
+            int a = find_arena(table, arena_address);
+            if (a < 0 && pass == 1) {
+                continue;
+            }
+            if (a < 0 && (a = add_arena(table, arena_address)) < 0) {
+                free_arena_table(table);
+                return -1;
+            }
+            heap->start_address = p_entry->start_address;
+            heap->end_address = p_entry->start_address + GLIBC_HEAP_MAX_SIZE;
+            heap->prev_address = (unsigned long long)(uintptr_t)h->prev;
+            heap->size = h->size;
+            heap->arena_index = a;
+            heap->ordinal = (pass == 0) ? 1 : 0;
+            table->heap_count++;
+        }
+    }
+    qsort(table->heaps, table->heap_count, sizeof(struct arena_heap), compare_arena_heaps);
+
+    // Follow the prev links to number the heaps in the order the arena grew
+    for (int changed = 1; changed; ) {
+        changed = 0;
+        for (size_t i = 0; i < table->heap_count; i++) {
+            struct arena_heap *heap = &table->heaps[i];
+            struct arena_heap *prev = heap->ordinal == 0 ? find_arena_heap(table, heap->prev_address) : NULL;
+            if (prev && prev->ordinal > 0) {
+                heap->ordinal = prev->ordinal + 1;
+                changed = 1;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < table->heap_count; i++) {
+        struct arena_info *arena = &table->arenas[table->heaps[i].arena_index];
+        arena->heap_count++;
+        arena->heap_bytes += table->heaps[i].size;
+    }
+
+    table->arenas[0].number = 0;
+    for (size_t a = 1; a < table->arena_count; a++) {
+        struct glibc_malloc_state *state = (struct glibc_malloc_state *)(uintptr_t)table->arenas[a].arena_address;
+        // system_mem of a thread arena is exactly the sum of its heap sizes
+        if (state->system_mem == table->arenas[a].heap_bytes) {
+            table->arenas[a].attached_threads = state->attached_threads;
+        }
+    }
+    number_arenas(table);
+    read_malloc_info_stats(table);
+    if (fragmentation_report) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        analyze_arena_fragmentation(table);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        table->fragmentation_seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    }
+    return 0;
+}
+
+/*
+ * Classifies arena heaps of another process from its maps alone: a thread
+ * arena heap is an anonymous rw mapping at a HEAP_MAX_SIZE aligned address
+ * whose reservation (rw part plus ---p tail) reaches up to the next boundary.
+ * Which heaps belong to the same arena can not be told without reading the
+ * process memory, so all of them are put into one group of thread heaps.
+ */
+int scan_arenas_from_maps(struct arena_table *table, struct pmap_entry *pmap_entries, int pmap_entry_count) {
+    memset(table, 0, sizeof(*table));
+    table->maps_only = 1;
+    if (add_arena(table, 0) < 0 || add_arena(table, 0) < 0) {
+        free_arena_table(table);
+        return -1;
+    }
+
+    table->heaps = malloc(sizeof(struct arena_heap) * (pmap_entry_count ? pmap_entry_count : 1));
+    if (!table->heaps) {
+        free_arena_table(table);
+        return -1;
+    }
+
+    for (int m = 0; m < pmap_entry_count; m++) {
+        struct pmap_entry *p_entry = &pmap_entries[m];
+        struct arena_heap *heap = &table->heaps[table->heap_count];
+        unsigned long long heap_end = p_entry->start_address + GLIBC_HEAP_MAX_SIZE;
+
+        if (!p_entry->brk_heap) {
+            if (p_entry->start_address % GLIBC_HEAP_MAX_SIZE != 0 || p_entry->r != 'r' || p_entry->w != 'w' ||
+                p_entry->mapping[0] != '[' || p_entry->end_address > heap_end) {
+                continue;
+            }
+            if (p_entry->end_address < heap_end) {
+                struct pmap_entry *p_tail = (m + 1 < pmap_entry_count) ? &pmap_entries[m + 1] : NULL;
+                if (!p_tail || p_tail->start_address != p_entry->end_address || p_tail->r != '-' ||
+                    p_tail->w != '-' || p_tail->end_address < heap_end) {
+                    continue;
+                }
+            }
+        }
+
+        heap->start_address = p_entry->start_address;
+        heap->end_address = p_entry->brk_heap ? p_entry->end_address : heap_end;
+        heap->prev_address = 0;
+        heap->size = p_entry->end_address - p_entry->start_address;
+        heap->arena_index = p_entry->brk_heap ? 0 : 1;
+        heap->ordinal = 0;
+        table->arenas[heap->arena_index].heap_count++;
+        table->arenas[heap->arena_index].heap_bytes += heap->size;
+        table->heap_count++;
+    }
+    table->arenas[0].number = 0;
+    return 0;
+}
+
+static int arena_display_number(struct arena_table *table, int arena_index) {
+    return table->arenas[arena_index].number >= 0 ? table->arenas[arena_index].number : arena_index;
+}
+
+// Arena headers can only be read in the own process, others are classified from the map layout
+// Older glibc lays malloc_state out differently, its arenas are only recognised from the map
+int scan_process_arenas(int pid, struct arena_table *table, struct pmap_entry *pmap_entries, int pmap_entry_count) {
+    if (pid == getpid() && read_arena_headers && glibc_at_least(2, 27)) {
+        return scan_arenas(table, pmap_entries, pmap_entry_count);
+    }
+    return scan_arenas_from_maps(table, pmap_entries, pmap_entry_count);
+}
+
+void print_arena_summary(struct arena_table *table, struct thread_info_entry *thread_entries, int thread_entry_count) {
+    printf("---------------- Arenas ---------------------------\n");
+    for (size_t a = 0; a < table->arena_count; a++) {
+        struct arena_info *arena = &table->arenas[a];
+        if (table->maps_only) {
+            printf("    %s: %zu heap(s), %zu kB mapped rw\n", a == 0 ? "Main arena" : "Thread arena heaps (arena unknown)",
+                   arena->heap_count, arena->heap_bytes / 1024);
+            continue;
+        }
+        if (a == 0) {
+            printf("    Arena 0 (main arena): %zu heap(s)", arena->heap_count);
+        } else {
+            printf("    Arena %d (0x%llx): %zu heap(s)", arena_display_number(table, (int)a),
+                   arena->arena_address, arena->heap_count);
+        }
+        if (arena->stats_valid) {
+            size_t in_use = arena->system_bytes > arena->free_bytes ? arena->system_bytes - arena->free_bytes : 0;
+            printf(", %zu kB system, %zu kB in use, %zu kB free", arena->system_bytes / 1024, in_use / 1024,
+                   arena->free_bytes / 1024);
+        }
+        if (a > 0 && arena->attached_threads > 0) {
+            printf(", %zu attached thread(s)", arena->attached_threads);
+        }
+        printf("\n");
+
+        for (size_t i = 0; i < table->heap_count; i++) {
+            if (table->heaps[i].arena_index == (int)a) {
+                printf("        Heap %d: [0x%llx - 0x%llx] (%zu kB in use)\n", table->heaps[i].ordinal,
+                       table->heaps[i].start_address, table->heaps[i].end_address, table->heaps[i].size / 1024);
+            }
+        }
+
+        int listed = 0;
+        for (int t = 0; t < thread_entry_count; t++) {
+            struct arena_heap *heap = find_arena_heap(table, thread_entries[t].arena_probe_address);
+            if (heap && heap->arena_index == (int)a) {
+                printf("%s%ld", listed++ ? ", " : "        Threads: ", thread_entries[t].thread_id);
+            }
+        }
+        if (listed) {
+            printf("\n");
+        }
+    }
+    printf("---------------------------------------------------\n");
+}
+
+/*
+ * Free but unreturnable memory per arena: the chunks held in the bins, which
+ * trimming can not give back as long as a chunk above them is in use, next
+ * to the top chunk, which it can. The fragmentation is the share of the
+ * arena below the top chunk that is free.
+ */
+void print_arena_fragmentation(struct arena_table *table) {
+    static const char *class_names[BIN_CLASSES] = { "fast", "unsorted", "small", "large" };
+    printf("---------------- Arena Fragmentation --------------\n");
+    for (size_t a = 0; a < table->arena_count; a++) {
+        struct arena_info *arena = &table->arenas[a];
+        struct arena_fragmentation *frag = &arena->fragmentation;
+        if (!frag->valid) {
+            printf("    Arena %d: bins not reachable\n", arena_display_number(table, (int)a));
+            continue;
+        }
+        size_t free_bytes = 0, free_chunks = 0;
+        for (int c = 0; c < BIN_CLASSES; c++) {
+            free_bytes += frag->free_bytes[c];
+            free_chunks += frag->free_chunks[c];
+        }
+        size_t system_bytes = arena->stats_valid ? arena->system_bytes : arena->heap_bytes;
+        size_t below_top = system_bytes > frag->top_bytes ? system_bytes - frag->top_bytes : 0;
+        printf("    Arena %d: %zu kB free in %zu chunks, top chunk %zu kB, fragmentation %.1f%%\n",
+               arena_display_number(table, (int)a), free_bytes / 1024, free_chunks, frag->top_bytes / 1024,
+               below_top ? 100.0 * (double)free_bytes / (double)below_top : 0.0);
+        if (!frag->bins_walked) {
+            printf("        fast %zu kB in %zu chunks, other bins %zu kB in %zu chunks (from mallinfo2)\n",
+                   frag->free_bytes[BIN_FAST] / 1024, frag->free_chunks[BIN_FAST], frag->free_bytes[BIN_SMALL] / 1024,
+                   frag->free_chunks[BIN_SMALL]);
+            continue;
+        }
+        printf("       ");
+        for (int c = 0; c < BIN_CLASSES; c++) {
+            printf(" %s %zu kB in %zu,", class_names[c], frag->free_bytes[c] / 1024, frag->free_chunks[c]);
+        }
+        printf(" largest free chunk %zu bytes\n", frag->largest_free);
+    }
+    printf("    Analyzed in %.0f us, chunks in the tcache of a thread count as in use\n",
+           table->fragmentation_seconds * 1e6);
+    printf("---------------------------------------------------\n");
+}
+
+/*
+ * Classifies a mapping that is part of an arena heap. Returns -1 if the
+ * mapping is not part of a heap, 1 if the heap ends with it, 0 otherwise.
+ */
+static int check_arena_heap(struct pmap_entry *p_current, struct arena_table *arenas, struct region_class *cls) {
+    struct arena_heap *heap = find_arena_heap(arenas, p_current->start_address);
+    if (!heap) {
+        // Adjacent anonymous mappings may have been merged with the heap start
+        heap = find_arena_heap(arenas, p_current->end_address - 1);
+    }
+    if (!heap) {
+        return -1;
+    }
+
+    cls->kind = heap->arena_index == 0 ? REGION_MAIN_HEAP : REGION_ARENA_HEAP;
+    cls->starts_region = heap->start_address >= p_current->start_address;
+    if (heap->arena_index > 0 && !arenas->maps_only) {
+        cls->arena = arena_display_number(arenas, heap->arena_index);
+        cls->heap_ordinal = heap->ordinal;
+        cls->heap_count = (int)arenas->arenas[heap->arena_index].heap_count;
+    }
+    return heap->end_address <= p_current->end_address;
+}
+
+/*
+ * Classifies p_current as heap, stack or other mapping. Returns 1 if the
+ * region ends with this mapping, so the text output closes it with a line.
+ */
+int check_pmap_entry_type(struct pmap_entry *p_current, struct pmap_entry *p_before, struct pmap_entry *p_after, struct thread_info_entry *thread_entries, struct attribution_index *index, struct arena_table *arenas, struct region_class *cls) {
+    memset(cls, 0, sizeof(*cls));
+    cls->kind = REGION_OTHER;
+    cls->thread_id = -1;
+    cls->arena = -1;
+
+    if (arenas && arenas->heap_count > 0) {
+        int ret = check_arena_heap(p_current, arenas, cls);
+        if (ret >= 0) {
+            return ret;
+        }
+    }
+
+    // Without smaps the brk heap can only be guessed from the address gap behind it
+    if (p_after && (!arenas || arenas->heap_count == 0 || arenas->heaps[0].arena_index != 0 ||
+                    !arenas->arenas[0].heap_count)) {
+        if (p_current->start_address + 0x200000000000 < p_after->start_address) {
+            cls->kind = REGION_MAIN_HEAP;
+            cls->starts_region = 1;
+            return 1;
+        }
+    }
+
+    if (!arenas || arenas->arena_count <= 1) {
+        if (p_after) {
+            // Thread Arena Check - Part 1
+            if (GLIBC_ARENA_SIZE_IN_KBYTES == p_current->kbytes + p_after->kbytes && p_current->r == 'r') {
+                cls->kind = REGION_ARENA_HEAP;
+                cls->starts_region = 1;
+                return 0;
+            }
+        }
+
+        if (p_before) {
+            // Thread Arena Check - Part 2
+            if (GLIBC_ARENA_SIZE_IN_KBYTES == p_current->kbytes + p_before->kbytes && p_current->r == '-') {
+                cls->kind = REGION_ARENA_HEAP;
+                return 1;
+            }
+        }
+    }
+
+    // Thread Stack Check
+    for (size_t i = 0; i < index->match_count; i++) {
+        if (index->matches[i]->malloc_index < 0) {
+            cls->kind = REGION_THREAD_STACK;
+            cls->starts_region = 1;
+            cls->thread_id = thread_entries[index->matches[i]->thread_index].thread_id;
+            return 1;
+        }
+    }
+
+    // Attached processes: an anonymous rw mapping right behind a guard mapping is a stack of an unknown thread
+    if (arenas && arenas->maps_only && p_before && p_before->end_address == p_current->start_address &&
+        p_before->r == '-' && p_before->w == '-' && p_before->x == '-' && p_before->mapping[0] == '[' &&
+        p_current->r == 'r' && p_current->w == 'w' && p_current->mapping[0] == '[') {
+        cls->kind = REGION_THREAD_STACK;
+        cls->starts_region = 1;
+        return 1;
+    }
+    return 0;
+}
+
+void print_region_banner(const struct region_class *cls) {
+    switch (cls->kind) {
+        case REGION_MAIN_HEAP:
+            printf("---------------- Main Thread - HEAP ---------------\n");
+            break;
+        case REGION_ARENA_HEAP:
+            if (cls->arena < 0) {
+                printf("---------------- Thread Arena - HEAP --------------\n");
+                break;
+            }
+            printf("---------------- Thread Arena %d - HEAP", cls->arena);
+            if (cls->heap_count > 1) {
+                printf(" %d/%d", cls->heap_ordinal, cls->heap_count);
+            }
+            printf(" --------------\n");
+            break;
+        case REGION_THREAD_STACK:
+            if (cls->thread_id < 0) {
+                printf("---------------- Thread ? - STACK ---------------\n");
+            } else {
+                printf("---------------- Thread %ld - STACK ---------------\n", cls->thread_id);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static const char *region_kind_name(enum region_kind kind) {
+    switch (kind) {
+        case REGION_MAIN_HEAP:
+            return "main_heap";
+        case REGION_ARENA_HEAP:
+            return "arena_heap";
+        case REGION_THREAD_STACK:
+            return "thread_stack";
+        default:
+            return "other";
+    }
+}
+
+void print_pmap_entry(struct pmap_entry p_entry) {
+    printf("%llx %8d %8d %8d %c%c%c %s",
+           p_entry.start_address,
+           p_entry.kbytes,
+           p_entry.rss,
+           p_entry.dirty,
+           p_entry.r,
+           p_entry.w,
+           p_entry.x,
+           p_entry.mapping);
+    if (p_entry.anon_huge_pages > 0) {
+        printf(" [THP %d kB]", p_entry.anon_huge_pages);
+    }
+    printf("\n");
+}
+
+void print_stack_entry(struct thread_info_entry *thread_entry) {
+    printf("    Thread %ld (TID: %d)", thread_entry->thread_id, thread_entry->tid);
+    printf(" - Stack: [0x%llx - 0x%llx] (size: %zu bytes)\n", 
+           thread_entry->stack_start_address, 
+           thread_entry->stack_end_address, 
+           thread_entry->stack_size);
+}
+
+void print_malloc_entry(struct thread_info_entry *thread_entry, size_t j) {
+    printf("    Thread %ld (TID: %d)", thread_entry->thread_id, thread_entry->tid);
+    size_t alloc_size = thread_entry->malloc_info_entries[j].malloc_size;
+    printf(" - Malloc #%ld: [0x%llx - 0x%llx] (size: %zu bytes)\n",
+           j+1,
+           thread_entry->malloc_info_entries[j].malloc_start_address,
+           thread_entry->malloc_info_entries[j].malloc_end_address,
+           alloc_size);
+}
+
+/*
+ * Per page state of a mapping from /proc/<pid>/pagemap, and /proc/kpageflags
+ * where readable (root only, without it pagemap hides the PFNs). pagemap is
+ * read PAGEMAP_BATCH_PAGES entries per pread, kpageflags once per run of
+ * physically contiguous pages.
+ */
+struct page_scanner {
+    int pagemap_fd;
+    int kpageflags_fd; // -1 if not readable, THP and zero pages are then counted as resident
+    size_t page_size;
+    uint64_t entries[PAGEMAP_BATCH_PAGES];
+    uint64_t flags[PAGEMAP_BATCH_PAGES];
+};
+
+enum page_state {
+    PAGE_UNTOUCHED,
+    PAGE_RESIDENT,
+    PAGE_THP,
+    PAGE_ZERO,
+    PAGE_SWAPPED,
+    PAGE_STATE_COUNT
+};
+
+static const char page_state_chars[PAGE_STATE_COUNT] = {
+    [PAGE_UNTOUCHED] = '.',
+    [PAGE_RESIDENT] = 'r',
+    [PAGE_THP] = 'H',
+    [PAGE_ZERO] = 'z',
+    [PAGE_SWAPPED] = 's',
+};
+
+struct page_scanner *open_page_scanner(int pid) {
+    char path[64];
+    struct page_scanner *scanner = malloc(sizeof(struct page_scanner));
+    if (!scanner) {
+        fprintf(stderr, "Malloc page scanner failed!\n");
+        return NULL;
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/pagemap", pid);
+    scanner->pagemap_fd = open(path, O_RDONLY);
+    if (scanner->pagemap_fd < 0) {
+        perror(path);
+        free(scanner);
+        return NULL;
+    }
+    scanner->kpageflags_fd = open("/proc/kpageflags", O_RDONLY);
+    scanner->page_size = (size_t)sysconf(_SC_PAGESIZE);
+    return scanner;
+}
+
+void close_page_scanner(struct page_scanner *scanner) {
+    close(scanner->pagemap_fd);
+    if (scanner->kpageflags_fd >= 0) {
+        close(scanner->kpageflags_fd);
+    }
+    free(scanner);
+}
+
+static void read_page_flags(struct page_scanner *scanner, size_t count) {
+    memset(scanner->flags, 0, sizeof(uint64_t) * count);
+    if (scanner->kpageflags_fd < 0) {
+        return;
+    }
+
+    size_t i = 0;
+    while (i < count) {
+        uint64_t pfn = scanner->entries[i] & PAGEMAP_PFN_MASK;
+        if (!(scanner->entries[i] & PAGEMAP_PRESENT) || pfn == 0) {
+            i++;
+            continue;
+        }
+        size_t run = 1;
+        while (i + run < count && (scanner->entries[i + run] & PAGEMAP_PRESENT) &&
+               (scanner->entries[i + run] & PAGEMAP_PFN_MASK) == pfn + run) {
+            run++;
+        }
+        if (pread(scanner->kpageflags_fd, &scanner->flags[i], run * sizeof(uint64_t),
+                  (off_t)(pfn * sizeof(uint64_t))) != (ssize_t)(run * sizeof(uint64_t))) {
+            memset(&scanner->flags[i], 0, run * sizeof(uint64_t));
+        }
+        i += run;
+    }
+}
+
+static enum page_state page_state_of(uint64_t entry, uint64_t flags) {
+    if (entry & PAGEMAP_PRESENT) {
+        if (flags & (1ULL << KPF_ZERO_PAGE))
+            return PAGE_ZERO;
+        if (flags & (1ULL << KPF_THP))
+            return PAGE_THP;
+        return PAGE_RESIDENT;
+    }
+    if (entry & PAGEMAP_SWAPPED)
+        return PAGE_SWAPPED;
+    return PAGE_UNTOUCHED;
+}
+
+static void print_page_run(enum page_state state, size_t length, size_t *runs) {
+    if (length == 0) {
+        return;
+    }
+    if (++(*runs) <= PAGE_MAP_MAX_RUNS) {
+        printf(" %c%zu", page_state_chars[state], length);
+    }
+}
+
+/*
+ * Prints the page states of a mapping, low to high address, as counts and a
+ * run-length summary ("r3 .2045" = 3 resident, then 2045 untouched pages).
+ * In PAGE_MAP_FULL mode every page is printed as one character as well.
+ */
+void print_page_map(struct page_scanner *scanner, const struct pmap_entry *p_entry) {
+    size_t page_count = (size_t)(p_entry->end_address - p_entry->start_address) / scanner->page_size;
+    size_t counts[PAGE_STATE_COUNT] = { 0 };
+    char *states = NULL;
+    if (page_map_mode == PAGE_MAP_FULL) {
+        states = malloc(page_count ? page_count : 1);
+    }
+
+    printf("        Runs:");
+    enum page_state run_state = PAGE_UNTOUCHED;
+    size_t run_length = 0, runs = 0;
+    off_t offset = (off_t)(p_entry->start_address / scanner->page_size * sizeof(uint64_t));
+    for (size_t done = 0; done < page_count;) {
+        size_t batch = page_count - done < PAGEMAP_BATCH_PAGES ? page_count - done : PAGEMAP_BATCH_PAGES;
+        ssize_t len = pread(scanner->pagemap_fd, scanner->entries, batch * sizeof(uint64_t), offset);
+        if (len <= 0) {
+            // Unreadable (e.g. vsyscall), count the rest as untouched
+            memset(scanner->entries, 0, batch * sizeof(uint64_t));
+        } else {
+            batch = (size_t)len / sizeof(uint64_t);
+        }
+        read_page_flags(scanner, batch);
+
+        for (size_t i = 0; i < batch; i++) {
+            enum page_state state = page_state_of(scanner->entries[i], scanner->flags[i]);
+            counts[state]++;
+            if (states) {
+                states[done + i] = page_state_chars[state];
+            }
+            if (state != run_state) {
+                print_page_run(run_state, run_length, &runs);
+                run_state = state;
+                run_length = 0;
+            }
+            run_length++;
+        }
+        done += batch;
+        offset += (off_t)(batch * sizeof(uint64_t));
+    }
+    print_page_run(run_state, run_length, &runs);
+    if (runs > PAGE_MAP_MAX_RUNS) {
+        printf(" ... (%zu runs)", runs);
+    }
+    printf("\n");
+
+    printf("        Pages: %zu resident, %zu thp, %zu zero, %zu swapped, %zu untouched\n", counts[PAGE_RESIDENT],
+           counts[PAGE_THP], counts[PAGE_ZERO], counts[PAGE_SWAPPED], counts[PAGE_UNTOUCHED]);
+
+    if (states) {
+        for (size_t row = 0; row < page_count; row += PAGE_MAP_ROW_PAGES) {
+            size_t n = page_count - row < PAGE_MAP_ROW_PAGES ? page_count - row : PAGE_MAP_ROW_PAGES;
+            printf("        %llx %.*s\n", p_entry->start_address + row * scanner->page_size, (int)n, states + row);
+        }
+        free(states);
+    }
+}
+
+void create_output(struct pmap_entry *pmap_entries, int pmap_entry_count, struct thread_info_entry *thread_entries, int thread_entry_count, struct arena_table *arenas, struct page_scanner *pages) {
+    struct attribution_index index;
+    if (build_attribution_index(&index, thread_entries, thread_entry_count) != 0) {
+        return;
+    }
+
+    printf("%-12s %8s %8s %8s %s%s%s %s\n",
+           "Address", "Kbytes", "RSS", "Dirty", "R", "W", "X", "Mapping");
+    printf("---------------------------------------------------\n");
+    for (int m = 0; m < pmap_entry_count; m++) {
+        struct pmap_entry *p_current = &pmap_entries[m];
+        struct pmap_entry *p_before = NULL;
+        struct pmap_entry *p_after = NULL;
+        int endline_needed = 0;
+
+        if (m + 1 < pmap_entry_count)
+            p_after = &pmap_entries[m+1];
+        if (m - 1 > 0)
+            p_before = &pmap_entries[m-1];
+
+        if (query_attribution_index(&index, p_current->start_address, p_current->end_address) != 0) {
+            break;
+        }
+
+        struct region_class cls;
+        endline_needed = check_pmap_entry_type(p_current, p_before, p_after, thread_entries, &index, arenas, &cls);
+        if (cls.starts_region) {
+            print_region_banner(&cls);
+        }
+
+        print_pmap_entry(*p_current);
+
+        for (size_t i = 0; i < index.match_count; i++) {
+            const struct attribution_record *rec = index.matches[i];
+            if (rec->malloc_index < 0) {
+                print_stack_entry(&thread_entries[rec->thread_index]);
+            } else {
+                print_malloc_entry(&thread_entries[rec->thread_index], (size_t)rec->malloc_index);
+            }
+        }
+        if (pages && (cls.kind != REGION_OTHER || index.match_count > 0)) {
+            print_page_map(pages, p_current);
+        }
+
+        if (endline_needed) {
+            printf("---------------------------------------------------\n");
+        }
+    }
+
+    free_attribution_index(&index);
+}
+
+/*
+ * Classifies every mapping the way create_output() does, for the summaries
+ * that group the map by region. classes has room for pmap_entry_count.
+ */
+int classify_pmap_entries(struct pmap_entry *pmap_entries, int pmap_entry_count, struct thread_info_entry *thread_entries,
+                          int thread_entry_count, struct arena_table *arenas, struct region_class *classes) {
+    struct attribution_index index;
+    if (build_attribution_index(&index, thread_entries, thread_entry_count) != 0) {
+        return -1;
+    }
+    for (int m = 0; m < pmap_entry_count; m++) {
+        struct pmap_entry *p_current = &pmap_entries[m];
+        if (query_attribution_index(&index, p_current->start_address, p_current->end_address) != 0) {
+            free_attribution_index(&index);
+            return -1;
+        }
+        check_pmap_entry_type(p_current, m > 0 ? &pmap_entries[m - 1] : NULL,
+                              m + 1 < pmap_entry_count ? &pmap_entries[m + 1] : NULL, thread_entries, &index, arenas,
+                              &classes[m]);
+    }
+    free_attribution_index(&index);
+    return 0;
+}
+
+void print_pmap_totals(struct pmap_entry *pmap_entries, int pmap_entry_count, int pid) {
+    long long total_kbytes = 0, total_rss = 0, total_dirty = 0;
+    for (int m = 0; m < pmap_entry_count; m++) {
+        total_kbytes += pmap_entries[m].kbytes;
+        total_rss += pmap_entries[m].rss;
+        total_dirty += pmap_entries[m].dirty;
+    }
+
+    printf("---------------------------------------------------\n");
+    printf("%-12s %8lld %8lld %8lld\n", "total kB", total_kbytes, total_rss, total_dirty);
+
+    struct smaps_counters rollup;
+    if (read_smaps_rollup(pid, &rollup) == 0) {
+        printf("Pss: %d kB, Swap: %d kB, AnonHugePages: %d kB, Shared_Dirty: %d kB, Private_Dirty: %d kB\n",
+               rollup.pss, rollup.swap, rollup.anon_huge_pages, rollup.shared_dirty, rollup.private_dirty);
+    }
+}
+
+/*
+ * Buffered writer for the machine readable report. Everything is formatted
+ * straight into one large buffer which is handed to write() when full, so a
+ * map with many thousand mappings and malloc records costs a few syscalls
+ * and no stdio call per field.
+ */
+struct output_writer {
+    int fd;
+    int failed;
+    size_t length;
+    char buffer[OUTPUT_BUFFER_SIZE];
+};
+
+static void writer_flush(struct output_writer *w) {
+    size_t done = 0;
+    while (done < w->length && !w->failed) {
+        ssize_t n = write(w->fd, w->buffer + done, w->length - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write report");
+            w->failed = 1;
+            break;
+        }
+        done += (size_t)n;
+    }
+    w->length = 0;
+}
+
+static char *writer_reserve(struct output_writer *w, size_t n) {
+    if (w->length + n > OUTPUT_BUFFER_SIZE) {
+        writer_flush(w);
+    }
+    return w->buffer + w->length;
+}
+
+static void writer_put(struct output_writer *w, const void *data, size_t n) {
+    memcpy(writer_reserve(w, n), data, n);
+    w->length += n;
+}
+
+static void writer_puts(struct output_writer *w, const char *s) {
+    writer_put(w, s, strlen(s));
+}
+
+static void writer_putc(struct output_writer *w, char c) {
+    *writer_reserve(w, 1) = c;
+    w->length++;
+}
+
+static void writer_put_unsigned(struct output_writer *w, unsigned long long value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+
+    char *p = writer_reserve(w, (size_t)n);
+    for (int i = 0; i < n; i++) {
+        p[i] = digits[n - 1 - i];
+    }
+    w->length += (size_t)n;
+}
+
+static void writer_put_signed(struct output_writer *w, long long value) {
+    if (value < 0) {
+        writer_putc(w, '-');
+        writer_put_unsigned(w, 0ULL - (unsigned long long)value);
+    } else {
+        writer_put_unsigned(w, (unsigned long long)value);
+    }
+}
+
+static void writer_put_hex(struct output_writer *w, unsigned long long value) {
+    static const char hex[] = "0123456789abcdef";
+    char digits[16];
+    int n = 0;
+    do {
+        digits[n++] = hex[value & 0xf];
+        value >>= 4;
+    } while (value);
+
+    char *p = writer_reserve(w, (size_t)n + 2);
+    *p++ = '0';
+    *p++ = 'x';
+    for (int i = 0; i < n; i++) {
+        p[i] = digits[n - 1 - i];
+    }
+    w->length += (size_t)n + 2;
+}
+
+// LEB128, small counters and address deltas take one or two bytes
+static void writer_put_varint(struct output_writer *w, unsigned long long value) {
+    char *p = writer_reserve(w, 10);
+    size_t n = 0;
+    while (value >= 0x80) {
+        p[n++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    p[n++] = (char)value;
+    w->length += n;
+}
+
+static void writer_put_zigzag(struct output_writer *w, long long value) {
+    writer_put_varint(w, ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63));
+}
+
+static void writer_put_json_string(struct output_writer *w, const char *s) {
+    writer_putc(w, '"');
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            writer_putc(w, '\\');
+            writer_putc(w, (char)c);
+        } else if (c < 0x20) {
+            static const char hex[] = "0123456789abcdef";
+            char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+            writer_put(w, esc, sizeof(esc));
+        } else {
+            writer_putc(w, (char)c);
+        }
+    }
+    writer_putc(w, '"');
+}
+
+static void writer_put_csv_string(struct output_writer *w, const char *s) {
+    writer_putc(w, '"');
+    for (; *s; s++) {
+        if (*s == '"') {
+            writer_putc(w, '"');
+        }
+        writer_putc(w, *s);
+    }
+    writer_putc(w, '"');
+}
+
+// Starts a report in output_format on fd, which close_output_writer() closes unless it is stdout
+struct output_writer *new_output_writer(int fd) {
+    struct output_writer *w = malloc(sizeof(struct output_writer));
+    if (!w) {
+        fprintf(stderr, "Malloc output writer failed!\n");
+        return NULL;
+    }
+    w->failed = 0;
+    w->length = 0;
+    w->fd = fd;
+    if (fd == STDOUT_FILENO) {
+        // Keep the order with anything printed through stdio before
+        fflush(stdout);
+    }
+
+    if (output_format == OUTPUT_CSV) {
+        writer_puts(w, "record,snapshot,start,end,kbytes,rss,dirty,pss,swap,anon_huge_pages,perms,mapping,kind,"
+                       "thread,tid,arena,index,size\n");
+    } else if (output_format == OUTPUT_BINARY) {
+        writer_put(w, REPORT_BINARY_MAGIC, 4);
+        writer_putc(w, REPORT_BINARY_VERSION);
+    }
+    return w;
+}
+
+struct output_writer *open_output_writer(void) {
+    int fd = STDOUT_FILENO;
+    if (output_path && (fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        perror(output_path);
+        return NULL;
+    }
+    struct output_writer *w = new_output_writer(fd);
+    if (!w && fd != STDOUT_FILENO) {
+        close(fd);
+    }
+    return w;
+}
+
+int close_output_writer(struct output_writer *w) {
+    writer_flush(w);
+    int ret = w->failed ? -1 : 0;
+    if (w->fd != STDOUT_FILENO && close(w->fd) != 0) {
+        perror("close report");
+        ret = -1;
+    }
+    free(w);
+    return ret;
+}
+
+static int report_on_stdout(void) {
+    return output_format != OUTPUT_TEXT && output_path == NULL;
+}
+
+static void write_report_owner(struct output_writer *w, const struct thread_info_entry *thread_entry,
+                               long malloc_index, unsigned long long mapping_start, unsigned long snapshot) {
+    unsigned long long start = thread_entry->stack_start_address;
+    unsigned long long end = thread_entry->stack_end_address;
+    size_t size = thread_entry->stack_size;
+    if (malloc_index >= 0) {
+        start = thread_entry->malloc_info_entries[malloc_index].malloc_start_address;
+        end = thread_entry->malloc_info_entries[malloc_index].malloc_end_address;
+        size = thread_entry->malloc_info_entries[malloc_index].malloc_size;
+    }
+
+    switch (output_format) {
+        case OUTPUT_JSON:
+            writer_puts(w, malloc_index < 0 ? "{\"type\":\"stack\",\"thread\":" : "{\"type\":\"malloc\",\"thread\":");
+            writer_put_signed(w, thread_entry->thread_id);
+            writer_puts(w, ",\"tid\":");
+            writer_put_signed(w, thread_entry->tid);
+            if (malloc_index >= 0) {
+                writer_puts(w, ",\"index\":");
+                writer_put_unsigned(w, (unsigned long long)malloc_index + 1);
+            }
+            writer_puts(w, ",\"start\":\"");
+            writer_put_hex(w, start);
+            writer_puts(w, "\",\"end\":\"");
+            writer_put_hex(w, end);
+            writer_puts(w, "\",\"size\":");
+            writer_put_unsigned(w, size);
+            writer_putc(w, '}');
+            break;
+        case OUTPUT_CSV:
+            writer_puts(w, malloc_index < 0 ? "stack," : "malloc,");
+            writer_put_unsigned(w, snapshot);
+            writer_putc(w, ',');
+            writer_put_hex(w, start);
+            writer_putc(w, ',');
+            writer_put_hex(w, end);
+            writer_puts(w, ",,,,,,,,,,");
+            writer_put_signed(w, thread_entry->thread_id);
+            writer_putc(w, ',');
+            writer_put_signed(w, thread_entry->tid);
+            writer_puts(w, ",,");
+            if (malloc_index >= 0) {
+                writer_put_unsigned(w, (unsigned long long)malloc_index + 1);
+            }
+            writer_putc(w, ',');
+            writer_put_unsigned(w, size);
+            writer_putc(w, '\n');
+            break;
+        case OUTPUT_BINARY:
+            writer_putc(w, malloc_index < 0 ? 's' : 'a');
+            writer_put_varint(w, (unsigned long long)thread_entry->thread_id);
+            writer_put_varint(w, (unsigned long long)thread_entry->tid);
+            if (malloc_index >= 0) {
+                writer_put_varint(w, (unsigned long long)malloc_index + 1);
+            }
+            writer_put_zigzag(w, (long long)(start - mapping_start));
+            writer_put_varint(w, size);
+            break;
+        default:
+            break;
+    }
+}
+
+static void write_report_mapping(struct output_writer *w, const struct pmap_entry *p_entry,
+                                 const struct region_class *cls, unsigned long long previous_end,
+                                 unsigned long snapshot, int first) {
+    char perms[4] = { p_entry->r, p_entry->w, p_entry->x, '\0' };
+
+    switch (output_format) {
+        case OUTPUT_JSON:
+            writer_puts(w, first ? "{\"start\":\"" : ",{\"start\":\"");
+            writer_put_hex(w, p_entry->start_address);
+            writer_puts(w, "\",\"end\":\"");
+            writer_put_hex(w, p_entry->end_address);
+            writer_puts(w, "\",\"kbytes\":");
+            writer_put_signed(w, p_entry->kbytes);
+            writer_puts(w, ",\"rss\":");
+            writer_put_signed(w, p_entry->rss);
+            writer_puts(w, ",\"dirty\":");
+            writer_put_signed(w, p_entry->dirty);
+            writer_puts(w, ",\"pss\":");
+            writer_put_signed(w, p_entry->pss);
+            writer_puts(w, ",\"swap\":");
+            writer_put_signed(w, p_entry->swap);
+            writer_puts(w, ",\"anon_huge_pages\":");
+            writer_put_signed(w, p_entry->anon_huge_pages);
+            writer_puts(w, ",\"perms\":\"");
+            writer_puts(w, perms);
+            writer_puts(w, "\",\"mapping\":");
+            writer_put_json_string(w, p_entry->mapping);
+            writer_puts(w, ",\"kind\":\"");
+            writer_puts(w, region_kind_name(cls->kind));
+            writer_putc(w, '"');
+            if (cls->thread_id >= 0) {
+                writer_puts(w, ",\"thread\":");
+                writer_put_signed(w, cls->thread_id);
+            }
+            if (cls->arena >= 0) {
+                writer_puts(w, ",\"arena\":");
+                writer_put_signed(w, cls->arena);
+            }
+            writer_puts(w, ",\"owners\":[");
+            break;
+        case OUTPUT_CSV:
+            writer_puts(w, "mapping,");
+            writer_put_unsigned(w, snapshot);
+            writer_putc(w, ',');
+            writer_put_hex(w, p_entry->start_address);
+            writer_putc(w, ',');
+            writer_put_hex(w, p_entry->end_address);
+            writer_putc(w, ',');
+            writer_put_signed(w, p_entry->kbytes);
+            writer_putc(w, ',');
+            writer_put_signed(w, p_entry->rss);
+            writer_putc(w, ',');
+            writer_put_signed(w, p_entry->dirty);
+            writer_putc(w, ',');
+            writer_put_signed(w, p_entry->pss);
+            writer_putc(w, ',');
+            writer_put_signed(w, p_entry->swap);
+            writer_putc(w, ',');
+            writer_put_signed(w, p_entry->anon_huge_pages);
+            writer_putc(w, ',');
+            writer_puts(w, perms);
+            writer_putc(w, ',');
+            writer_put_csv_string(w, p_entry->mapping);
+            writer_putc(w, ',');
+            writer_puts(w, region_kind_name(cls->kind));
+            writer_putc(w, ',');
+            if (cls->thread_id >= 0) {
+                writer_put_signed(w, cls->thread_id);
+            }
+            writer_puts(w, ",,");
+            if (cls->arena >= 0) {
+                writer_put_signed(w, cls->arena);
+            }
+            writer_puts(w, ",,\n");
+            break;
+        case OUTPUT_BINARY: {
+            size_t name_len = strlen(p_entry->mapping);
+            writer_putc(w, 'M');
+            writer_put_varint(w, (p_entry->start_address - previous_end) >> 12);
+            writer_put_varint(w, (p_entry->end_address - p_entry->start_address) >> 12);
+            writer_put_varint(w, (unsigned long long)p_entry->rss);
+            writer_put_varint(w, (unsigned long long)p_entry->dirty);
+            writer_put_varint(w, (unsigned long long)p_entry->pss);
+            writer_put_varint(w, (unsigned long long)p_entry->swap);
+            writer_put_varint(w, (unsigned long long)p_entry->anon_huge_pages);
+            writer_putc(w, (char)((p_entry->r == 'r' ? 4 : 0) | (p_entry->w == 'w' ? 2 : 0) |
+                                  (p_entry->x == 'x' ? 1 : 0) | (p_entry->brk_heap ? 8 : 0)));
+            writer_putc(w, (char)cls->kind);
+            writer_put_zigzag(w, cls->thread_id);
+            writer_put_zigzag(w, cls->arena);
+            writer_put_varint(w, name_len);
+            writer_put(w, p_entry->mapping, name_len);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void write_report_totals(struct output_writer *w, struct pmap_entry *pmap_entries, int pmap_entry_count,
+                                int pid, unsigned long snapshot) {
+    long long totals[3] = { 0, 0, 0 };
+    for (int m = 0; m < pmap_entry_count; m++) {
+        totals[0] += pmap_entries[m].kbytes;
+        totals[1] += pmap_entries[m].rss;
+        totals[2] += pmap_entries[m].dirty;
+    }
+    struct smaps_counters rollup;
+    if (read_smaps_rollup(pid, &rollup) != 0) {
+        memset(&rollup, 0, sizeof(rollup));
+    }
+    long long rollup_values[5] = { rollup.pss, rollup.swap, rollup.anon_huge_pages, rollup.shared_dirty,
+                                   rollup.private_dirty };
+    static const char *const names[8] = { "kbytes", "rss", "dirty", "pss", "swap", "anon_huge_pages",
+                                          "shared_dirty", "private_dirty" };
+
+    switch (output_format) {
+        case OUTPUT_JSON:
+            writer_puts(w, "],\"totals\":{");
+            for (int i = 0; i < 8; i++) {
+                writer_puts(w, i ? ",\"" : "\"");
+                writer_puts(w, names[i]);
+                writer_puts(w, "\":");
+                writer_put_signed(w, i < 3 ? totals[i] : rollup_values[i - 3]);
+            }
+            writer_putc(w, '}');
+            break;
+        case OUTPUT_CSV:
+            writer_puts(w, "total,");
+            writer_put_unsigned(w, snapshot);
+            writer_puts(w, ",,");
+            for (int i = 0; i < 6; i++) {
+                writer_putc(w, ',');
+                writer_put_signed(w, i < 3 ? totals[i] : rollup_values[i - 3]);
+            }
+            writer_puts(w, ",,,,,,,,\n");
+            break;
+        case OUTPUT_BINARY:
+            writer_putc(w, 'T');
+            for (int i = 0; i < 8; i++) {
+                writer_put_varint(w, (unsigned long long)(i < 3 ? totals[i] : rollup_values[i - 3]));
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void write_report_fragmentation(struct output_writer *w, const struct arena_fragmentation *frag) {
+    static const char *class_names[BIN_CLASSES] = { "fast", "unsorted", "small", "large" };
+    writer_puts(w, ",\"fragmentation\":{\"top_bytes\":");
+    writer_put_unsigned(w, frag->top_bytes);
+    if (frag->bins_walked) {
+        writer_puts(w, ",\"largest_free\":");
+        writer_put_unsigned(w, frag->largest_free);
+    }
+    for (int c = 0; c < BIN_CLASSES; c++) {
+        if (!frag->bins_walked && (c == BIN_UNSORTED || c == BIN_LARGE)) {
+            continue;
+        }
+        writer_puts(w, ",\"");
+        writer_puts(w, class_names[c]);
+        writer_puts(w, "\":{\"bytes\":");
+        writer_put_unsigned(w, frag->free_bytes[c]);
+        writer_puts(w, ",\"chunks\":");
+        writer_put_unsigned(w, frag->free_chunks[c]);
+        writer_putc(w, '}');
+    }
+    writer_putc(w, '}');
+}
+
+static void write_report_arenas(struct output_writer *w, struct arena_table *arenas) {
+    if (output_format == OUTPUT_JSON) {
+        writer_puts(w, ",\"arenas\":[");
+    }
+    for (size_t a = 0; arenas && a < arenas->arena_count; a++) {
+        struct arena_info *arena = &arenas->arenas[a];
+        int number = arenas->maps_only && a > 0 ? -1 : arena_display_number(arenas, (int)a);
+        if (output_format == OUTPUT_JSON) {
+            writer_puts(w, a ? ",{\"arena\":" : "{\"arena\":");
+            writer_put_signed(w, number);
+            writer_puts(w, ",\"address\":\"");
+            writer_put_hex(w, arena->arena_address);
+            writer_puts(w, "\",\"heaps\":");
+            writer_put_unsigned(w, arena->heap_count);
+            writer_puts(w, ",\"heap_bytes\":");
+            writer_put_unsigned(w, arena->heap_bytes);
+            if (arena->stats_valid) {
+                writer_puts(w, ",\"system_bytes\":");
+                writer_put_unsigned(w, arena->system_bytes);
+                writer_puts(w, ",\"free_bytes\":");
+                writer_put_unsigned(w, arena->free_bytes);
+            }
+            if (arena->fragmentation.valid) {
+                write_report_fragmentation(w, &arena->fragmentation);
+            }
+            writer_puts(w, ",\"attached_threads\":");
+            writer_put_unsigned(w, arena->attached_threads);
+            writer_putc(w, '}');
+        } else if (output_format == OUTPUT_BINARY) {
+            writer_putc(w, 'R');
+            writer_put_zigzag(w, number);
+            writer_put_varint(w, arena->arena_address);
+            writer_put_varint(w, arena->heap_count);
+            writer_put_varint(w, arena->heap_bytes);
+            writer_put_varint(w, arena->stats_valid ? arena->system_bytes : 0);
+            writer_put_varint(w, arena->stats_valid ? arena->free_bytes : 0);
+            writer_put_varint(w, arena->attached_threads);
+        }
+    }
+    if (output_format == OUTPUT_JSON) {
+        writer_putc(w, ']');
+    }
+}
+
+/*
+ * Writes one snapshot in the selected machine readable format: every mapping
+ * with its classification and owners, the totals and the arenas. JSON is one
+ * object per line, CSV one row per mapping/stack/malloc plus a total row
+ * (arenas only show up in the arena column). The binary records are described
+ * in the README.
+ */
+int write_report(struct output_writer *w, int pid, unsigned long snapshot, unsigned long long elapsed_ms,
+                 struct pmap_entry *pmap_entries, int pmap_entry_count,
+                 struct thread_info_entry *thread_entries, int thread_entry_count, struct arena_table *arenas) {
+    struct attribution_index index;
+    if (build_attribution_index(&index, thread_entries, thread_entry_count) != 0) {
+        return -1;
+    }
+
+    if (output_format == OUTPUT_JSON) {
+        writer_puts(w, "{\"pid\":");
+        writer_put_signed(w, pid);
+        writer_puts(w, ",\"snapshot\":");
+        writer_put_unsigned(w, snapshot);
+        writer_puts(w, ",\"elapsed_ms\":");
+        writer_put_unsigned(w, elapsed_ms);
+        writer_puts(w, ",\"mappings\":[");
+    } else if (output_format == OUTPUT_BINARY) {
+        writer_putc(w, 'S');
+        writer_put_varint(w, (unsigned long long)pid);
+        writer_put_varint(w, snapshot);
+        writer_put_varint(w, elapsed_ms);
+        writer_put_varint(w, (unsigned long long)pmap_entry_count);
+    }
+
+    unsigned long long previous_end = 0;
+    for (int m = 0; m < pmap_entry_count; m++) {
+        struct pmap_entry *p_current = &pmap_entries[m];
+        struct pmap_entry *p_before = m > 0 ? &pmap_entries[m - 1] : NULL;
+        struct pmap_entry *p_after = m + 1 < pmap_entry_count ? &pmap_entries[m + 1] : NULL;
+        struct region_class cls;
+
+        if (query_attribution_index(&index, p_current->start_address, p_current->end_address) != 0) {
+            free_attribution_index(&index);
+            return -1;
+        }
+        check_pmap_entry_type(p_current, p_before, p_after, thread_entries, &index, arenas, &cls);
+
+        write_report_mapping(w, p_current, &cls, previous_end, snapshot, m == 0);
+        if (output_format == OUTPUT_BINARY) {
+            writer_put_varint(w, index.match_count);
+        }
+        for (size_t i = 0; i < index.match_count; i++) {
+            const struct attribution_record *rec = index.matches[i];
+            if (output_format == OUTPUT_JSON && i > 0) {
+                writer_putc(w, ',');
+            }
+            write_report_owner(w, &thread_entries[rec->thread_index], rec->malloc_index, p_current->start_address,
+                               snapshot);
+        }
+        if (output_format == OUTPUT_JSON) {
+            writer_puts(w, "]}");
+        }
+        previous_end = p_current->end_address;
+    }
+    free_attribution_index(&index);
+
+    write_report_totals(w, pmap_entries, pmap_entry_count, pid, snapshot);
+    write_report_arenas(w, arenas);
+    if (output_format == OUTPUT_JSON) {
+        writer_puts(w, "}\n");
+    } else if (output_format == OUTPUT_BINARY) {
+        writer_putc(w, 'E');
+    }
+    // Flush per snapshot, so a watched report can be followed live
+    writer_flush(w);
+    return w->failed ? -1 : 0;
+}
+
+/*
+ * --trace: malloc, free, calloc, realloc and the memalign family are
+ * interposed for the whole process, libc and other libraries included, and
+ * forwarded to glibc's __libc_* entry points. Every thread records its calls
+ * into a ring of its own, mapped on its first call. The owner only advances
+ * head and the writer thread only advances tail, so neither side takes a
+ * lock and a full ring drops the event instead of blocking the workload.
+ * The writer drains all rings into the trace file in blocks per thread:
+ *
+ *   "GVTR" version start_ns start_ticks
+ *   'A' arena_id arena_address         first use of an arena
+ *   'T' tid count first_ticks events... a block of one thread
+ *   'E' events dropped end_ns end_ticks end of the trace
+ *
+ * An event is its type byte, then varints: the ticks since the previous
+ * event of the block, the zigzag delta of the address to the previous one,
+ * the size, for realloc the zigzag delta of the old address, and the arena
+ * id. Arena ids 0 and 1 are the main arena and mmap()ed chunks.
+ */
+enum trace_type {
+    TRACE_MALLOC,
+    TRACE_FREE,
+    TRACE_CALLOC,
+    TRACE_REALLOC,
+    TRACE_MEMALIGN
+};
+
+struct trace_event {
+    unsigned long long ticks;
+    unsigned long long address;
+    unsigned long long old_address;
+    unsigned long long arena;
+    unsigned long long size;
+    int type;
+};
+
+struct trace_ring {
+    unsigned long long head; // written by the owner
+    char pad[56];
+    unsigned long long tail; // written by the trace writer
+    unsigned long long dropped;
+    pid_t tid;
+    int released; // the owner exited, free for the next thread once drained
+    struct trace_ring *next;
+    struct trace_event events[];
+};
+
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+volatile int trace_enabled = 0;
+static __thread struct trace_ring *trace_ring = NULL;
+static __thread int trace_attaching = 0;
+static struct trace_ring *trace_rings = NULL;
+static pthread_key_t trace_ring_key;
+static int trace_threads = 0;
+
+// Destructor of trace_ring_key, calls made later in the exit of the thread are not traced
+static void release_trace_ring(void *arg) {
+    struct trace_ring *ring = (struct trace_ring *)arg;
+    trace_attaching = 1;
+    trace_ring = NULL;
+    __atomic_store_n(&ring->released, 1, __ATOMIC_RELEASE);
+}
+
+// The cheapest clock there is, the trace file holds the start and end in ticks and ns to convert it
+static inline unsigned long long trace_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+#endif
+}
+
+static unsigned long long trace_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static size_t trace_ring_bytes = sizeof(struct trace_ring) + TRACE_RING_EVENTS * sizeof(struct trace_event);
+
+/*
+ * The rings are mapped in the process they trace. Their mappings are left
+ * out of its memory map and only counted here, so --trace does not add to
+ * the footprint it runs alongside.
+ */
+struct trace_ring_footprint {
+    int mappings;
+    long long kbytes;
+    long long rss;
+    long long dirty;
+} trace_ring_footprint;
+
+static int compare_ring_addresses(const void *a, const void *b) {
+    uintptr_t ra = *(const uintptr_t *)a;
+    uintptr_t rb = *(const uintptr_t *)b;
+    return (ra > rb) - (ra < rb);
+}
+
+// Drops the mappings the rings cover completely from the address sorted entries, returns the count left
+static int drop_trace_ring_mappings(struct pmap_entry *entries, int count) {
+    size_t ring_count = 0;
+    for (struct trace_ring *ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        ring_count++;
+    }
+    if (ring_count == 0) {
+        return count;
+    }
+    uintptr_t *starts = malloc(sizeof(uintptr_t) * ring_count);
+    if (!starts) {
+        return count;
+    }
+    size_t filled = 0;
+    for (struct trace_ring *ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring && filled < ring_count;
+         ring = ring->next) {
+        starts[filled++] = (uintptr_t)ring;
+    }
+    qsort(starts, filled, sizeof(uintptr_t), compare_ring_addresses);
+
+    // Adjacent rings merge into one mapping, so a mapping counts when consecutive rings tile it
+    unsigned long long page_size = (unsigned long long)sysconf(_SC_PAGESIZE);
+    unsigned long long span = (trace_ring_bytes + page_size - 1) & ~(page_size - 1);
+    memset(&trace_ring_footprint, 0, sizeof(trace_ring_footprint));
+    size_t r = 0;
+    int kept = 0;
+    for (int m = 0; m < count; m++) {
+        struct pmap_entry *entry = &entries[m];
+        while (r < filled && starts[r] + span <= entry->start_address) {
+            r++;
+        }
+        unsigned long long covered = entry->start_address;
+        for (size_t s = r; s < filled && starts[s] == covered && covered < entry->end_address; s++) {
+            covered += span;
+        }
+        if (covered > entry->start_address && covered >= entry->end_address) {
+            trace_ring_footprint.mappings++;
+            trace_ring_footprint.kbytes += entry->kbytes;
+            trace_ring_footprint.rss += entry->rss;
+            trace_ring_footprint.dirty += entry->dirty;
+            continue;
+        }
+        if (kept != m) {
+            entries[kept] = *entry;
+        }
+        kept++;
+    }
+    free(starts);
+    return kept;
+}
+
+// The library leaves the allocator of the service it is linked into alone
+#ifndef GLIBCVSZ_LIBRARY
+// A ring of an exited thread the writer has drained, so short lived threads do not add a ring each
+static struct trace_ring *claim_trace_ring(void) {
+    for (struct trace_ring *ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        int released = 1;
+        if (__atomic_load_n(&ring->released, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head &&
+            __atomic_compare_exchange_n(&ring->released, &released, 0, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return ring;
+        }
+    }
+    return NULL;
+}
+
+static struct trace_ring *attach_trace_ring(void) {
+    // mmap() and pthread_setspecific() do not allocate, but a failing mmap() may print through stdio
+    trace_attaching = 1;
+    struct trace_ring *ring = claim_trace_ring();
+    if (!ring) {
+        ring = mmap(NULL, trace_ring_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (ring == MAP_FAILED) {
+            trace_attaching = 0;
+            return NULL;
+        }
+        // The flag keeps the ring from merging with a stack or heap next to it, only rings merge with rings
+        madvise(ring, trace_ring_bytes, MADV_DONTFORK);
+        ring->tid = syscall(SYS_gettid);
+        ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    } else {
+        // The writer reads the tid only for events published after this store
+        ring->tid = syscall(SYS_gettid);
+    }
+    pthread_setspecific(trace_ring_key, ring);
+    trace_attaching = 0;
+    __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+    trace_ring = ring;
+    return ring;
+}
+
+// The glibc arena of a chunk from its header: 0 for the main arena, 1 for a chunk of its own mmap()
+static unsigned long long chunk_arena(const void *ptr) {
+    size_t header = ((const size_t *)ptr)[-1];
+    if (header & GLIBC_CHUNK_IS_MMAPPED)
+        return 1;
+    if (header & GLIBC_CHUNK_NON_MAIN_ARENA)
+        return (unsigned long long)(uintptr_t)((const struct glibc_heap_info *)((uintptr_t)ptr & ~(GLIBC_HEAP_MAX_SIZE - 1)))->ar_ptr;
+    return 0;
+}
+
+static void trace_call(int type, const void *ptr, const void *old_ptr, size_t size) {
+    struct trace_ring *ring = trace_ring;
+    if (!ring && (trace_attaching || (ring = attach_trace_ring()) == NULL)) {
+        return;
+    }
+    unsigned long long head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= TRACE_RING_EVENTS) {
+        ring->dropped++;
+        return;
+    }
+
+    struct trace_event *event = &ring->events[head & (TRACE_RING_EVENTS - 1)];
+    event->ticks = trace_ticks();
+    event->type = type;
+    event->address = (unsigned long long)(uintptr_t)ptr;
+    event->old_address = (unsigned long long)(uintptr_t)old_ptr;
+    event->size = size;
+    event->arena = ptr ? chunk_arena(ptr) : 0;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void *malloc(size_t size) {
+    void *ptr = __libc_malloc(size);
+    if (trace_enabled && ptr) {
+        trace_call(TRACE_MALLOC, ptr, NULL, size);
+    }
+    return ptr;
+}
+
+void free(void *ptr) {
+    // The chunk header still tells size and arena before the chunk is given back
+    if (trace_enabled && ptr) {
+        trace_call(TRACE_FREE, ptr, NULL, (((const size_t *)ptr)[-1] & ~(size_t)GLIBC_CHUNK_FLAGS));
+    }
+    __libc_free(ptr);
+}
+
+void *calloc(size_t count, size_t size) {
+    void *ptr = __libc_calloc(count, size);
+    if (trace_enabled && ptr) {
+        trace_call(TRACE_CALLOC, ptr, NULL, count * size);
+    }
+    return ptr;
+}
+
+void *realloc(void *old_ptr, size_t size) {
+    void *ptr = __libc_realloc(old_ptr, size);
+    if (trace_enabled && (ptr || size == 0)) {
+        trace_call(TRACE_REALLOC, ptr, old_ptr, size);
+    }
+    return ptr;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    void *ptr = __libc_memalign(alignment, size);
+    if (trace_enabled && ptr) {
+        trace_call(TRACE_MEMALIGN, ptr, NULL, size);
+    }
+    return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **result, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0) {
+        return EINVAL;
+    }
+    void *ptr = memalign(alignment, size);
+    if (!ptr) {
+        return ENOMEM;
+    }
+    *result = ptr;
+    return 0;
+}
+
+void *valloc(size_t size) {
+    return memalign((size_t)sysconf(_SC_PAGESIZE), size);
+}
+#endif
+
+struct trace_writer {
+    pthread_t thread;
+    struct output_writer *out;
+    unsigned long long start_ticks;
+    unsigned long long events;
+    unsigned long long arenas[TRACE_MAX_ARENAS];
+    size_t arena_count;
+    double overhead_ns;
+    volatile int stop;
+};
+
+struct trace_writer trace_writer;
+
+static unsigned long long trace_arena_id(struct trace_writer *t, unsigned long long arena) {
+    if (arena <= 1)
+        return arena;
+    for (size_t a = 0; a < t->arena_count; a++) {
+        if (t->arenas[a] == arena)
+            return a + 2;
+    }
+    if (t->arena_count == TRACE_MAX_ARENAS)
+        return 0;
+    t->arenas[t->arena_count++] = arena;
+    writer_putc(t->out, 'A');
+    writer_put_varint(t->out, t->arena_count + 1);
+    writer_put_varint(t->out, arena);
+    return t->arena_count + 1;
+}
+
+// Writes the events of every ring as one block each, returns the number written
+static unsigned long long drain_trace_rings(struct trace_writer *t) {
+    unsigned long long written = 0;
+    for (struct trace_ring *ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        unsigned long long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long long tail = ring->tail;
+        if (head == tail)
+            continue;
+
+        written += head - tail;
+        // New arenas are announced before the block that uses them
+        for (unsigned long long i = tail; i != head; i++) {
+            trace_arena_id(t, ring->events[i & (TRACE_RING_EVENTS - 1)].arena);
+        }
+
+        unsigned long long previous_ticks = ring->events[tail & (TRACE_RING_EVENTS - 1)].ticks;
+        unsigned long long previous_address = 0;
+        writer_putc(t->out, 'T');
+        writer_put_varint(t->out, (unsigned long long)ring->tid);
+        writer_put_varint(t->out, head - tail);
+        writer_put_varint(t->out, previous_ticks - t->start_ticks);
+        for (; tail != head; tail++) {
+            const struct trace_event *event = &ring->events[tail & (TRACE_RING_EVENTS - 1)];
+            unsigned long long arena_id = trace_arena_id(t, event->arena);
+            writer_putc(t->out, (char)event->type);
+            writer_put_varint(t->out, event->ticks - previous_ticks);
+            writer_put_zigzag(t->out, (long long)(event->address - previous_address));
+            writer_put_varint(t->out, event->size);
+            if (event->type == TRACE_REALLOC)
+                writer_put_zigzag(t->out, (long long)(event->old_address - event->address));
+            writer_put_varint(t->out, arena_id);
+            previous_ticks = event->ticks;
+            previous_address = event->address;
+        }
+        __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+    }
+    return written;
+}
+
+static void *trace_writer_function(void *arg) {
+    struct trace_writer *t = (struct trace_writer *)arg;
+    struct timespec idle = { 0, TRACE_DRAIN_INTERVAL_NS };
+    while (!t->stop) {
+        unsigned long long written = drain_trace_rings(t);
+        t->events += written;
+        if (written == 0)
+            nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+// Nanoseconds a traced malloc()/free() pair costs more than an untraced one, per call
+static double measure_trace_overhead(void) {
+    double best[2] = { 0.0, 0.0 };
+    for (int traced = 0; traced < 2; traced++) {
+        trace_enabled = traced;
+        for (int round = 0; round < TRACE_CALIBRATION_ROUNDS; round++) {
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int i = 0; i < TRACE_RING_EVENTS / 2; i++) {
+                void *volatile ptr = malloc(64);
+                free(ptr);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+            if (round == 0 || ns < best[traced])
+                best[traced] = ns;
+            // The calibration calls are not part of the trace
+            if (trace_ring)
+                trace_ring->tail = trace_ring->head;
+        }
+    }
+    trace_enabled = 0;
+    return (best[1] - best[0]) / TRACE_RING_EVENTS;
+}
+
+int start_trace(const char *path) {
+    memset(&trace_writer, 0, sizeof(trace_writer));
+    trace_writer.out = malloc(sizeof(struct output_writer));
+    if (!trace_writer.out) {
+        perror("malloc trace writer");
+        return -1;
+    }
+    trace_writer.out->failed = 0;
+    trace_writer.out->length = 0;
+    trace_writer.out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace_writer.out->fd < 0) {
+        perror(path);
+        free(trace_writer.out);
+        return -1;
+    }
+
+    trace_threads = 0;
+    if (pthread_key_create(&trace_ring_key, release_trace_ring) != 0) {
+        perror("pthread_key_create trace ring");
+        close_output_writer(trace_writer.out);
+        return -1;
+    }
+    trace_writer.overhead_ns = measure_trace_overhead();
+    writer_put(trace_writer.out, TRACE_MAGIC, 4);
+    writer_putc(trace_writer.out, TRACE_VERSION);
+    writer_put_varint(trace_writer.out, trace_now_ns());
+    trace_writer.start_ticks = trace_ticks();
+    writer_put_varint(trace_writer.out, trace_writer.start_ticks);
+
+    if (pthread_create(&trace_writer.thread, NULL, trace_writer_function, &trace_writer) != 0) {
+        perror("pthread_create trace writer");
+        close_output_writer(trace_writer.out);
+        return -1;
+    }
+    trace_enabled = 1;
+    return 0;
+}
+
+// Stops tracing, writes what is left in the rings and the end record
+int finish_trace(int print_summary) {
+    trace_enabled = 0;
+    trace_writer.stop = 1;
+    pthread_join(trace_writer.thread, NULL);
+    trace_writer.events += drain_trace_rings(&trace_writer);
+    // Threads still running must not release their ring once it is unmapped
+    pthread_key_delete(trace_ring_key);
+
+    unsigned long long dropped = 0;
+    int rings = 0;
+    struct trace_ring *ring = trace_rings;
+    trace_rings = NULL;
+    trace_ring = NULL;
+    while (ring) {
+        struct trace_ring *next = ring->next;
+        dropped += ring->dropped;
+        rings++;
+        munmap(ring, trace_ring_bytes);
+        ring = next;
+    }
+    writer_putc(trace_writer.out, 'E');
+    writer_put_varint(trace_writer.out, trace_writer.events);
+    writer_put_varint(trace_writer.out, dropped);
+    writer_put_varint(trace_writer.out, trace_now_ns());
+    writer_put_varint(trace_writer.out, trace_ticks());
+    off_t bytes = lseek(trace_writer.out->fd, 0, SEEK_CUR) + (off_t)trace_writer.out->length;
+    int ret = close_output_writer(trace_writer.out);
+
+    if (print_summary) {
+        printf("---------------- Allocation Trace -----------------\n");
+        printf("    %llu events of %d threads in %d rings and %zu thread arenas written to %s\n", trace_writer.events,
+               trace_threads, rings, trace_writer.arena_count, trace_path);
+        printf("    %llu events dropped on full rings of %d events\n", dropped, TRACE_RING_EVENTS);
+        printf("    %d ring mappings with %lld kB VSZ, %lld kB RSS and %lld kB Dirty left out of the memory map\n",
+               trace_ring_footprint.mappings, trace_ring_footprint.kbytes, trace_ring_footprint.rss,
+               trace_ring_footprint.dirty);
+        if (trace_writer.events > 0) {
+            printf("    %lld bytes, %.1f bytes per event\n", (long long)bytes, (double)bytes / trace_writer.events);
+        }
+        printf("    Tracing costs %.1f ns per call\n", trace_writer.overhead_ns);
+        printf("---------------------------------------------------\n");
+    }
+    return ret;
+}
+
+/*
+ * --snapshot writes the classified map to a compact file which --compare
+ * reads back through mmap(). Mapping names are interned, every field is a
+ * column of its own so a reader touches only what it needs, and the columns
+ * are varints: start addresses as the gap to the previous mapping and sizes
+ * in pages. The fixed size header holds the offset of every column, all
+ * numbers in it are little endian.
+ *
+ *   "GVSS" version mapping_count name_count pid page_shift created offsets[]
+ *   label:  varint length, bytes (command line and glibc version)
+ *   names:  name_count times varint length, bytes
+ *   start, pages, rss, dirty, swap, anon_huge: one varint per mapping
+ *   perms, kind: one byte per mapping
+ *   name: varint name index, owner: zigzag arena number or thread id
+ */
+enum snapshot_column {
+    SNAP_LABEL,
+    SNAP_NAMES,
+    SNAP_START,
+    SNAP_PAGES,
+    SNAP_RSS,
+    SNAP_DIRTY,
+    SNAP_SWAP,
+    SNAP_ANON_HUGE,
+    SNAP_PERMS,
+    SNAP_KIND,
+    SNAP_NAME,
+    SNAP_OWNER,
+    SNAP_COLUMNS
+};
+
+#define SNAP_HEADER_SIZE (4 + 5 * 4 + 8 + 8 * (SNAP_COLUMNS + 1))
+
+char snapshot_label[SNAP_MAX_LABEL];
+
+// The command line and glibc version, so a snapshot says how it was taken
+void set_snapshot_label(int argc, char *argv[]) {
+    size_t length = 0;
+    for (int i = 0; i < argc && length < sizeof(snapshot_label); i++) {
+        length += (size_t)snprintf(snapshot_label + length, sizeof(snapshot_label) - length, "%s%s", i ? " " : "",
+                                   argv[i]);
+    }
+    if (length < sizeof(snapshot_label)) {
+        snprintf(snapshot_label + length, sizeof(snapshot_label) - length, ", glibc %s", gnu_get_libc_version());
+    }
+}
+
+static void put_le(unsigned char *p, unsigned long long value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static unsigned long long get_le(const unsigned char *p, int bytes) {
+    unsigned long long value = 0;
+    for (int i = 0; i < bytes; i++)
+        value |= (unsigned long long)p[i] << (8 * i);
+    return value;
+}
+
+static int snapshot_owner(const struct region_class *cls) {
+    if (cls->kind == REGION_ARENA_HEAP)
+        return cls->arena;
+    if (cls->kind == REGION_THREAD_STACK)
+        return (int)cls->thread_id;
+    return -1;
+}
+
+static unsigned long long hash_name(const char *name) {
+    unsigned long long hash = 1469598103934665603ULL;
+    for (; *name; name++)
+        hash = (hash ^ (unsigned char)*name) * 1099511628211ULL;
+    return hash;
+}
+
+/*
+ * Gives every distinct mapping name an index in the order of first use,
+ * name_index[m] is the one of mapping m. Returns the number of names or -1.
+ */
+static int intern_mapping_names(struct pmap_entry *pmap_entries, int pmap_entry_count, int *name_index,
+                                int *first_use) {
+    size_t slots = 64;
+    while (slots < (size_t)pmap_entry_count * 2)
+        slots *= 2;
+    int *table = malloc(sizeof(int) * slots);
+    if (!table) {
+        perror("malloc name table");
+        return -1;
+    }
+    for (size_t i = 0; i < slots; i++)
+        table[i] = -1;
+
+    int names = 0;
+    for (int m = 0; m < pmap_entry_count; m++) {
+        size_t slot = hash_name(pmap_entries[m].mapping) & (slots - 1);
+        while (table[slot] >= 0 && strcmp(pmap_entries[first_use[table[slot]]].mapping, pmap_entries[m].mapping) != 0)
+            slot = (slot + 1) & (slots - 1);
+        if (table[slot] < 0) {
+            first_use[names] = m;
+            table[slot] = names++;
+        }
+        name_index[m] = table[slot];
+    }
+    free(table);
+    return names;
+}
+
+int save_snapshot(const char *path, int pid, struct pmap_entry *pmap_entries, int pmap_entry_count,
+                  struct thread_info_entry *thread_entries, int thread_entry_count, struct arena_table *arenas) {
+    size_t count = pmap_entry_count > 0 ? (size_t)pmap_entry_count : 1;
+    struct region_class *classes = malloc(sizeof(struct region_class) * count);
+    int *name_index = malloc(sizeof(int) * count);
+    int *first_use = malloc(sizeof(int) * count);
+    struct output_writer *w = malloc(sizeof(struct output_writer));
+    int names = -1;
+    if (classes && name_index && first_use && w &&
+        classify_pmap_entries(pmap_entries, pmap_entry_count, thread_entries, thread_entry_count, arenas, classes) == 0) {
+        names = intern_mapping_names(pmap_entries, pmap_entry_count, name_index, first_use);
+    }
+    if (names < 0 || (w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        if (names >= 0)
+            perror(path);
+        free(classes);
+        free(name_index);
+        free(first_use);
+        free(w);
+        return -1;
+    }
+    w->failed = 0;
+    w->length = 0;
+
+    int page_shift = 0;
+    while ((1L << page_shift) < sysconf(_SC_PAGESIZE))
+        page_shift++;
+
+    // Columns are written one after the other, the header with their offsets goes in last
+    unsigned long long offsets[SNAP_COLUMNS + 1];
+    unsigned char header[SNAP_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    writer_put(w, header, sizeof(header));
+
+    for (int column = 0; column < SNAP_COLUMNS; column++) {
+        offsets[column] = (unsigned long long)lseek(w->fd, 0, SEEK_CUR) + w->length;
+        if (column == SNAP_LABEL) {
+            writer_put_varint(w, strlen(snapshot_label));
+            writer_puts(w, snapshot_label);
+            continue;
+        }
+        if (column == SNAP_NAMES) {
+            for (int n = 0; n < names; n++) {
+                const char *name = pmap_entries[first_use[n]].mapping;
+                writer_put_varint(w, strlen(name));
+                writer_puts(w, name);
+            }
+            continue;
+        }
+
+        unsigned long long previous_end = 0;
+        for (int m = 0; m < pmap_entry_count; m++) {
+            const struct pmap_entry *p = &pmap_entries[m];
+            switch (column) {
+                case SNAP_START:
+                    writer_put_varint(w, (p->start_address - previous_end) >> page_shift);
+                    previous_end = p->end_address;
+                    break;
+                case SNAP_PAGES:
+                    writer_put_varint(w, (p->end_address - p->start_address) >> page_shift);
+                    break;
+                case SNAP_RSS:
+                    writer_put_varint(w, (unsigned long long)p->rss);
+                    break;
+                case SNAP_DIRTY:
+                    writer_put_varint(w, (unsigned long long)p->dirty);
+                    break;
+                case SNAP_SWAP:
+                    writer_put_varint(w, (unsigned long long)p->swap);
+                    break;
+                case SNAP_ANON_HUGE:
+                    writer_put_varint(w, (unsigned long long)p->anon_huge_pages);
+                    break;
+                case SNAP_PERMS:
+                    writer_putc(w, (char)((p->r == 'r') | (p->w == 'w') << 1 | (p->x == 'x') << 2));
+                    break;
+                case SNAP_KIND:
+                    writer_putc(w, (char)classes[m].kind);
+                    break;
+                case SNAP_NAME:
+                    writer_put_varint(w, (unsigned long long)name_index[m]);
+                    break;
+                case SNAP_OWNER:
+                    writer_put_zigzag(w, snapshot_owner(&classes[m]));
+                    break;
+            }
+        }
+    }
+    offsets[SNAP_COLUMNS] = (unsigned long long)lseek(w->fd, 0, SEEK_CUR) + w->length;
+    writer_flush(w);
+
+    unsigned char *h = header;
+    memcpy(h, SNAP_MAGIC, 4);
+    put_le(h + 4, SNAP_VERSION, 4);
+    put_le(h + 8, (unsigned long long)pmap_entry_count, 4);
+    put_le(h + 12, (unsigned long long)names, 4);
+    put_le(h + 16, (unsigned long long)pid, 4);
+    put_le(h + 20, (unsigned long long)page_shift, 4);
+    put_le(h + 24, (unsigned long long)time(NULL), 8);
+    for (int column = 0; column <= SNAP_COLUMNS; column++)
+        put_le(h + 32 + 8 * column, offsets[column], 8);
+    if (!w->failed && pwrite(w->fd, header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        perror("write snapshot header");
+        w->failed = 1;
+    }
+
+    free(classes);
+    free(name_index);
+    free(first_use);
+    return close_output_writer(w);
+}
+
+/*
+ * A snapshot mapped read only. Every column has a cursor of its own, the
+ * mappings are decoded in order straight from the mapping without copying.
+ */
+struct snapshot_file {
+    const unsigned char *data;
+    size_t size;
+    unsigned int mapping_count;
+    unsigned int name_count;
+    unsigned int pid;
+    int page_shift;
+    time_t created;
+    const char *label;
+    size_t label_length;
+    const unsigned char *names;         // start of the names column
+    const unsigned char **name_offsets; // name_count entries into names
+    const unsigned char *cursor[SNAP_COLUMNS];
+    const unsigned char *end[SNAP_COLUMNS];
+    unsigned long long previous_end;
+};
+
+struct snapshot_mapping {
+    unsigned long long start;
+    unsigned long long end;
+    unsigned long long rss;
+    unsigned long long dirty;
+    unsigned long long swap;
+    unsigned long long anon_huge;
+    int perms;
+    enum region_kind kind;
+    long long owner;
+    const char *name;
+    size_t name_length;
+};
+
+static int read_varint(const unsigned char **p, const unsigned char *end, unsigned long long *value) {
+    *value = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*p)++;
+        *value |= (unsigned long long)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+void close_snapshot(struct snapshot_file *snap) {
+    if (snap->data)
+        munmap((void *)snap->data, snap->size);
+    free(snap->name_offsets);
+    memset(snap, 0, sizeof(*snap));
+}
+
+int open_snapshot(const char *path, struct snapshot_file *snap) {
+    memset(snap, 0, sizeof(*snap));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < SNAP_HEADER_SIZE) {
+        fprintf(stderr, "%s: not a snapshot\n", path);
+        close(fd);
+        return -1;
+    }
+    snap->size = (size_t)st.st_size;
+    void *data = mmap(NULL, snap->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap snapshot");
+        return -1;
+    }
+    snap->data = data;
+
+    const unsigned char *h = snap->data;
+    if (memcmp(h, SNAP_MAGIC, 4) != 0 || get_le(h + 4, 4) != SNAP_VERSION) {
+        fprintf(stderr, "%s: not a snapshot of version %d\n", path, SNAP_VERSION);
+        close_snapshot(snap);
+        return -1;
+    }
+    snap->mapping_count = (unsigned int)get_le(h + 8, 4);
+    snap->name_count = (unsigned int)get_le(h + 12, 4);
+    snap->pid = (unsigned int)get_le(h + 16, 4);
+    snap->page_shift = (int)get_le(h + 20, 4);
+    snap->created = (time_t)get_le(h + 24, 8);
+    for (int column = 0; column < SNAP_COLUMNS; column++) {
+        unsigned long long start = get_le(h + 32 + 8 * column, 8);
+        unsigned long long end = get_le(h + 32 + 8 * (column + 1), 8);
+        if (start < SNAP_HEADER_SIZE || start > end || end > snap->size || snap->page_shift > 30) {
+            fprintf(stderr, "%s: corrupt snapshot\n", path);
+            close_snapshot(snap);
+            return -1;
+        }
+        snap->cursor[column] = snap->data + start;
+        snap->end[column] = snap->data + end;
+    }
+    // The byte columns end the decoding, they have to hold exactly one byte per mapping
+    if (snap->end[SNAP_PERMS] - snap->cursor[SNAP_PERMS] != (ptrdiff_t)snap->mapping_count ||
+        snap->end[SNAP_KIND] - snap->cursor[SNAP_KIND] != (ptrdiff_t)snap->mapping_count) {
+        fprintf(stderr, "%s: corrupt snapshot, the perms and kind columns do not hold %u mappings\n", path,
+                snap->mapping_count);
+        close_snapshot(snap);
+        return -1;
+    }
+
+    unsigned long long length;
+    if (read_varint(&snap->cursor[SNAP_LABEL], snap->end[SNAP_LABEL], &length) != 0 ||
+        length > (unsigned long long)(snap->end[SNAP_LABEL] - snap->cursor[SNAP_LABEL])) {
+        fprintf(stderr, "%s: corrupt snapshot label\n", path);
+        close_snapshot(snap);
+        return -1;
+    }
+    snap->label = (const char *)snap->cursor[SNAP_LABEL];
+    snap->label_length = (size_t)length;
+
+    snap->names = snap->cursor[SNAP_NAMES];
+    snap->name_offsets = malloc(sizeof(const unsigned char *) * (snap->name_count ? snap->name_count : 1));
+    if (!snap->name_offsets) {
+        perror("malloc snapshot names");
+        close_snapshot(snap);
+        return -1;
+    }
+    const unsigned char *p = snap->names;
+    for (unsigned int n = 0; n < snap->name_count; n++) {
+        snap->name_offsets[n] = p;
+        if (read_varint(&p, snap->end[SNAP_NAMES], &length) != 0 ||
+            length > (unsigned long long)(snap->end[SNAP_NAMES] - p)) {
+            fprintf(stderr, "%s: corrupt snapshot names\n", path);
+            close_snapshot(snap);
+            return -1;
+        }
+        p += length;
+    }
+    return 0;
+}
+
+// Decodes the next mapping, returns 1 for a mapping, 0 at the end and -1 for a corrupt file
+int next_snapshot_mapping(struct snapshot_file *snap, struct snapshot_mapping *out) {
+    if (snap->cursor[SNAP_PERMS] == snap->end[SNAP_PERMS])
+        return 0;
+
+    unsigned long long gap, pages, name, owner;
+    if (read_varint(&snap->cursor[SNAP_START], snap->end[SNAP_START], &gap) != 0 ||
+        read_varint(&snap->cursor[SNAP_PAGES], snap->end[SNAP_PAGES], &pages) != 0 ||
+        read_varint(&snap->cursor[SNAP_RSS], snap->end[SNAP_RSS], &out->rss) != 0 ||
+        read_varint(&snap->cursor[SNAP_DIRTY], snap->end[SNAP_DIRTY], &out->dirty) != 0 ||
+        read_varint(&snap->cursor[SNAP_SWAP], snap->end[SNAP_SWAP], &out->swap) != 0 ||
+        read_varint(&snap->cursor[SNAP_ANON_HUGE], snap->end[SNAP_ANON_HUGE], &out->anon_huge) != 0 ||
+        snap->cursor[SNAP_KIND] == snap->end[SNAP_KIND] ||
+        read_varint(&snap->cursor[SNAP_NAME], snap->end[SNAP_NAME], &name) != 0 ||
+        read_varint(&snap->cursor[SNAP_OWNER], snap->end[SNAP_OWNER], &owner) != 0 || name >= snap->name_count) {
+        return -1;
+    }
+    out->start = snap->previous_end + (gap << snap->page_shift);
+    out->end = out->start + (pages << snap->page_shift);
+    snap->previous_end = out->end;
+    out->perms = *snap->cursor[SNAP_PERMS]++;
+    out->kind = (enum region_kind)*snap->cursor[SNAP_KIND]++;
+    out->owner = (long long)(owner >> 1) ^ -(long long)(owner & 1);
+
+    const unsigned char *p = snap->name_offsets[name];
+    unsigned long long length;
+    read_varint(&p, snap->end[SNAP_NAMES], &length);
+    out->name = (const char *)p;
+    out->name_length = (size_t)length;
+    return 1;
+}
+
+/*
+ * One row of --compare: the main heap, an arena, all thread stacks, or all
+ * other mappings of one name. Addresses differ between runs, so regions are
+ * matched by what they are, not where they are.
+ */
+struct compare_row {
+    enum region_kind kind;
+    long long arena;
+    const char *name;
+    size_t name_length;
+    long long maps[2];
+    long long kbytes[2];
+    long long rss[2];
+    long long dirty[2];
+    long long swap[2];
+};
+
+// The rows in order of appearance and a hash of their (kind, arena, name) key
+struct compare_table {
+    struct compare_row *rows;
+    size_t count;
+    size_t capacity;
+    size_t *slots; // linear probing, index + 1 of the row, 0 for a free slot
+    size_t slot_mask;
+};
+
+// FNV-1a over the key, the name only counts for REGION_OTHER
+static size_t compare_key_hash(enum region_kind kind, long long arena, const char *name, size_t name_length) {
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+    hash = (hash ^ (unsigned long long)kind) * 0x100000001B3ULL;
+    hash = (hash ^ (unsigned long long)arena) * 0x100000001B3ULL;
+    for (size_t i = 0; i < name_length; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 0x100000001B3ULL;
+    }
+    return (size_t)hash;
+}
+
+static size_t compare_row_slot(const struct compare_table *table, enum region_kind kind, long long arena,
+                               const char *name, size_t name_length) {
+    size_t slot = compare_key_hash(kind, arena, name, name_length) & table->slot_mask;
+    for (; table->slots[slot]; slot = (slot + 1) & table->slot_mask) {
+        const struct compare_row *row = &table->rows[table->slots[slot] - 1];
+        if (row->kind == kind && row->arena == arena && row->name_length == name_length &&
+            (name_length == 0 || memcmp(row->name, name, name_length) == 0)) {
+            break;
+        }
+    }
+    return slot;
+}
+
+// Doubles the rows and rehashes them into twice as many slots, so the table stays at most half full
+static int grow_compare_table(struct compare_table *table) {
+    size_t capacity = table->capacity ? table->capacity * 2 : 64;
+    struct compare_row *rows = realloc(table->rows, sizeof(struct compare_row) * capacity);
+    if (!rows) {
+        perror("realloc compare rows");
+        return -1;
+    }
+    table->rows = rows;
+    size_t *slots = calloc(capacity * 2, sizeof(size_t));
+    if (!slots) {
+        perror("calloc compare slots");
+        return -1;
+    }
+    table->capacity = capacity;
+    free(table->slots);
+    table->slots = slots;
+    table->slot_mask = capacity * 2 - 1;
+    for (size_t r = 0; r < table->count; r++) {
+        struct compare_row *row = &table->rows[r];
+        table->slots[compare_row_slot(table, row->kind, row->arena, row->name, row->name_length)] = r + 1;
+    }
+    return 0;
+}
+
+static struct compare_row *compare_row_of(struct compare_table *table, const struct snapshot_mapping *m) {
+    long long arena = m->kind == REGION_ARENA_HEAP ? m->owner : -1;
+    int named = m->kind == REGION_OTHER;
+    const char *name = named ? m->name : NULL;
+    size_t name_length = named ? m->name_length : 0;
+
+    if (table->count == table->capacity && grow_compare_table(table) != 0) {
+        return NULL;
+    }
+    size_t slot = compare_row_slot(table, m->kind, arena, name, name_length);
+    if (table->slots[slot]) {
+        return &table->rows[table->slots[slot] - 1];
+    }
+
+    struct compare_row *row = &table->rows[table->count];
+    memset(row, 0, sizeof(*row));
+    row->kind = m->kind;
+    row->arena = arena;
+    row->name = name;
+    row->name_length = name_length;
+    table->slots[slot] = ++table->count;
+    return row;
+}
+
+static int add_snapshot_to_compare(struct compare_table *table, struct snapshot_file *snap, int side) {
+    struct snapshot_mapping m;
+    int ret;
+    while ((ret = next_snapshot_mapping(snap, &m)) == 1) {
+        struct compare_row *row = compare_row_of(table, &m);
+        if (!row)
+            return -1;
+        row->maps[side]++;
+        row->kbytes[side] += (long long)((m.end - m.start) / 1024);
+        row->rss[side] += (long long)m.rss;
+        row->dirty[side] += (long long)m.dirty;
+        row->swap[side] += (long long)m.swap;
+    }
+    return ret;
+}
+
+static long long compare_change(const struct compare_row *row) {
+    return llabs(row->kbytes[1] - row->kbytes[0]) + llabs(row->rss[1] - row->rss[0]);
+}
+
+static int compare_rows(const void *a, const void *b) {
+    const struct compare_row *x = a, *y = b;
+    // Heaps, arenas and stacks first, then the mappings that changed most
+    int rank_x = x->kind == REGION_OTHER ? 4 : (int)x->kind, rank_y = y->kind == REGION_OTHER ? 4 : (int)y->kind;
+    if (rank_x != rank_y)
+        return rank_x - rank_y;
+    if (x->kind == REGION_ARENA_HEAP && x->arena != y->arena)
+        return x->arena < y->arena ? -1 : 1;
+    long long change_x = compare_change(x), change_y = compare_change(y);
+    return (change_x < change_y) - (change_x > change_y);
+}
+
+static void print_snapshot_info(const char *which, const char *path, const struct snapshot_file *snap) {
+    char created[32];
+    struct tm tm;
+    strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S", localtime_r(&snap->created, &tm));
+    printf("    %s %s: %u mappings of pid %u at %s\n", which, path, snap->mapping_count, snap->pid, created);
+    printf("        %.*s\n", (int)snap->label_length, snap->label);
+}
+
+static void print_compare_row(const char *name, int name_length, const long long *maps, const long long *kbytes,
+                              const long long *rss, const long long *dirty) {
+    printf("    %-28.*s %6lld %6lld %11lld %11lld %+10lld %10lld %10lld %+9lld %+9lld\n", name_length, name, maps[0],
+           maps[1], kbytes[0], kbytes[1], kbytes[1] - kbytes[0], rss[0], rss[1], rss[1] - rss[0], dirty[1] - dirty[0]);
+}
+
+int run_compare(const char *old_path, const char *new_path) {
+    struct snapshot_file snaps[2];
+    if (open_snapshot(old_path, &snaps[0]) != 0) {
+        return EXIT_FAILURE;
+    }
+    if (open_snapshot(new_path, &snaps[1]) != 0) {
+        close_snapshot(&snaps[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct compare_table table = { NULL, 0, 0, NULL, 0 };
+    int ret = EXIT_SUCCESS;
+    for (int side = 0; side < 2; side++) {
+        if (add_snapshot_to_compare(&table, &snaps[side], side) != 0) {
+            fprintf(stderr, "%s: corrupt snapshot\n", side ? new_path : old_path);
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    if (ret == EXIT_SUCCESS) {
+        qsort(table.rows, table.count, sizeof(struct compare_row), compare_rows);
+        printf("---------------- Snapshot Compare -----------------\n");
+        print_snapshot_info("old", old_path, &snaps[0]);
+        print_snapshot_info("new", new_path, &snaps[1]);
+        printf("    %-28s %6s %6s %11s %11s %10s %10s %10s %9s %9s\n", "Region", "Maps", "Maps", "VSZ kB", "VSZ kB",
+               "VSZ diff", "RSS kB", "RSS kB", "RSS diff", "Dirty");
+        long long maps[2] = { 0 }, kbytes[2] = { 0 }, rss[2] = { 0 }, dirty[2] = { 0 };
+        for (size_t r = 0; r < table.count; r++) {
+            const struct compare_row *row = &table.rows[r];
+            char label[32];
+            const char *name = label;
+            int name_length;
+            if (row->kind == REGION_OTHER) {
+                name = row->name;
+                name_length = (int)row->name_length;
+            } else if (row->kind == REGION_ARENA_HEAP) {
+                name_length = snprintf(label, sizeof(label), "arena %lld", row->arena);
+            } else {
+                name_length = snprintf(label, sizeof(label), "%s", region_kind_name(row->kind));
+            }
+            print_compare_row(name, name_length, row->maps, row->kbytes, row->rss, row->dirty);
+            for (int side = 0; side < 2; side++) {
+                maps[side] += row->maps[side];
+                kbytes[side] += row->kbytes[side];
+                rss[side] += row->rss[side];
+                dirty[side] += row->dirty[side];
+            }
+        }
+        printf("---------------------------------------------------\n");
+        print_compare_row("total", 5, maps, kbytes, rss, dirty);
+    }
+
+    free(table.rows);
+    free(table.slots);
+    close_snapshot(&snaps[0]);
+    close_snapshot(&snaps[1]);
+    return ret;
+}
+
+int get_stack_info(void **stack_addr, size_t *stack_size, void **stack_end_addr) {
+    pthread_t self = pthread_self();
+    pthread_attr_t attr;
+
+    int ret = pthread_getattr_np(self, &attr);
+    if (ret != 0) {
+        perror("pthread_getattr_np");
+        return -1;
+    }
+
+    pthread_attr_getstack(&attr, &*stack_addr, &*stack_size);
+    pthread_attr_destroy(&attr);
+
+    *stack_end_addr = (void *)((char *)(*stack_addr) + *(stack_size));
+
+    return 0;
+}
+
+/*
+ * Fills the unused part of the own stack with STACK_PAINT_PATTERN, from the
+ * lowest address up to STACK_PAINT_SAFETY below the current frame. Must not
+ * be inlined, the frame address has to be the one of this call.
+ */
+static __attribute__((noinline)) void paint_stack(struct thread_info_entry *tinfo) {
+    char *low = (char *)(uintptr_t)tinfo->stack_start_address;
+    char *limit = (char *)__builtin_frame_address(0) - STACK_PAINT_SAFETY;
+    if (limit > low) {
+        memset(low, STACK_PAINT_PATTERN, (size_t)(limit - low));
+    }
+}
+
+// The lowest byte that differs from the paint is the deepest stack use
+static size_t painted_stack_usage(struct thread_info_entry *tinfo) {
+    const unsigned char *p = (const unsigned char *)(uintptr_t)tinfo->stack_start_address;
+    const unsigned char *end = (const unsigned char *)(uintptr_t)tinfo->stack_end_address;
+    while (p < end && *p == STACK_PAINT_PATTERN) {
+        p++;
+    }
+    return (size_t)(end - p);
+}
+
+// Stack pages are only faulted in when touched, the lowest resident one marks the deepest use
+static size_t resident_stack_usage(struct thread_info_entry *tinfo) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t pages = tinfo->stack_size / (size_t)page_size;
+    unsigned char *vec = malloc(pages ? pages : 1);
+    if (!vec) {
+        return 0;
+    }
+
+    size_t used = 0;
+    if (mincore((void *)(uintptr_t)tinfo->stack_start_address, tinfo->stack_size, vec) == 0) {
+        for (size_t i = 0; i < pages; i++) {
+            if (vec[i] & 1) {
+                used = (pages - i) * (size_t)page_size;
+                break;
+            }
+        }
+    } else {
+        perror("mincore");
+    }
+    free(vec);
+    return used;
+}
+
+void measure_stack_usage(struct thread_info_entry *tinfo) {
+    if (stack_usage_method == STACK_USAGE_PAINT) {
+        tinfo->stack_peak_bytes = painted_stack_usage(tinfo);
+    } else if (stack_usage_method == STACK_USAGE_MINCORE) {
+        tinfo->stack_peak_bytes = resident_stack_usage(tinfo);
+    }
+}
+
+void print_stack_usage_summary(struct thread_info_entry *thread_entries, int thread_entry_count) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t peak = 0;
+
+    printf("---------------- Stack Usage ----------------------\n");
+    for (int i = 0; i < thread_entry_count; i++) {
+        struct thread_info_entry *t = &thread_entries[i];
+        printf("    Thread %ld (TID: %d): peak %zu of %zu bytes (%.1f%%)\n", t->thread_id, t->tid,
+               t->stack_peak_bytes, t->stack_size,
+               t->stack_size ? 100.0 * (double)t->stack_peak_bytes / (double)t->stack_size : 0.0);
+        if (t->stack_peak_bytes > peak) {
+            peak = t->stack_peak_bytes;
+        }
+    }
+
+    size_t recommended = peak + peak * (size_t)stack_usage_margin / 100;
+    recommended = (recommended + page_size - 1) / page_size * page_size;
+    if (recommended < (size_t)PTHREAD_STACK_MIN) {
+        recommended = (size_t)PTHREAD_STACK_MIN;
+    }
+    printf("    Highest peak: %zu bytes (%s)\n", peak,
+           stack_usage_method == STACK_USAGE_PAINT ? "painted, byte exact" : "resident pages, page granular");
+    printf("    Recommendation: -s %zu (highest peak + %d%% margin), saves %zu kB VSZ per thread\n", recommended,
+           stack_usage_margin,
+           thread_entry_count > 0 && thread_entries[0].stack_size > recommended
+               ? (thread_entries[0].stack_size - recommended) / 1024
+               : 0);
+    printf("---------------------------------------------------\n");
+}
+
+struct allocator_backend {
+    const char *name;
+    void *(*allocate)(size_t size);
+    void (*release)(void *ptr);
+    void *(*resize)(void *ptr, size_t size);
+};
+
+static size_t thp_page_size(void) {
+    static size_t size;
+    if (size == 0) {
+        unsigned long long value = 0;
+        FILE *file = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+        if (file) {
+            if (fscanf(file, "%llu", &value) != 1)
+                value = 0;
+            fclose(file);
+        }
+        size = value > 0 ? (size_t)value : THP_DEFAULT_PAGE_SIZE;
+    }
+    return size;
+}
+
+// MADV_HUGEPAGE on the whole pages inside [ptr, ptr + size)
+static void advise_huge_pages(void *ptr, size_t size) {
+    uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)ptr + page_size - 1) & ~(page_size - 1);
+    uintptr_t end = ((uintptr_t)ptr + size) & ~(page_size - 1);
+    if (end > start) {
+        madvise((void *)start, end - start, MADV_HUGEPAGE);
+    }
+}
+
+static __thread uintptr_t thp_advised_heap = 0;
+static uintptr_t thp_advised_brk = 0; // end of the advised part of the brk heap
+
+/*
+ * --thp madvise for a block glibc handed out, the chunk header tells where it
+ * lives. An mmap()ed chunk is advised on its own. A thread arena heap is
+ * reserved GLIBC_HEAP_MAX_SIZE aligned and advised as a whole the first time
+ * the thread allocates from it, later mprotect() growth keeps the flag. A brk
+ * extension becomes a VMA of its own without the flag, so the brk heap of the
+ * main arena is advised again for every range it grew by.
+ */
+static void advise_chunk_huge_pages(void *ptr) {
+    size_t header = ((const size_t *)ptr)[-1];
+    if (header & GLIBC_CHUNK_IS_MMAPPED) {
+        advise_huge_pages(ptr, (header & ~GLIBC_CHUNK_FLAGS) - 2 * sizeof(size_t));
+        return;
+    }
+
+    if (!(header & GLIBC_CHUNK_NON_MAIN_ARENA)) {
+        uintptr_t brk_end = (uintptr_t)sbrk(0);
+        uintptr_t advised = __atomic_load_n(&thp_advised_brk, __ATOMIC_RELAXED);
+        // The thread moving the mark advises the range, the others leave it to it
+        if ((uintptr_t)ptr >= brk_end || brk_end <= advised ||
+            !__atomic_compare_exchange_n(&thp_advised_brk, &advised, brk_end, 0, __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED)) {
+            return;
+        }
+        uintptr_t start = advised ? advised : (uintptr_t)ptr;
+        advise_huge_pages((void *)start, brk_end - start);
+        return;
+    }
+
+    uintptr_t heap = (uintptr_t)ptr & ~(GLIBC_HEAP_MAX_SIZE - 1);
+    if (heap == thp_advised_heap) {
+        return;
+    }
+    thp_advised_heap = heap;
+    advise_huge_pages((void *)heap, GLIBC_HEAP_MAX_SIZE);
+}
+
+static void *glibc_allocate(size_t size) {
+    void *ptr = malloc(size);
+    if (ptr && thp_mode == THP_MADVISE) {
+        advise_chunk_huge_pages(ptr);
+    }
+    return ptr;
+}
+
+static void glibc_release(void *ptr) {
+    free(ptr);
+}
+
+static void *glibc_resize(void *ptr, size_t size) {
+    void *resized = realloc(ptr, size);
+    if (resized && thp_mode == THP_MADVISE) {
+        advise_chunk_huge_pages(resized);
+    }
+    return resized;
+}
+
+/*
+ * Per-thread size-class slab allocator. Every thread owns a pool which carves
+ * objects of one size class out of POOL_CHUNK_SIZE aligned mmap chunks, so the
+ * chunk header of any object is found by masking its address. Objects freed by
+ * the owning thread go straight to its free lists, objects freed by another
+ * thread are pushed onto the owner's lock-free remote-free stack, which the
+ * owner drains when a free list runs dry. Objects above POOL_LARGE_THRESHOLD
+ * get a chunk of their own.
+ */
+struct pool_free_object {
+    struct pool_free_object *next;
+};
+
+struct thread_pool;
+
+struct pool_chunk {
+    struct thread_pool *owner;
+    size_t object_size; // 0 for a large object chunk
+    size_t mapping_size;
+    int size_class;
+};
+
+struct thread_pool {
+    struct pool_free_object *free_lists[POOL_SIZE_CLASSES];
+    char *bump[POOL_SIZE_CLASSES];
+    char *bump_end[POOL_SIZE_CLASSES];
+    struct pool_free_object *remote_frees;
+    size_t mapped_bytes;
+    size_t chunk_count;
+    size_t large_count;
+    struct thread_pool *next;
+};
+
+static const size_t pool_class_sizes[POOL_SIZE_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256,
+    512, 1024, 2048, 4096, 8192, 16384
+};
+
+static __thread struct thread_pool *current_pool = NULL;
+static struct thread_pool *all_pools = NULL;
+static pthread_mutex_t all_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int pool_size_class(size_t size) {
+    if (size <= 256) {
+        return size == 0 ? 0 : (int)((size + 15) / 16) - 1;
+    }
+    int log2 = 64 - __builtin_clzll((unsigned long long)size - 1); // ceil(log2(size))
+    return 16 + (log2 - 9);
+}
+
+static struct pool_chunk *pool_chunk_of(void *ptr) {
+    return (struct pool_chunk *)((uintptr_t)ptr & ~((uintptr_t)POOL_CHUNK_SIZE - 1));
+}
+
+static void *pool_map_aligned(size_t size) {
+    // Over-map by one chunk and trim, so the result is POOL_CHUNK_SIZE aligned
+    size_t map_size = size + POOL_CHUNK_SIZE;
+    char *raw = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    char *aligned = (char *)(((uintptr_t)raw + POOL_CHUNK_SIZE - 1) & ~((uintptr_t)POOL_CHUNK_SIZE - 1));
+    if (aligned > raw) {
+        munmap(raw, aligned - raw);
+    }
+    size_t tail = (raw + map_size) - (aligned + size);
+    if (tail > 0) {
+        munmap(aligned + size, tail);
+    }
+    return aligned;
+}
+
+static struct thread_pool *get_thread_pool(void) {
+    if (current_pool) {
+        return current_pool;
+    }
+
+    // The pool itself lives outside of malloc, otherwise glibc would attach an arena anyway
+    struct thread_pool *pool = mmap(NULL, sizeof(struct thread_pool), PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED) {
+        return NULL;
+    }
+    memset(pool, 0, sizeof(*pool));
+
+    pthread_mutex_lock(&all_pools_lock);
+    pool->next = all_pools;
+    all_pools = pool;
+    pthread_mutex_unlock(&all_pools_lock);
+
+    current_pool = pool;
+    return pool;
+}
+
+static void pool_drain_remote_frees(struct thread_pool *pool) {
+    struct pool_free_object *obj = __atomic_exchange_n(&pool->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while (obj) {
+        struct pool_free_object *next = obj->next;
+        int size_class = pool_chunk_of(obj)->size_class;
+        obj->next = pool->free_lists[size_class];
+        pool->free_lists[size_class] = obj;
+        obj = next;
+    }
+}
+
+static void *pool_allocate_large(struct thread_pool *pool, size_t size) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mapping_size = (POOL_CHUNK_HEADER_SIZE + size + page_size - 1) & ~(page_size - 1);
+
+    struct pool_chunk *chunk = pool_map_aligned(mapping_size);
+    if (!chunk) {
+        return NULL;
+    }
+    chunk->owner = pool;
+    chunk->object_size = 0;
+    chunk->mapping_size = mapping_size;
+    chunk->size_class = -1;
+
+    __atomic_add_fetch(&pool->mapped_bytes, mapping_size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool->large_count, 1, __ATOMIC_RELAXED);
+    return (char *)chunk + POOL_CHUNK_HEADER_SIZE;
+}
+
+static int pool_add_chunk(struct thread_pool *pool, int size_class) {
+    struct pool_chunk *chunk = pool_map_aligned(POOL_CHUNK_SIZE);
+    if (!chunk) {
+        return -1;
+    }
+    chunk->owner = pool;
+    chunk->object_size = pool_class_sizes[size_class];
+    chunk->mapping_size = POOL_CHUNK_SIZE;
+    chunk->size_class = size_class;
+
+    pool->bump[size_class] = (char *)chunk + POOL_CHUNK_HEADER_SIZE;
+    pool->bump_end[size_class] = (char *)chunk + POOL_CHUNK_SIZE;
+    __atomic_add_fetch(&pool->mapped_bytes, POOL_CHUNK_SIZE, __ATOMIC_RELAXED);
+    pool->chunk_count++;
+    return 0;
+}
+
+static void *pool_allocate(size_t size) {
+    struct thread_pool *pool = get_thread_pool();
+    if (!pool) {
+        return NULL;
+    }
+    if (size > POOL_LARGE_THRESHOLD) {
+        return pool_allocate_large(pool, size);
+    }
+
+    int size_class = pool_size_class(size);
+    if (!pool->free_lists[size_class] && pool->remote_frees) {
+        pool_drain_remote_frees(pool);
+    }
+
+    struct pool_free_object *obj = pool->free_lists[size_class];
+    if (obj) {
+        pool->free_lists[size_class] = obj->next;
+        return obj;
+    }
+
+    size_t object_size = pool_class_sizes[size_class];
+    if (pool->bump[size_class] == NULL || pool->bump[size_class] + object_size > pool->bump_end[size_class]) {
+        if (pool_add_chunk(pool, size_class) != 0) {
+            return NULL;
+        }
+    }
+    void *ptr = pool->bump[size_class];
+    pool->bump[size_class] += object_size;
+    return ptr;
+}
+
+static void pool_release(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    struct pool_chunk *chunk = pool_chunk_of(ptr);
+    if (chunk->object_size == 0) {
+        __atomic_sub_fetch(&chunk->owner->mapped_bytes, chunk->mapping_size, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&chunk->owner->large_count, 1, __ATOMIC_RELAXED);
+        munmap(chunk, chunk->mapping_size);
+        return;
+    }
+
+    struct thread_pool *owner = chunk->owner;
+    struct pool_free_object *obj = ptr;
+    if (owner == current_pool) {
+        obj->next = owner->free_lists[chunk->size_class];
+        owner->free_lists[chunk->size_class] = obj;
+        return;
+    }
+
+    obj->next = __atomic_load_n(&owner->remote_frees, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&owner->remote_frees, &obj->next, obj, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        // obj->next was updated with the current head, retry
+    }
+}
+
+static void *pool_resize(void *ptr, size_t size) {
+    if (!ptr) {
+        return pool_allocate(size);
+    }
+
+    struct pool_chunk *chunk = pool_chunk_of(ptr);
+    size_t old_size = chunk->object_size ? chunk->object_size : chunk->mapping_size - POOL_CHUNK_HEADER_SIZE;
+    if (size <= old_size && chunk->object_size) {
+        return ptr;
+    }
+
+    void *new_ptr = pool_allocate(size);
+    if (!new_ptr) {
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    pool_release(ptr);
+    return new_ptr;
+}
+
+void print_pool_summary(void) {
+    size_t mapped_bytes = 0, chunk_count = 0, large_count = 0, pool_count = 0;
+
+    pthread_mutex_lock(&all_pools_lock);
+    for (struct thread_pool *pool = all_pools; pool; pool = pool->next) {
+        mapped_bytes += __atomic_load_n(&pool->mapped_bytes, __ATOMIC_RELAXED);
+        chunk_count += pool->chunk_count;
+        large_count += __atomic_load_n(&pool->large_count, __ATOMIC_RELAXED);
+        pool_count++;
+    }
+    pthread_mutex_unlock(&all_pools_lock);
+
+    printf("---------------- Pool Allocator -------------------\n");
+    printf("    %zu thread pools, %zu kB mapped in %zu chunks of %d kB and %zu large objects\n",
+           pool_count, mapped_bytes / 1024, chunk_count, POOL_CHUNK_SIZE / 1024, large_count);
+    printf("---------------------------------------------------\n");
+}
+
+static const struct allocator_backend allocator_backends[] = {
+    { "glibc", glibc_allocate, glibc_release, glibc_resize },
+    { "pool", pool_allocate, pool_release, pool_resize },
+};
+
+const struct allocator_backend *allocator = &allocator_backends[0];
+
+int select_allocator_backend(const char *name) {
+    for (size_t i = 0; i < sizeof(allocator_backends) / sizeof(allocator_backends[0]); i++) {
+        if (strcmp(name, allocator_backends[i].name) == 0) {
+            allocator = &allocator_backends[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Per thread counters for --counters. Every event is opened on its own with
+ * perf_event_open(), so a missing hardware PMU (as in most VMs) only loses
+ * the cycles and dTLB misses. Kernel time is where first-touch faults are
+ * paid, so kernel plus user is tried first and user only second. Faults
+ * fall back to getrusage(RUSAGE_THREAD); wall and CPU time always come from
+ * clock_gettime().
+ */
+static int open_counter(unsigned int type, unsigned long long config, enum counter_source *source) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_hv = 1;
+    for (int user_only = 0; user_only < 2; user_only++) {
+        attr.exclude_kernel = (unsigned int)user_only;
+        int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (fd >= 0) {
+            *source = user_only ? COUNTER_SOURCE_PERF_USER : COUNTER_SOURCE_PERF;
+            return fd;
+        }
+    }
+    *source = COUNTER_SOURCE_NONE;
+    return -1;
+}
+
+static void open_thread_counters(struct thread_counters *c) {
+    c->fds[COUNTER_FAULTS] = open_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, &c->source[COUNTER_FAULTS]);
+    c->fds[COUNTER_MAJOR_FAULTS] =
+        open_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ, &c->source[COUNTER_MAJOR_FAULTS]);
+    c->fds[COUNTER_DTLB_MISSES] = open_counter(PERF_TYPE_HW_CACHE,
+                                               PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+                                               &c->source[COUNTER_DTLB_MISSES]);
+    c->fds[COUNTER_CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, &c->source[COUNTER_CYCLES]);
+    if (c->fds[COUNTER_FAULTS] < 0 || c->fds[COUNTER_MAJOR_FAULTS] < 0) {
+        c->source[COUNTER_FAULTS] = COUNTER_SOURCE_RUSAGE;
+        c->source[COUNTER_MAJOR_FAULTS] = COUNTER_SOURCE_RUSAGE;
+    }
+}
+
+static void close_thread_counters(struct thread_counters *c) {
+    for (int e = 0; e < COUNTER_EVENTS; e++) {
+        if (c->fds[e] >= 0) {
+            close(c->fds[e]);
+        }
+        c->fds[e] = -1;
+    }
+}
+
+static void read_thread_counters(struct thread_counters *c, struct phase_counters *now) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now->wall_ns = (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    now->cpu_ns = (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+
+    for (int e = 0; e < COUNTER_EVENTS; e++) {
+        unsigned long long value = 0;
+        if (c->fds[e] >= 0 && c->source[e] != COUNTER_SOURCE_RUSAGE &&
+            read(c->fds[e], &value, sizeof(value)) != (ssize_t)sizeof(value)) {
+            value = 0;
+        }
+        now->events[e] = value;
+    }
+    if (c->source[COUNTER_FAULTS] == COUNTER_SOURCE_RUSAGE) {
+        struct rusage usage;
+        getrusage(RUSAGE_THREAD, &usage);
+        now->events[COUNTER_FAULTS] = (unsigned long long)(usage.ru_minflt + usage.ru_majflt);
+        now->events[COUNTER_MAJOR_FAULTS] = (unsigned long long)usage.ru_majflt;
+    }
+}
+
+static void start_counter_phase(struct thread_counters *c) {
+    if (c) {
+        read_thread_counters(c, &c->start);
+    }
+}
+
+static void end_counter_phase(struct thread_counters *c, enum counter_phase phase) {
+    if (!c) {
+        return;
+    }
+    struct phase_counters now;
+    read_thread_counters(c, &now);
+    struct phase_counters *p = &c->phases[phase];
+    p->wall_ns += now.wall_ns - c->start.wall_ns;
+    p->cpu_ns += now.cpu_ns - c->start.cpu_ns;
+    for (int e = 0; e < COUNTER_EVENTS; e++) {
+        p->events[e] += now.events[e] - c->start.events[e];
+    }
+}
+
+static size_t gcd_size(size_t a, size_t b) {
+    while (b) {
+        size_t r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+/*
+ * The touch engine behind -f: how the blocks are turned from VSZ into RSS.
+ * full is the memset() with 0xAA, page writes one byte per page, stride one
+ * byte every <stride> bytes, random one byte in <percent> of the pages in a
+ * scattered order, stream a full write with non-temporal SSE2 stores that
+ * bypass the cache, and read reads one byte per page, which only maps the
+ * zero page. Returns the bytes written or read.
+ */
+static size_t touch_block(void *ptr, size_t size, const struct touch_pattern *pattern, unsigned long long *rng) {
+    volatile unsigned char *bytes = ptr;
+    uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)ptr, end = start + size;
+    size_t accessed = 0;
+
+    switch (pattern->kind) {
+        case TOUCH_FULL:
+            memset(ptr, 0xAA, size);
+            return size;
+        case TOUCH_PAGE:
+        case TOUCH_READ: {
+            unsigned char sum = 0;
+            for (uintptr_t a = start; a < end; a = (a & ~(page_size - 1)) + page_size, accessed++) {
+                if (pattern->kind == TOUCH_READ)
+                    sum += *(volatile unsigned char *)a;
+                else
+                    *(volatile unsigned char *)a = 0xAA;
+            }
+            (void)sum;
+            return accessed;
+        }
+        case TOUCH_STRIDE:
+            for (size_t offset = 0; offset < size; offset += pattern->stride, accessed++) {
+                bytes[offset] = 0xAA;
+            }
+            return accessed;
+        case TOUCH_RANDOM: {
+            size_t first = start / page_size, pages = (end - 1) / page_size - first + 1;
+            size_t count = (pages * (size_t)pattern->percent + 99) / 100;
+            // Stepping by a number coprime to pages visits every page once, in a scattered order
+            size_t step = 2654435761UL % pages;
+            while (gcd_size(step ? step : 1, pages) != 1)
+                step++;
+            step = step ? step : 1;
+            *rng ^= *rng << 13;
+            *rng ^= *rng >> 7;
+            *rng ^= *rng << 17;
+            size_t page = (size_t)(*rng % pages);
+            for (size_t i = 0; i < count; i++, page = (page + step) % pages) {
+                uintptr_t a = (first + page) * page_size;
+                *(volatile unsigned char *)(a < start ? start : a) = 0xAA;
+            }
+            return count;
+        }
+        case TOUCH_STREAM: {
+#ifdef __SSE2__
+            unsigned char *p = ptr, *e = p + size;
+            unsigned char *aligned = (unsigned char *)((start + 15) & ~(uintptr_t)15);
+            if (aligned > e)
+                aligned = e;
+            memset(p, 0xAA, (size_t)(aligned - p));
+            __m128i value = _mm_set1_epi8((char)0xAA);
+            for (p = aligned; p + 64 <= e; p += 64) {
+                _mm_stream_si128((__m128i *)p, value);
+                _mm_stream_si128((__m128i *)(p + 16), value);
+                _mm_stream_si128((__m128i *)(p + 32), value);
+                _mm_stream_si128((__m128i *)(p + 48), value);
+            }
+            for (; p + 16 <= e; p += 16) {
+                _mm_stream_si128((__m128i *)p, value);
+            }
+            memset(p, 0xAA, (size_t)(e - p));
+            _mm_sfence();
+#else
+            memset(ptr, 0xAA, size);
+#endif
+            return size;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The mallocs come first and the fill second, so --counters can tell what
+ * malloc() itself costs from what turning the blocks into RSS costs.
+ */
+void** malloc_allocate_function(struct thread_info_entry *tinfo) {
+    long thread_id = tinfo->thread_id;
+    struct malloc_info_entry *entries = tinfo->malloc_info_entries;
+    struct thread_counters *counters = counters_enabled ? &tinfo->counters : NULL;
+    void **allocated_memory = malloc(malloc_count * sizeof(void*));
+    if (allocated_memory == NULL) {
+        fprintf(stderr, "Thread %ld failed to allocate memory for malloc pointers\n", thread_id);
+        return NULL;
+    }
+    if (counters) {
+        open_thread_counters(counters);
+    }
+
+    start_counter_phase(counters);
+    for (int i = 0; i < malloc_count; i++) {
+        allocated_memory[i] = allocator->allocate(malloc_size);
+    }
+    end_counter_phase(counters, COUNTER_ALLOC);
+
+    unsigned long long rng = 0x9E3779B97F4A7C15ULL ^ (unsigned long long)(thread_id + 1);
+    struct timespec fill_start, fill_end;
+    clock_gettime(CLOCK_MONOTONIC, &fill_start);
+    start_counter_phase(counters);
+    for (int i = 0; i < malloc_count && malloc_fill_enabled; i++) {
+        if (allocated_memory[i] != NULL) {
+            tinfo->touch_accessed += touch_block(allocated_memory[i], malloc_size, &touch_patterns[touch_active], &rng);
+        }
+    }
+    end_counter_phase(counters, COUNTER_FILL);
+    clock_gettime(CLOCK_MONOTONIC, &fill_end);
+    tinfo->touch_ns = (unsigned long long)(fill_end.tv_sec - fill_start.tv_sec) * 1000000000ULL +
+                      (unsigned long long)fill_end.tv_nsec - (unsigned long long)fill_start.tv_nsec;
+    if (counters) {
+        close_thread_counters(counters);
+    }
+
+    for (int i = 0; i < malloc_count; i++) {
+        if (allocated_memory[i] != NULL) {
+            void *malloc_end_addr = (char *)allocated_memory[i] + malloc_size;
+            entries[i].malloc_start_address = (unsigned long long) allocated_memory[i];
+            entries[i].malloc_size = malloc_size;
+            entries[i].malloc_end_address = (unsigned long long) malloc_end_addr;
+        } else {
+            entries[i].malloc_start_address = 0;
+            entries[i].malloc_size = 0;
+            entries[i].malloc_end_address = 0;
+        }
+    }
+    return allocated_memory;
+}
+
+void malloc_deallocate_function(void **allocated_memory) {
+    if (!allocated_memory) return;
+    for (int i = 0; i < malloc_count; i++) {
+         if (allocated_memory[i]) {
+             allocator->release(allocated_memory[i]);
+         }
+     }
+     free(allocated_memory);
+}
+
+struct workload_object {
+    void *ptr;
+    size_t size;
+    long expires_at;
+};
+
+struct workload_state {
+    struct workload_object *objects;
+    size_t count;
+    size_t capacity;
+    unsigned long long rng;
+    void *arena_anchor;
+};
+
+static unsigned long long workload_random(struct workload_state *state) {
+    // xorshift64*, cheap and good enough to drive the allocation pattern
+    state->rng ^= state->rng >> 12;
+    state->rng ^= state->rng << 25;
+    state->rng ^= state->rng >> 27;
+    return state->rng * 2685821657736338717ULL;
+}
+
+static double workload_random_unit(struct workload_state *state) {
+    return (double)(workload_random(state) >> 11) / (double)(1ULL << 53);
+}
+
+static size_t sample_workload_size(struct workload_state *state) {
+    double size = 0;
+
+    switch (workload.size_dist) {
+        case SIZE_DIST_FIXED:
+            return workload.size_min;
+        case SIZE_DIST_UNIFORM:
+            return workload.size_min + workload_random(state) % (workload.size_max - workload.size_min + 1);
+        case SIZE_DIST_LOGNORMAL: {
+            // Box-Muller transform for a standard normal sample
+            double u1 = workload_random_unit(state);
+            double u2 = workload_random_unit(state);
+            double z = sqrt(-2.0 * log(u1 > 0 ? u1 : 1e-300)) * cos(2.0 * M_PI * u2);
+            size = exp(workload.lognormal_mu + workload.lognormal_sigma * z);
+            break;
+        }
+        case SIZE_DIST_HISTOGRAM: {
+            double pick = workload_random_unit(state) * workload.histogram[workload.histogram_count - 1].cumulative_weight;
+            size_t lo = 0, hi = workload.histogram_count - 1;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (workload.histogram[mid].cumulative_weight <= pick)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            return workload.histogram[lo].size;
+        }
+    }
+
+    if (size < 1)
+        return 1;
+    if (size > (double)(SIZE_MAX / 2))
+        return SIZE_MAX / 2;
+    return (size_t)size;
+}
+
+static void handoff_queue_push(struct handoff_queue *queue, void *ptr) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->capacity) {
+        size_t new_capacity = queue->capacity ? queue->capacity * 2 : PMAP_INITIAL_CAPACITY;
+        void **new_items = malloc(sizeof(void *) * new_capacity);
+        if (!new_items) {
+            pthread_mutex_unlock(&queue->lock);
+            allocator->release(ptr); // no room to hand it over, free it locally instead
+            return;
+        }
+        for (size_t i = 0; i < queue->count; i++) {
+            new_items[i] = queue->items[(queue->head + i) % queue->capacity];
+        }
+        free(queue->items);
+        queue->items = new_items;
+        queue->head = 0;
+        queue->capacity = new_capacity;
+    }
+    queue->items[(queue->head + queue->count) % queue->capacity] = ptr;
+    queue->count++;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void handoff_queue_finish(struct handoff_queue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->producer_done = 1;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void release_workload_object(struct thread_info_entry *tinfo, struct workload_state *state, size_t i) {
+    struct workload_object *obj = &state->objects[i];
+
+    if (tinfo->workload_role == WORKLOAD_ROLE_PRODUCER) {
+        handoff_queue_push(tinfo->handoff, obj->ptr);
+    } else {
+        allocator->release(obj->ptr);
+    }
+    tinfo->workload_stats.frees++;
+    tinfo->workload_stats.live_bytes -= obj->size;
+
+    state->objects[i] = state->objects[--state->count];
+}
+
+static int allocate_workload_object(struct thread_info_entry *tinfo, struct workload_state *state, long op) {
+    if (state->count == state->capacity) {
+        size_t new_capacity = state->capacity ? state->capacity * 2 : PMAP_INITIAL_CAPACITY;
+        struct workload_object *new_objects = realloc(state->objects, sizeof(struct workload_object) * new_capacity);
+        if (!new_objects) {
+            return -1;
+        }
+        state->objects = new_objects;
+        state->capacity = new_capacity;
+    }
+
+    size_t size = sample_workload_size(state);
+    void *ptr = allocator->allocate(size);
+    if (!ptr) {
+        tinfo->workload_stats.failed++;
+        return 0;
+    }
+    if (malloc_fill_enabled) {
+        memset(ptr, 0xAA, size);
+    }
+
+    struct workload_object *obj = &state->objects[state->count++];
+    obj->ptr = ptr;
+    obj->size = size;
+    obj->expires_at = workload.lifetime_ops > 0 ? op + workload.lifetime_ops : -1;
+
+    tinfo->workload_stats.allocs++;
+    tinfo->workload_stats.live_bytes += size;
+    return 0;
+}
+
+static void grow_workload_object(struct thread_info_entry *tinfo, struct workload_state *state, size_t i) {
+    struct workload_object *obj = &state->objects[i];
+    size_t new_size = (size_t)((double)obj->size * workload.realloc_growth);
+    if (new_size < 1)
+        new_size = 1;
+
+    void *ptr = allocator->resize(obj->ptr, new_size);
+    if (!ptr) {
+        tinfo->workload_stats.failed++;
+        return;
+    }
+    if (malloc_fill_enabled && new_size > obj->size) {
+        memset((char *)ptr + obj->size, 0xAA, new_size - obj->size);
+    }
+
+    tinfo->workload_stats.reallocs++;
+    tinfo->workload_stats.live_bytes = tinfo->workload_stats.live_bytes - obj->size + new_size;
+    obj->ptr = ptr;
+    obj->size = new_size;
+}
+
+static void expire_workload_objects(struct thread_info_entry *tinfo, struct workload_state *state, long op) {
+    for (size_t i = 0; i < state->count; ) {
+        if (state->objects[i].expires_at >= 0 && state->objects[i].expires_at <= op) {
+            release_workload_object(tinfo, state, i); // moves the last object into slot i
+        } else {
+            i++;
+        }
+    }
+}
+
+static void pace_workload(struct timespec *start, long op) {
+    long long ns = (long long)op * 1000000000LL / workload.ops_per_sec;
+    struct timespec deadline = *start;
+    deadline.tv_sec += ns / 1000000000LL;
+    deadline.tv_nsec += ns % 1000000000LL;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+}
+
+/*
+ * Drives the thread through workload.ops operations. Each operation frees a
+ * random live object (free_percent), grows one with realloc (realloc_percent)
+ * or allocates a new object with a size from the configured distribution.
+ * Objects older than lifetime_ops are freed as well; the live set is scanned
+ * every lifetime_ops/4 operations, which keeps the amortized cost per
+ * operation constant. Producers hand every object they free over to their
+ * consumer instead of freeing it themselves.
+ */
+int run_workload(struct thread_info_entry *tinfo, struct workload_state *state) {
+    memset(state, 0, sizeof(*state));
+    state->rng = 0x9E3779B97F4A7C15ULL ^ ((unsigned long long)(tinfo->thread_id + 1) * 0xBF58476D1CE4E5B9ULL);
+
+    long expire_interval = workload.lifetime_ops / 4 > 0 ? workload.lifetime_ops / 4 : 1;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (long op = 0; op < workload.ops; op++) {
+        int roll = (int)(workload_random(state) % 100);
+
+        if (workload.lifetime_ops > 0 && op % expire_interval == 0) {
+            expire_workload_objects(tinfo, state, op);
+        }
+
+        if (state->count > 0 && roll < workload.free_percent) {
+            release_workload_object(tinfo, state, workload_random(state) % state->count);
+        } else if (state->count > 0 && roll < workload.free_percent + workload.realloc_percent) {
+            grow_workload_object(tinfo, state, workload_random(state) % state->count);
+        } else if (allocate_workload_object(tinfo, state, op) != 0) {
+            fprintf(stderr, "Thread %ld failed to grow its workload object table\n", tinfo->thread_id);
+            return -1;
+        }
+
+        if (tinfo->workload_stats.live_bytes > tinfo->workload_stats.peak_live_bytes) {
+            tinfo->workload_stats.peak_live_bytes = tinfo->workload_stats.live_bytes;
+        }
+        if (workload.ops_per_sec > 0 && (op & 63) == 63) {
+            pace_workload(&start, op + 1);
+        }
+    }
+
+    tinfo->workload_stats.live_objects = state->count;
+    return 0;
+}
+
+/*
+ * Consumer side of a producer/consumer pair: frees everything the producer
+ * hands over. The consumer owns its own arena (attached by the anchor
+ * allocation), so every free here is a free into a foreign arena.
+ */
+int run_workload_consumer(struct thread_info_entry *tinfo, struct workload_state *state) {
+    memset(state, 0, sizeof(*state));
+    state->arena_anchor = allocator->allocate(1);
+
+    struct handoff_queue *queue = tinfo->handoff;
+    pthread_mutex_lock(&queue->lock);
+    for (;;) {
+        while (queue->count == 0 && !queue->producer_done) {
+            pthread_cond_wait(&queue->cond, &queue->lock);
+        }
+        if (queue->count == 0) {
+            break;
+        }
+        void *ptr = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_mutex_unlock(&queue->lock);
+
+        allocator->release(ptr);
+        tinfo->workload_stats.remote_frees++;
+
+        pthread_mutex_lock(&queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+/*
+ * Publishes the objects still alive after the workload as the malloc info
+ * entries of the thread, so they show up in the memory map output.
+ */
+void record_workload_objects(struct thread_info_entry *tinfo, struct workload_state *state) {
+    free(tinfo->malloc_info_entries);
+    tinfo->malloc_info_entries = NULL;
+    tinfo->malloc_entry_count = 0;
+    if (state->count == 0) {
+        return;
+    }
+
+    tinfo->malloc_info_entries = malloc(sizeof(struct malloc_info_entry) * state->count);
+    if (!tinfo->malloc_info_entries) {
+        fprintf(stderr, "Thread %ld failed to allocate memory for malloc info entries\n", tinfo->thread_id);
+        return;
+    }
+    for (size_t i = 0; i < state->count; i++) {
+        tinfo->malloc_info_entries[i].malloc_start_address = (unsigned long long) state->objects[i].ptr;
+        tinfo->malloc_info_entries[i].malloc_size = state->objects[i].size;
+        tinfo->malloc_info_entries[i].malloc_end_address = (unsigned long long) state->objects[i].ptr + state->objects[i].size;
+    }
+    tinfo->malloc_entry_count = state->count;
+}
+
+void free_workload_state(struct workload_state *state) {
+    for (size_t i = 0; i < state->count; i++) {
+        allocator->release(state->objects[i].ptr);
+    }
+    free(state->objects);
+    allocator->release(state->arena_anchor);
+    memset(state, 0, sizeof(*state));
+}
+
+static const char *counter_source_name(enum counter_source source) {
+    switch (source) {
+        case COUNTER_SOURCE_PERF:
+            return "perf";
+        case COUNTER_SOURCE_PERF_USER:
+            return "perf, user space only";
+        case COUNTER_SOURCE_RUSAGE:
+            return "getrusage";
+        default:
+            return "n/a";
+    }
+}
+
+static void print_phase_counters(const char *name, const char *phase, const struct phase_counters *p,
+                                 const enum counter_source *source) {
+    printf("    %-10s %-5s %10.3f %10.3f %10llu %7llu", name, phase, p->wall_ns / 1e6, p->cpu_ns / 1e6,
+           p->events[COUNTER_FAULTS], p->events[COUNTER_MAJOR_FAULTS]);
+    for (int e = COUNTER_DTLB_MISSES; e <= COUNTER_CYCLES; e++) {
+        if (source[e] == COUNTER_SOURCE_NONE) {
+            printf(" %12s", "n/a");
+        } else {
+            printf(" %12llu", p->events[e]);
+        }
+    }
+    printf("\n");
+}
+
+/*
+ * Per thread and in total what the mallocs and the fill cost, and the price
+ * of every MB that became resident. That is the RSS of the mappings holding
+ * the blocks, a fault can map a whole huge page.
+ */
+void print_counter_summary(struct thread_info_entry *thread_entries, int thread_entry_count, long long resident_kbytes) {
+    static const char *phase_names[COUNTER_PHASES] = { "alloc", "fill" };
+    struct phase_counters total[COUNTER_PHASES];
+    memset(total, 0, sizeof(total));
+    const enum counter_source *source = thread_entries[0].counters.source;
+
+    printf("---------------- Allocation Counters --------------\n");
+    printf("    Faults: %s, dTLB misses: %s, cycles: %s\n", counter_source_name(source[COUNTER_FAULTS]),
+           counter_source_name(source[COUNTER_DTLB_MISSES]), counter_source_name(source[COUNTER_CYCLES]));
+    printf("    %-10s %-5s %10s %10s %10s %7s %12s %12s\n", "Thread", "Phase", "Wall ms", "CPU ms", "Faults", "Major",
+           "dTLB misses", "Cycles");
+    for (int i = 0; i < thread_entry_count; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "%ld", thread_entries[i].thread_id);
+        for (int phase = 0; phase < COUNTER_PHASES; phase++) {
+            const struct phase_counters *p = &thread_entries[i].counters.phases[phase];
+            print_phase_counters(phase ? "" : name, phase_names[phase], p, source);
+            total[phase].wall_ns += p->wall_ns;
+            total[phase].cpu_ns += p->cpu_ns;
+            for (int e = 0; e < COUNTER_EVENTS; e++) {
+                total[phase].events[e] += p->events[e];
+            }
+        }
+    }
+    for (int phase = 0; phase < COUNTER_PHASES; phase++) {
+        print_phase_counters(phase ? "" : "Total", phase_names[phase], &total[phase], source);
+    }
+
+    unsigned long long faults = total[COUNTER_ALLOC].events[COUNTER_FAULTS] + total[COUNTER_FILL].events[COUNTER_FAULTS];
+    double mbytes = (double)resident_kbytes / 1024.0;
+    if (mbytes > 0) {
+        printf("    %.1f MB made resident by %llu faults: %.1f us wall, %.1f us CPU", mbytes, faults,
+               (total[COUNTER_ALLOC].wall_ns + total[COUNTER_FILL].wall_ns) / 1e3 / mbytes,
+               (total[COUNTER_ALLOC].cpu_ns + total[COUNTER_FILL].cpu_ns) / 1e3 / mbytes);
+        if (source[COUNTER_CYCLES] != COUNTER_SOURCE_NONE) {
+            printf(", %.0f cycles",
+                   (double)(total[COUNTER_ALLOC].events[COUNTER_CYCLES] + total[COUNTER_FILL].events[COUNTER_CYCLES]) /
+                       mbytes);
+        }
+        if (source[COUNTER_DTLB_MISSES] != COUNTER_SOURCE_NONE) {
+            printf(", %.0f dTLB misses", (double)(total[COUNTER_ALLOC].events[COUNTER_DTLB_MISSES] +
+                                                  total[COUNTER_FILL].events[COUNTER_DTLB_MISSES]) /
+                                             mbytes);
+        }
+        printf(" per MB\n");
+    }
+    printf("---------------------------------------------------\n");
+}
+
+void print_workload_summary(struct thread_info_entry *thread_entries, int thread_entry_count) {
+    static const char *role_names[] = { "solo", "producer", "consumer" };
+    struct workload_stats total;
+    memset(&total, 0, sizeof(total));
+
+    printf("---------------- Workload Summary -----------------\n");
+    for (int i = 0; i < thread_entry_count; i++) {
+        struct workload_stats *st = &thread_entries[i].workload_stats;
+        printf("    Thread %ld (TID: %d) - %s: %ld allocs, %ld frees, %ld reallocs, %ld remote frees, %ld failed, "
+               "%zu live objects (%zu bytes, peak %zu bytes)\n",
+               thread_entries[i].thread_id, thread_entries[i].tid, role_names[thread_entries[i].workload_role],
+               st->allocs, st->frees, st->reallocs, st->remote_frees, st->failed,
+               st->live_objects, st->live_bytes, st->peak_live_bytes);
+        total.allocs += st->allocs;
+        total.frees += st->frees;
+        total.reallocs += st->reallocs;
+        total.remote_frees += st->remote_frees;
+        total.live_objects += st->live_objects;
+        total.live_bytes += st->live_bytes;
+    }
+    printf("    Total: %ld allocs, %ld frees, %ld reallocs, %ld remote frees, %zu live objects (%zu bytes)\n",
+           total.allocs, total.frees, total.reallocs, total.remote_frees, total.live_objects, total.live_bytes);
+
+    // mallinfo2() sums up all arenas, fordblks is what is held but not in use
+    struct mallinfo2 mi = mallinfo2();
+    double fragmentation = mi.arena ? 100.0 * (double)mi.fordblks / (double)mi.arena : 0.0;
+    printf("    Arenas: %zu kB from system, %zu kB in use, %zu kB free (fragmentation %.1f%%), %zu kB releasable, %zu kB mmapped in %zu chunks\n",
+           mi.arena / 1024, mi.uordblks / 1024, mi.fordblks / 1024, fragmentation,
+           mi.keepcost / 1024, mi.hblkhd / 1024, mi.hblks);
+    printf("---------------------------------------------------\n");
+}
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+/*
+ * Log-linear latency buckets: values below 16 ns get their own bucket, above
+ * that every power of two is split into 16 sub-buckets (~6% resolution).
+ */
+static int latency_bucket(unsigned long long ns) {
+    if (ns < LATENCY_SUB_BUCKETS) {
+        return (int)ns;
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    int sub = (int)((ns >> (exponent - 4)) & (LATENCY_SUB_BUCKETS - 1));
+    return (exponent - 3) * LATENCY_SUB_BUCKETS + sub;
+}
+
+static unsigned long long latency_bucket_value(int bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return (unsigned long long)bucket;
+    }
+    int exponent = bucket / LATENCY_SUB_BUCKETS + 3;
+    int sub = bucket % LATENCY_SUB_BUCKETS;
+    return (unsigned long long)(LATENCY_SUB_BUCKETS + sub) << (exponent - 4);
+}
+
+static void record_latency(struct latency_histogram *hist, unsigned long long ns) {
+    hist->counts[latency_bucket(ns)]++;
+    hist->total++;
+}
+
+static void merge_latency_histogram(struct latency_histogram *dst, const struct latency_histogram *src) {
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+}
+
+static unsigned long long latency_percentile(const struct latency_histogram *hist, double percentile) {
+    unsigned long long wanted = (unsigned long long)(percentile * (double)hist->total);
+    unsigned long long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen > wanted) {
+            return latency_bucket_value(i);
+        }
+    }
+    return 0;
+}
+
+static long futex_wait(volatile int *addr, int expected) {
+    return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static long futex_wake(volatile int *addr, int count) {
+    return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/*
+ * The start gate of the benchmark counts down the threads still to come.
+ * A thread that fails before it gets there counts itself off in
+ * mark_thread_ready(), so the others never wait for it.
+ */
+static void leave_benchmark_gate(struct benchmark_result *result) {
+    result->arrived = 1;
+    if (__atomic_sub_fetch(&benchmark_gate, 1, __ATOMIC_RELEASE) == 0) {
+        futex_wake(&benchmark_gate, INT_MAX);
+    }
+}
+
+static void pass_benchmark_gate(struct benchmark_result *result) {
+    leave_benchmark_gate(result);
+    int waiting;
+    while ((waiting = __atomic_load_n(&benchmark_gate, __ATOMIC_ACQUIRE)) > 0) {
+        futex_wait(&benchmark_gate, waiting);
+    }
+}
+
+/*
+ * Timed malloc/free loop run by every thread at the same time (released by
+ * the start gate), so the arenas see the contention of all num_threads threads.
+ * The measured latency includes one clock_gettime() call (vDSO, ~20 ns).
+ */
+int run_benchmark(struct thread_info_entry *tinfo) {
+    struct benchmark_result *result = tinfo->benchmark;
+    struct workload_state rng_state;
+    memset(&rng_state, 0, sizeof(rng_state));
+    rng_state.rng = 0xD1B54A32D192ED03ULL ^ (unsigned long long)(tinfo->thread_id + 1);
+
+    void *window[BENCHMARK_WINDOW];
+    memset(window, 0, sizeof(window));
+
+    pass_benchmark_gate(result);
+
+    unsigned long long start = now_ns();
+    for (long op = 0; op < benchmark_ops; op++) {
+        int slot = (int)(op % BENCHMARK_WINDOW);
+        size_t size = sample_workload_size(&rng_state);
+
+        unsigned long long t0 = now_ns();
+        if (window[slot]) {
+            allocator->release(window[slot]);
+            unsigned long long t1 = now_ns();
+            record_latency(&result->free_latency, t1 - t0);
+            t0 = t1;
+        }
+        window[slot] = allocator->allocate(size);
+        record_latency(&result->malloc_latency, now_ns() - t0);
+        if (!window[slot]) {
+            result->failed++;
+        }
+    }
+    for (int i = 0; i < BENCHMARK_WINDOW; i++) {
+        allocator->release(window[i]);
+    }
+    result->seconds = (double)(now_ns() - start) / 1e9;
+    result->ops = benchmark_ops;
+    return 0;
+}
+
+static void print_latency_line(const char *what, const struct latency_histogram *hist) {
+    printf(" %s p50 %llu ns, p99 %llu ns, p999 %llu ns", what,
+           latency_percentile(hist, 0.50),
+           latency_percentile(hist, 0.99),
+           latency_percentile(hist, 0.999));
+}
+
+double benchmark_ops_per_sec(struct thread_info_entry *thread_entries, int thread_entry_count) {
+    long total_ops = 0;
+    double wall_seconds = 0;
+    for (int i = 0; i < thread_entry_count; i++) {
+        struct benchmark_result *result = thread_entries[i].benchmark;
+        if (!result) {
+            continue;
+        }
+        total_ops += result->ops;
+        if (result->seconds > wall_seconds)
+            wall_seconds = result->seconds;
+    }
+    return wall_seconds > 0 ? (double)total_ops / wall_seconds : 0.0;
+}
+
+void print_benchmark_summary(struct thread_info_entry *thread_entries, int thread_entry_count) {
+    struct latency_histogram *malloc_total = calloc(1, sizeof(struct latency_histogram));
+    struct latency_histogram *free_total = calloc(1, sizeof(struct latency_histogram));
+    if (!malloc_total || !free_total) {
+        fprintf(stderr, "Malloc benchmark histograms failed!\n");
+        free(malloc_total);
+        free(free_total);
+        return;
+    }
+
+    long total_ops = 0, total_failed = 0;
+    double wall_seconds = 0;
+
+    printf("---------------- Benchmark (%s, arena max: ", allocator->name);
+    if (malloc_arena_max > 0)
+        printf("%d", malloc_arena_max);
+    else
+        printf("default");
+    printf(") ----------\n");
+
+    for (int i = 0; i < thread_entry_count; i++) {
+        struct benchmark_result *result = thread_entries[i].benchmark;
+        if (!result) {
+            continue;
+        }
+        printf("    Thread %ld (TID: %d) - %.0f ops/s,", thread_entries[i].thread_id, thread_entries[i].tid,
+               result->seconds > 0 ? (double)result->ops / result->seconds : 0.0);
+        print_latency_line("malloc", &result->malloc_latency);
+        printf(";");
+        print_latency_line("free", &result->free_latency);
+        printf("\n");
+
+        merge_latency_histogram(malloc_total, &result->malloc_latency);
+        merge_latency_histogram(free_total, &result->free_latency);
+        total_ops += result->ops;
+        total_failed += result->failed;
+        if (result->seconds > wall_seconds)
+            wall_seconds = result->seconds;
+    }
+
+    printf("    Total: %ld ops in %.3f s, %.0f ops/s, %ld failed\n", total_ops, wall_seconds,
+           wall_seconds > 0 ? (double)total_ops / wall_seconds : 0.0, total_failed);
+    printf("   ");
+    print_latency_line("malloc", malloc_total);
+    printf(";");
+    print_latency_line("free", free_total);
+    printf("\n");
+    printf("---------------------------------------------------\n");
+
+    free(malloc_total);
+    free(free_total);
+}
+
+/*
+ * Every logical thread reports exactly once, also when it failed or was never
+ * created, the last one wakes up wait_for_threads_to_finish().
+ */
+static void mark_thread_ready(struct thread_info_entry *tinfo, int ok) {
+    tinfo->ready_ns = now_ns();
+    tinfo->finished = ok;
+    if (!ok && tinfo->benchmark && !tinfo->benchmark->arrived) {
+        leave_benchmark_gate(tinfo->benchmark);
+    }
+    if (__atomic_add_fetch(&threads_ready, 1, __ATOMIC_RELEASE) == num_threads) {
+        futex_wake(&threads_ready, 1);
+    }
+}
+
+// Parks a finished thread until stop_threads() clears running, without waking up in between
+static void wait_until_stopped(void) {
+    while (running) {
+        futex_wait(&running, 1);
+    }
+}
+
+// Blocks until reclaim_phase reaches phase, returns the phase reached
+static int wait_for_reclaim_phase(int phase) {
+    int current;
+    while ((current = __atomic_load_n(&reclaim_phase, __ATOMIC_ACQUIRE)) < phase) {
+        futex_wait(&reclaim_phase, current);
+    }
+    return current;
+}
+
+static void ack_reclaim_phase(void) {
+    if (__atomic_add_fetch(&reclaim_acks, 1, __ATOMIC_RELEASE) == reclaim_participants) {
+        futex_wake(&reclaim_acks, 1);
+    }
+}
+
+// The newest allocations, the ones closest to the top chunk of the arena
+static size_t reclaim_share_start(size_t count) {
+    return count - count * (size_t)reclaim_percent / 100;
+}
+
+static void reclaim_free_share(struct thread_info_entry *tinfo, void **allocated_memory,
+                               struct workload_state *workload_state) {
+    if (workload.enabled) {
+        for (size_t i = reclaim_share_start(workload_state->count); i < workload_state->count; i++) {
+            allocator->release(workload_state->objects[i].ptr);
+            workload_state->objects[i].ptr = NULL;
+        }
+    } else if (allocated_memory) {
+        for (size_t i = reclaim_share_start((size_t)malloc_count); i < (size_t)malloc_count; i++) {
+            allocator->release(allocated_memory[i]);
+            allocated_memory[i] = NULL;
+            memset(&tinfo->malloc_info_entries[i], 0, sizeof(struct malloc_info_entry));
+        }
+    }
+}
+
+// Allocates the freed share again the way it was allocated first, timing it and counting the page faults of this thread
+static void reclaim_retouch_share(struct thread_info_entry *tinfo, void **allocated_memory,
+                                  struct workload_state *workload_state) {
+    struct rusage before, after;
+    getrusage(RUSAGE_THREAD, &before);
+    unsigned long long start = now_ns();
+
+    if (workload.enabled) {
+        for (size_t i = reclaim_share_start(workload_state->count); i < workload_state->count; i++) {
+            void *ptr = allocator->allocate(workload_state->objects[i].size);
+            if (ptr) {
+                memset(ptr, 0xAA, workload_state->objects[i].size);
+            }
+            workload_state->objects[i].ptr = ptr;
+        }
+    } else if (allocated_memory) {
+        for (size_t i = reclaim_share_start((size_t)malloc_count); i < (size_t)malloc_count; i++) {
+            allocated_memory[i] = allocator->allocate(malloc_size);
+            if (allocated_memory[i]) {
+                if (malloc_fill_enabled) {
+                    unsigned long long rng = (unsigned long long)i + 1;
+                    touch_block(allocated_memory[i], malloc_size, &touch_patterns[touch_active], &rng);
+                }
+                tinfo->malloc_info_entries[i].malloc_start_address = (unsigned long long) allocated_memory[i];
+                tinfo->malloc_info_entries[i].malloc_size = malloc_size;
+                tinfo->malloc_info_entries[i].malloc_end_address = (unsigned long long) allocated_memory[i] + malloc_size;
+            }
+        }
+    }
+
+    tinfo->retouch_ns = now_ns() - start;
+    getrusage(RUSAGE_THREAD, &after);
+    tinfo->retouch_faults = (after.ru_minflt - before.ru_minflt) + (after.ru_majflt - before.ru_majflt);
+    if (workload.enabled) {
+        record_workload_objects(tinfo, workload_state);
+    }
+}
+
+/*
+ * Thread side of --reclaim: frees its share of the allocations when the main
+ * thread starts RECLAIM_PHASE_FREE and allocates and touches it again in
+ * RECLAIM_PHASE_RETOUCH. Everything below the frame recorded here is idle
+ * stack the main thread may madvise() away in between.
+ */
+static __attribute__((noinline)) void run_reclaim_phases(struct thread_info_entry *tinfo, void **allocated_memory,
+                                                         struct workload_state *workload_state) {
+    tinfo->parked_frame = (unsigned long long)(uintptr_t)__builtin_frame_address(0);
+
+    if (wait_for_reclaim_phase(RECLAIM_PHASE_FREE) != RECLAIM_PHASE_FREE) {
+        return;
+    }
+    reclaim_free_share(tinfo, allocated_memory, workload_state);
+    ack_reclaim_phase();
+
+    if (wait_for_reclaim_phase(RECLAIM_PHASE_RETOUCH) != RECLAIM_PHASE_RETOUCH) {
+        return;
+    }
+    reclaim_retouch_share(tinfo, allocated_memory, workload_state);
+    ack_reclaim_phase();
+}
+
+/*
+ * CPUs the threads are pinned to with --affinity, in the order they are
+ * handed out, and the NUMA node of every CPU. Machines without
+ * /sys/devices/system/node are treated as one node.
+ */
+struct cpu_topology {
+    int cpus[CPU_SETSIZE];
+    int cpu_count;
+    int cpu_node[CPU_SETSIZE];
+    int node_count;
+};
+
+struct cpu_topology topology;
+
+static int parse_cpu_list(const char *list, int node) {
+    const char *p = list;
+    while (*p && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p)
+                return -1;
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            if (cpu >= 0)
+                topology.cpu_node[cpu] = node;
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+int load_cpu_topology(void) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        perror("sched_getaffinity");
+        return -1;
+    }
+
+    memset(&topology, 0, sizeof(topology));
+    topology.node_count = 1;
+    for (int node = 0; node < NUMA_MAX_NODES; node++) {
+        char path[96], list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *file = fopen(path, "r");
+        if (!file)
+            continue;
+        if (fgets(list, sizeof(list), file) && parse_cpu_list(list, node) == 0 && node + 1 > topology.node_count)
+            topology.node_count = node + 1;
+        fclose(file);
+    }
+
+    int allowed_count = CPU_COUNT(&allowed);
+    if (affinity_mode == AFFINITY_SCATTER) {
+        // One CPU of every node in turn
+        for (int round = 0; topology.cpu_count < allowed_count; round++) {
+            for (int node = 0; node < topology.node_count; node++) {
+                int seen = 0;
+                for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                    if (CPU_ISSET(cpu, &allowed) && topology.cpu_node[cpu] == node && seen++ == round) {
+                        topology.cpus[topology.cpu_count++] = cpu;
+                        break;
+                    }
+                }
+            }
+        }
+    } else {
+        // One node after the other
+        for (int node = 0; node < topology.node_count; node++) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &allowed) && topology.cpu_node[cpu] == node)
+                    topology.cpus[topology.cpu_count++] = cpu;
+            }
+        }
+    }
+    return 0;
+}
+
+// Pins the calling thread to the CPU of the index-th thread, returns the CPU it runs on
+static int pin_thread(long index) {
+    if (affinity_mode != AFFINITY_OFF && topology.cpu_count > 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(topology.cpus[index % topology.cpu_count], &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            fprintf(stderr, "Thread %ld could not be pinned to CPU %d\n", index,
+                    topology.cpus[index % topology.cpu_count]);
+        }
+    }
+    return sched_getcpu();
+}
+
+/*
+ * The work of one logical thread: arena probe, benchmark, workload or fixed
+ * mallocs. The allocations stay alive in *allocated_memory/workload_state
+ * until the caller releases them.
+ */
+static int run_thread_work(struct thread_info_entry *tinfo, void ***allocated_memory,
+                           struct workload_state *workload_state) {
+    long thread_id = tinfo->thread_id;
+
+    // Remember where a small malloc lands, that is the arena the thread is attached to
+    void *arena_probe = malloc(1);
+    tinfo->arena_probe_address = (unsigned long long) arena_probe;
+    free(arena_probe);
+    if (tinfo->malloc_entry_count > 0 && tinfo->malloc_info_entries == NULL) {
+        fprintf(stderr, "Thread %ld failed to allocate memory for thread_info_entry pointerrs\n", thread_id);
+        return -1;
+    }
+
+    if (tinfo->benchmark && run_benchmark(tinfo) != 0) {
+        return -1;
+    }
+
+    if (workload.enabled) {
+        int ret = (tinfo->workload_role == WORKLOAD_ROLE_CONSUMER)
+                      ? run_workload_consumer(tinfo, workload_state)
+                      : run_workload(tinfo, workload_state);
+        if (tinfo->workload_role == WORKLOAD_ROLE_PRODUCER) {
+            handoff_queue_finish(tinfo->handoff);
+        }
+        if (ret != 0) {
+            free_workload_state(workload_state);
+            return -1;
+        }
+        record_workload_objects(tinfo, workload_state);
+    } else if (malloc_enabled) {
+        *allocated_memory = malloc_allocate_function(tinfo);
+        if (!*allocated_memory) {
+            return -1;
+        }
+    }
+
+    measure_stack_usage(tinfo);
+    return 0;
+}
+
+void* thread_function(void *arg) {
+    struct thread_info_entry *tinfo = (struct thread_info_entry *)arg;
+    long thread_id = tinfo->thread_id;
+    void *stack_addr = NULL;
+    size_t stack_size;
+    void *stack_end_addr = NULL;
+    void **allocated_memory = NULL;
+    struct workload_state workload_state;
+
+    memset(&workload_state, 0, sizeof(workload_state));
+    // Before anything touches the stack, so its pages come from the node of the CPU
+    tinfo->cpu = pin_thread(thread_id);
+    if (get_stack_info(&stack_addr, &stack_size, &stack_end_addr) != 0) {
+        mark_thread_ready(tinfo, 0);
+        return NULL;
+    }
+
+    // Thread Info Entry Init
+    tinfo->thread_id = thread_id;
+    tinfo->tid = syscall(SYS_gettid);
+    tinfo->stack_start_address = (unsigned long long) stack_addr;
+    tinfo->stack_size = stack_size;
+    tinfo->stack_end_address = (unsigned long long) stack_end_addr;
+    tinfo->stack_peak_bytes = 0;
+    if (thp_mode == THP_MADVISE) {
+        advise_huge_pages(stack_addr, stack_size);
+    }
+    if (stack_usage_method == STACK_USAGE_PAINT) {
+        paint_stack(tinfo);
+    }
+
+    if (run_thread_work(tinfo, &allocated_memory, &workload_state) != 0) {
+        mark_thread_ready(tinfo, 0);
+        return NULL;
+    }
+    mark_thread_ready(tinfo, 1);
+    if (reclaim_strategy != RECLAIM_NONE) {
+        run_reclaim_phases(tinfo, allocated_memory, &workload_state);
+    }
+    wait_until_stopped();
+
+    if (allocated_memory != NULL) {
+        malloc_deallocate_function(allocated_memory);
+        allocated_memory = NULL;
+    }
+    free_workload_state(&workload_state);
+
+    return NULL;
+}
+
+int set_malloc_arena_number(int count) {
+    if (mallopt(M_ARENA_MAX, count) == 0) {
+        fprintf(stderr, "ERROR while trying to set MALLOC_ARENA_MAX\n");
+        return 1;
+    }
+    return 0;
+}
+
+int set_malloc_mmap_threshold_in_bytes(size_t size) {
+    if (mallopt(M_MMAP_THRESHOLD, size) == 0) {
+        fprintf(stderr, "ERROR while trying to set M_MMAP_THRESHOLD\n");
+        return 1;
+    }
+    return 0;
+}
+
+enum long_only_option {
+    OPT_WORKLOAD = 256,
+    OPT_SIZE_DIST,
+    OPT_FREE_PERCENT,
+    OPT_REALLOC_PERCENT,
+    OPT_REALLOC_GROWTH,
+    OPT_LIFETIME,
+    OPT_OPS_PER_SEC,
+    OPT_PRODUCER_CONSUMER,
+    OPT_BENCHMARK,
+    OPT_ALLOCATOR,
+    OPT_SWEEP,
+    OPT_SWEEP_JOBS,
+    OPT_MIN_THROUGHPUT,
+    OPT_FORMAT,
+    OPT_OUTPUT,
+    OPT_STACK_USAGE,
+    OPT_STACK_MARGIN,
+    OPT_PAGE_MAP,
+    OPT_POOL,
+    OPT_SPAWNERS,
+    OPT_RECLAIM,
+    OPT_RECLAIM_PERCENT,
+    OPT_THP,
+    OPT_AFFINITY,
+    OPT_NUMA,
+    OPT_STACK_POOL,
+    OPT_STACK_GUARD,
+    OPT_STACK_COMMIT,
+    OPT_TRACE,
+    OPT_SNAPSHOT,
+    OPT_COMPARE,
+    OPT_FRAGMENTATION,
+    OPT_COUNTERS,
+    OPT_TOUCH
+};
+
+static int add_sweep_value(struct sweep_param *param, long value) {
+    if (param->count >= SWEEP_MAX_VALUES) {
+        fprintf(stderr, "Too many sweep values for -%c (max %d)\n", param->key, SWEEP_MAX_VALUES);
+        return -1;
+    }
+    param->values[param->count++] = value;
+    return 0;
+}
+
+/*
+ * Parses "<key>=<values>" where key is one of n, s, a, t and values is a comma
+ * separated list of numbers or ranges "<start>:<end>[:+<step>|:*<factor>]".
+ */
+int parse_sweep_spec(const char *spec) {
+    struct sweep_param *param = NULL;
+    for (int p = 0; p < SWEEP_PARAM_COUNT; p++) {
+        if (spec[0] == sweep_params[p].key && spec[1] == '=') {
+            param = &sweep_params[p];
+        }
+    }
+    if (!param) {
+        return -1;
+    }
+
+    const char *token = spec + 2;
+    while (*token) {
+        long start, end, step = 1;
+        char op = '+';
+        int consumed = 0;
+
+        if (sscanf(token, "%ld:%ld:%c%ld%n", &start, &end, &op, &step, &consumed) == 4) {
+            if ((op != '+' && op != '*') || step <= (op == '*' ? 1 : 0) || start <= 0 || end < start) {
+                return -1;
+            }
+            for (long v = start; v <= end; v = (op == '*') ? v * step : v + step) {
+                if (add_sweep_value(param, v) != 0)
+                    return -1;
+            }
+        } else if (sscanf(token, "%ld:%ld%n", &start, &end, &consumed) == 2) {
+            if (start <= 0 || end < start) {
+                return -1;
+            }
+            for (long v = start; v <= end; v++) {
+                if (add_sweep_value(param, v) != 0)
+                    return -1;
+            }
+        } else if (sscanf(token, "%ld%n", &start, &consumed) == 1 && start > 0) {
+            if (add_sweep_value(param, start) != 0)
+                return -1;
+        } else {
+            return -1;
+        }
+
+        token += consumed;
+        if (*token == ',') {
+            token++;
+        } else if (*token != '\0') {
+            return -1;
+        }
+    }
+
+    if (param->key == 's') {
+        for (size_t i = 0; i < param->count; i++) {
+            if (param->values[i] < (long)PTHREAD_STACK_MIN) {
+                fprintf(stderr, "Sweep stack size %ld is below %ld bytes\n", param->values[i], (long)PTHREAD_STACK_MIN);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int load_size_histogram(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+
+    size_t capacity = PMAP_INITIAL_CAPACITY;
+    struct size_histogram_bucket *buckets = malloc(sizeof(struct size_histogram_bucket) * capacity);
+    if (!buckets) {
+        fclose(fp);
+        return -1;
+    }
+
+    char line[256];
+    size_t count = 0;
+    double cumulative = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        size_t size;
+        double weight;
+        if (line[0] == '#' || sscanf(line, "%zu %lf", &size, &weight) != 2 || size == 0 || weight <= 0) {
+            continue; // skip comments and malformed lines
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            struct size_histogram_bucket *new_buckets = realloc(buckets, sizeof(struct size_histogram_bucket) * capacity);
+            if (!new_buckets) {
+                free(buckets);
+                fclose(fp);
+                return -1;
+            }
+            buckets = new_buckets;
+        }
+        cumulative += weight;
+        buckets[count].size = size;
+        buckets[count].cumulative_weight = cumulative;
+        count++;
+    }
+    fclose(fp);
+
+    if (count == 0) {
+        fprintf(stderr, "Histogram file %s has no \"<size> <weight>\" lines\n", path);
+        free(buckets);
+        return -1;
+    }
+    workload.histogram = buckets;
+    workload.histogram_count = count;
+    return 0;
+}
+
+int parse_size_distribution(const char *spec) {
+    if (sscanf(spec, "fixed:%zu", &workload.size_min) == 1 && workload.size_min > 0) {
+        workload.size_dist = SIZE_DIST_FIXED;
+        return 0;
+    }
+    if (sscanf(spec, "uniform:%zu:%zu", &workload.size_min, &workload.size_max) == 2 &&
+        workload.size_min > 0 && workload.size_max >= workload.size_min) {
+        workload.size_dist = SIZE_DIST_UNIFORM;
+        return 0;
+    }
+    if (sscanf(spec, "lognormal:%lf:%lf", &workload.lognormal_mu, &workload.lognormal_sigma) == 2 &&
+        workload.lognormal_sigma >= 0) {
+        workload.size_dist = SIZE_DIST_LOGNORMAL;
+        return 0;
+    }
+    if (strncmp(spec, "file:", 5) == 0 && load_size_histogram(spec + 5) == 0) {
+        workload.size_dist = SIZE_DIST_HISTOGRAM;
+        return 0;
+    }
+    return -1;
+}
+
+int parse_reclaim_strategy(const char *spec) {
+    if (strcmp(spec, "trim") == 0) {
+        reclaim_strategy = RECLAIM_TRIM;
+    } else if (strncmp(spec, "trim-threshold:", 15) == 0) {
+        char *end;
+        unsigned long long value = strtoull(spec + 15, &end, 10);
+        if (end == spec + 15 || *end != '\0' || value > INT_MAX) {
+            return -1;
+        }
+        reclaim_strategy = RECLAIM_TRIM_THRESHOLD;
+        reclaim_trim_threshold = (size_t)value;
+    } else if (strcmp(spec, "dontneed") == 0) {
+        reclaim_strategy = RECLAIM_DONTNEED;
+    } else if (strcmp(spec, "free") == 0) {
+        reclaim_strategy = RECLAIM_FREE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// A comma separated list of full, page, stride:<bytes>, random:<percent>, stream and read
+int parse_touch_patterns(const char *spec) {
+    char list[256];
+    snprintf(list, sizeof(list), "%s", spec);
+    char *save = NULL;
+    for (char *token = strtok_r(list, ",", &save); token; token = strtok_r(NULL, ",", &save)) {
+        if (touch_pattern_count == TOUCH_MAX_PATTERNS) {
+            return -1;
+        }
+        struct touch_pattern *p = &touch_patterns[touch_pattern_count];
+        memset(p, 0, sizeof(*p));
+        char *end;
+        if (strcmp(token, "full") == 0) {
+            p->kind = TOUCH_FULL;
+        } else if (strcmp(token, "page") == 0) {
+            p->kind = TOUCH_PAGE;
+        } else if (strncmp(token, "stride:", 7) == 0) {
+            p->kind = TOUCH_STRIDE;
+            p->stride = (size_t)strtoull(token + 7, &end, 10);
+            if (end == token + 7 || *end != '\0' || p->stride == 0) {
+                return -1;
+            }
+        } else if (strncmp(token, "random:", 7) == 0) {
+            p->kind = TOUCH_RANDOM;
+            long percent = strtol(token + 7, &end, 10);
+            if (end == token + 7 || *end != '\0' || percent < 1 || percent > 100) {
+                return -1;
+            }
+            p->percent = (int)percent;
+        } else if (strcmp(token, "stream") == 0) {
+            p->kind = TOUCH_STREAM;
+        } else if (strcmp(token, "read") == 0) {
+            p->kind = TOUCH_READ;
+        } else {
+            return -1;
+        }
+        snprintf(p->name, sizeof(p->name), "%s", token);
+        touch_pattern_count++;
+    }
+    return touch_pattern_count > 0 ? 0 : -1;
+}
+
+int select_output_format(const char *name) {
+    static const char *const names[] = {
+        [OUTPUT_TEXT] = "text",
+        [OUTPUT_JSON] = "json",
+        [OUTPUT_CSV] = "csv",
+        [OUTPUT_BINARY] = "binary",
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(name, names[i]) == 0) {
+            output_format = (enum output_format)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void print_usage(const char *program_name) {
+    printf("Usage: %s [options]\n", program_name);
+    printf("Options:\n");
+    printf("  -n, --num-threads <num>                   Number of threads (default: %d)\n", DEFAULT_NUM_THREADS);
+    printf("  -s, --thread-stack-size <size>            Stack size for each thread in bytes (default: system default)\n");
+    printf("  -m, --malloc-sparse-inside-thread <size>  Allocate memory inside each thread without initialization\n");
+    printf("  -f, --malloc-filled-inside-thread <size>  Allocate memory inside each thread and fill with 0xAA\n");
+    printf("  -c, --count-of-mallocs <number>           Number of malloc calls inside each thread (default: %d)\n", DEFAULT_MALLOC_COUNT);
+    printf("  -a, --malloc-arena-max <size>             Set number of arenas via MALLOC_ARENA_MAX (default: depends on arch and cpu core count)\n");
     printf("  -t, --mmap-threshold <size>               Set threshold number of bytes by which memory allocations are done via mmap instead of using heap/arenas (default: 131072)\n");
+    printf("  -w, --watch <interval>                    Keep the threads alive and print the changes of the memory map every <interval> ms until Ctrl+C\n");
+    printf("      --workload <ops>                      Run <ops> allocation workload operations per thread instead of the fixed mallocs\n");
+    printf("      --size-dist <spec>                    Workload size distribution: fixed:<size>, uniform:<min>:<max>, lognormal:<mu>:<sigma>\n");
+    printf("                                            or file:<path> with \"<size> <weight>\" lines (default: fixed:<-m/-f size or %d>)\n", DEFAULT_WORKLOAD_SIZE);
+    printf("      --free-percent <pct>                  Percentage of workload operations freeing a random live object (default: 0)\n");
+    printf("      --realloc-percent <pct>               Percentage of workload operations growing a random live object (default: 0)\n");
+    printf("      --realloc-growth <factor>             Growth factor used for workload reallocs (default: %.1f)\n", DEFAULT_REALLOC_GROWTH);
+    printf("      --lifetime <ops>                      Free workload objects after <ops> operations (default: live until shutdown)\n");
+    printf("      --ops-per-sec <rate>                  Limit the workload churn rate of each thread (default: unlimited)\n");
+    printf("      --producer-consumer                   Pair up threads, the second thread of each pair frees what the first one allocated\n");
+    printf("      --benchmark <ops>                     Run <ops> timed malloc/free calls in all threads at once and report throughput and latency\n");
+    printf("      --allocator <glibc|pool>              Allocator backend used inside the threads, pool is a per-thread slab allocator (default: glibc)\n");
+    printf("      --sweep <key>=<values>                Sweep -n, -s, -a or -t (key n, s, a, t) over a list \"1,2,4\" or range \"<start>:<end>[:+<step>|:*<factor>]\",\n");
+    printf("                                            can be given once per key, each configuration runs in its own child process\n");
+    printf("      --sweep-jobs <num>                    Number of sweep configurations run in parallel (default: 1, keep 1 for --benchmark numbers)\n");
+    printf("      --min-throughput <ops/s>              Only recommend sweep configurations reaching this --benchmark throughput\n");
+    printf("      --format <text|json|csv|binary>       Output format of the memory map report (default: text)\n");
+    printf("      --output <path>                       Write the --format report to <path> instead of stdout\n");
+    printf("      --stack-usage <mincore|paint>         Measure the peak stack usage of each thread from resident pages or a painted stack\n");
+    printf("                                            and recommend a -s value\n");
+    printf("      --stack-margin <pct>                  Safety margin added to the peak stack usage for the -s recommendation (default: %d)\n", DEFAULT_STACK_MARGIN);
+    printf("      --page-map <summary|full>             Show the resident, THP, zero, swapped and untouched pages of every heap and stack\n");
+    printf("                                            mapping from /proc/<pid>/pagemap, full prints one character per page\n");
+    printf("      --pool <workers>                      Run the -n logical threads as tasks on <workers> work-stealing pool threads\n");
+    printf("                                            and compare with one thread per task\n");
+    printf("      --spawners <num>                      Create the threads from <num> spawner threads in parallel, report pthread_create\n");
+    printf("                                            latency, time to ready and the limit hit if not all threads could be created\n");
+    printf("      --reclaim <strategy>                  Free part of the allocations, then apply trim, trim-threshold:<bytes>, dontneed or free\n");
+    printf("                                            (madvise on idle stack and arena top pages) and report RSS reclaimed and retouch cost\n");
+    printf("      --reclaim-percent <pct>               Percentage of each thread's allocations freed for --reclaim (default: %d)\n", DEFAULT_RECLAIM_PERCENT);
+    printf("      --thp <mode>                          Back the workload with transparent huge pages, madvise (MADV_HUGEPAGE on arenas,\n");
+    printf("                                            stacks and large blocks) or tunable (re-exec with %s),\n", THP_TUNABLE_SETTING);
+    printf("                                            report AnonHugePages per region, RSS inflation and page access gain\n");
+    printf("      --affinity <mode>                     Pin the threads to CPUs, compact (node after node) or scatter (across nodes)\n");
+    printf("      --numa                                Report the resident pages of every arena, the stacks and the rest per NUMA node\n");
+    printf("      --stack-pool                          Carve all thread stacks from one reservation with pthread_attr_setstack()\n");
+    printf("                                            and compare VSZ, mappings and creation time with glibc stacks\n");
+    printf("      --stack-guard <bytes>                 Guard below every thread stack, 0 for none (default: one page)\n");
+    printf("      --stack-commit <lazy|eager>           Fault --stack-pool stacks in when touched or populate them up front (default: lazy)\n");
+    printf("      --trace <file>                        Trace every malloc/free/calloc/realloc/memalign of the process into a binary file\n");
+    printf("      --snapshot <file>                     Write the classified map to a compact binary snapshot file\n");
+    printf("      --compare <old> <new>                 Compare two snapshot files region by region and exit\n");
+    printf("      --fragmentation                       Report free bytes per bin class, largest free chunk, top chunk and fragmentation of every arena\n");
+    printf("      --counters                            Count page faults, dTLB misses and cycles of the -m/-f mallocs and the fill per thread\n");
+    printf("                                            with perf_event_open(), or getrusage() faults, and report the price per MB made resident\n");
+    printf("      --touch <patterns>                    Touch the -f blocks with full, page, stride:<bytes>, random:<pct>, stream (non-temporal)\n");
+    printf("                                            or read instead of memset, a comma list runs each pattern and reports GB/s, RSS and Dirty\n");
+    printf("  -p, --pid <pid>                           Analyze the memory map of an already running process instead of starting threads\n");
     printf("  -h, --help                                Show this help message\n");
 }
 
-void parse_arguments(int *argc, char *argv[]) {
-    int opt;
-    int option_index = 0;
-    extern int optind;
+static size_t default_thread_stack_size(void) {
+    pthread_attr_t attr;
+    size_t size = 0;
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr, &size);
+    pthread_attr_destroy(&attr);
+    return size;
+}
+
+void parse_arguments(int *argc, char *argv[]) {
+    int opt;
+    int option_index = 0;
+    extern int optind;
+
+    // Define the options
+    static struct option long_options[] = {
+        {"num-threads", required_argument, 0, 'n'},
+        {"thread-stack-size", required_argument, 0, 's'},
+        {"malloc-sparse-inside-thread", required_argument, 0, 'm'},
+        {"malloc-filled-inside-thread", required_argument, 0, 'f'},
+        {"count-of-mallocs", required_argument, 0, 'c'},
+        {"malloc-arena-max", required_argument, 0, 'a'},
+        {"mmap-threshold", required_argument, 0, 't'},
+        {"watch", required_argument, 0, 'w'},
+        {"workload", required_argument, 0, OPT_WORKLOAD},
+        {"size-dist", required_argument, 0, OPT_SIZE_DIST},
+        {"free-percent", required_argument, 0, OPT_FREE_PERCENT},
+        {"realloc-percent", required_argument, 0, OPT_REALLOC_PERCENT},
+        {"realloc-growth", required_argument, 0, OPT_REALLOC_GROWTH},
+        {"lifetime", required_argument, 0, OPT_LIFETIME},
+        {"ops-per-sec", required_argument, 0, OPT_OPS_PER_SEC},
+        {"producer-consumer", no_argument, 0, OPT_PRODUCER_CONSUMER},
+        {"benchmark", required_argument, 0, OPT_BENCHMARK},
+        {"allocator", required_argument, 0, OPT_ALLOCATOR},
+        {"sweep", required_argument, 0, OPT_SWEEP},
+        {"sweep-jobs", required_argument, 0, OPT_SWEEP_JOBS},
+        {"min-throughput", required_argument, 0, OPT_MIN_THROUGHPUT},
+        {"format", required_argument, 0, OPT_FORMAT},
+        {"output", required_argument, 0, OPT_OUTPUT},
+        {"stack-usage", required_argument, 0, OPT_STACK_USAGE},
+        {"stack-margin", required_argument, 0, OPT_STACK_MARGIN},
+        {"page-map", required_argument, 0, OPT_PAGE_MAP},
+        {"pool", required_argument, 0, OPT_POOL},
+        {"spawners", required_argument, 0, OPT_SPAWNERS},
+        {"reclaim", required_argument, 0, OPT_RECLAIM},
+        {"reclaim-percent", required_argument, 0, OPT_RECLAIM_PERCENT},
+        {"thp", required_argument, 0, OPT_THP},
+        {"affinity", required_argument, 0, OPT_AFFINITY},
+        {"numa", no_argument, 0, OPT_NUMA},
+        {"stack-pool", no_argument, 0, OPT_STACK_POOL},
+        {"stack-guard", required_argument, 0, OPT_STACK_GUARD},
+        {"stack-commit", required_argument, 0, OPT_STACK_COMMIT},
+        {"trace", required_argument, 0, OPT_TRACE},
+        {"snapshot", required_argument, 0, OPT_SNAPSHOT},
+        {"compare", required_argument, 0, OPT_COMPARE},
+        {"fragmentation", no_argument, 0, OPT_FRAGMENTATION},
+        {"counters", no_argument, 0, OPT_COUNTERS},
+        {"touch", required_argument, 0, OPT_TOUCH},
+        {"pid", required_argument, 0, 'p'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(*argc, argv, "n:s:m:f:c:a:t:w:p:h", long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 'n':
+                if (sscanf(optarg, "%d", &num_threads) != 1 || num_threads <= 0) {
+                    fprintf(stderr, "Invalid number of threads: %s. Must be a positive integer.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                stack_size_given = 1;
+                if (sscanf(optarg, "%zu", &stack_size) != 1 || stack_size < (size_t)PTHREAD_STACK_MIN) {
+                    fprintf(stderr, "Invalid stack size: %s. Must be at least %ld bytes.\n", optarg, PTHREAD_STACK_MIN);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                malloc_enabled = 1;
+                malloc_fill_enabled = 0;
+                if (sscanf(optarg, "%zu", &malloc_size) != 1 || malloc_size <= 0) {
+                    fprintf(stderr, "Invalid malloc size: %s. Must be a positive integer.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'f':
+                malloc_enabled = 1;
+                malloc_fill_enabled = 1;
+                if (sscanf(optarg, "%zu", &malloc_size) != 1 || malloc_size <= 0) {
+                    fprintf(stderr, "Invalid malloc size: %s. Must be a positive integer.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                if (sscanf(optarg, "%d", &malloc_count) != 1 || malloc_count <= 0) {
+                    fprintf(stderr, "Invalid count of mallocs: %s. Must be a positive integer.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'a':
+                int arenas = 0;
+                if (sscanf(optarg, "%d", &arenas) != 1 || arenas <= 0) {
+                    fprintf(stderr, "Invalid number of arenas: %s. Must be a positive integer.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                if (set_malloc_arena_number(arenas) != 0)
+                    exit(EXIT_FAILURE);
+                malloc_arena_max = arenas;
+                break;
+            case 't':
+                int mmap_threshold = 0;
+                if (sscanf(optarg, "%d", &mmap_threshold) != 1 || mmap_threshold <= 0) {
+                    fprintf(stderr, "Invalid size of mmap threshold: %s. Must be a positive integer.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                if (set_malloc_mmap_threshold_in_bytes(mmap_threshold) != 0)
+                    exit(EXIT_FAILURE);
+                malloc_mmap_threshold = mmap_threshold;
+                break;
+            case 'w':
+                if (sscanf(optarg, "%d", &watch_interval_ms) != 1 || watch_interval_ms <= 0) {
+                    fprintf(stderr, "Invalid watch interval: %s. Must be a positive number of milliseconds.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_WORKLOAD:
+                workload.enabled = 1;
+                if (sscanf(optarg, "%ld", &workload.ops) != 1 || workload.ops <= 0) {
+                    fprintf(stderr, "Invalid number of workload operations: %s. Must be a positive integer.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_SIZE_DIST:
+                if (parse_size_distribution(optarg) != 0) {
+                    fprintf(stderr, "Invalid size distribution: %s.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_FREE_PERCENT:
+                if (sscanf(optarg, "%d", &workload.free_percent) != 1 || workload.free_percent < 0 || workload.free_percent > 100) {
+                    fprintf(stderr, "Invalid free percentage: %s. Must be between 0 and 100.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_REALLOC_PERCENT:
+                if (sscanf(optarg, "%d", &workload.realloc_percent) != 1 || workload.realloc_percent < 0 || workload.realloc_percent > 100) {
+                    fprintf(stderr, "Invalid realloc percentage: %s. Must be between 0 and 100.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_REALLOC_GROWTH:
+                if (sscanf(optarg, "%lf", &workload.realloc_growth) != 1 || workload.realloc_growth <= 0) {
+                    fprintf(stderr, "Invalid realloc growth factor: %s. Must be a positive number.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_LIFETIME:
+                if (sscanf(optarg, "%ld", &workload.lifetime_ops) != 1 || workload.lifetime_ops <= 0) {
+                    fprintf(stderr, "Invalid object lifetime: %s. Must be a positive integer.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_OPS_PER_SEC:
+                if (sscanf(optarg, "%ld", &workload.ops_per_sec) != 1 || workload.ops_per_sec <= 0) {
+                    fprintf(stderr, "Invalid workload rate: %s. Must be a positive integer.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_PRODUCER_CONSUMER:
+                workload.producer_consumer = 1;
+                break;
+            case OPT_BENCHMARK:
+                if (sscanf(optarg, "%ld", &benchmark_ops) != 1 || benchmark_ops <= 0) {
+                    fprintf(stderr, "Invalid number of benchmark operations: %s. Must be a positive integer.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_ALLOCATOR:
+                if (select_allocator_backend(optarg) != 0) {
+                    fprintf(stderr, "Invalid allocator: %s. Must be glibc or pool.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_SWEEP:
+                sweep_enabled = 1;
+                if (parse_sweep_spec(optarg) != 0) {
+                    fprintf(stderr, "Invalid sweep: %s.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_SWEEP_JOBS:
+                if (sscanf(optarg, "%d", &sweep_jobs) != 1 || sweep_jobs <= 0) {
+                    fprintf(stderr, "Invalid number of sweep jobs: %s. Must be a positive integer.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_MIN_THROUGHPUT:
+                if (sscanf(optarg, "%lf", &sweep_min_throughput) != 1 || sweep_min_throughput <= 0) {
+                    fprintf(stderr, "Invalid throughput floor: %s. Must be a positive number.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_FORMAT:
+                if (select_output_format(optarg) != 0) {
+                    fprintf(stderr, "Invalid format: %s. Must be text, json, csv or binary.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_OUTPUT:
+                output_path = optarg;
+                break;
+            case OPT_STACK_USAGE:
+                if (strcmp(optarg, "mincore") == 0) {
+                    stack_usage_method = STACK_USAGE_MINCORE;
+                } else if (strcmp(optarg, "paint") == 0) {
+                    stack_usage_method = STACK_USAGE_PAINT;
+                } else {
+                    fprintf(stderr, "Invalid stack usage method: %s. Must be mincore or paint.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_STACK_MARGIN:
+                if (sscanf(optarg, "%d", &stack_usage_margin) != 1 || stack_usage_margin < 0) {
+                    fprintf(stderr, "Invalid stack margin: %s. Must be a non-negative percentage.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_PAGE_MAP:
+                if (strcmp(optarg, "summary") == 0) {
+                    page_map_mode = PAGE_MAP_SUMMARY;
+                } else if (strcmp(optarg, "full") == 0) {
+                    page_map_mode = PAGE_MAP_FULL;
+                } else {
+                    fprintf(stderr, "Invalid page map mode: %s. Must be summary or full.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_POOL:
+                if (sscanf(optarg, "%d", &pool_workers) != 1 || pool_workers <= 0) {
+                    fprintf(stderr, "Invalid number of pool workers: %s. Must be a positive integer.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_SPAWNERS:
+                if (sscanf(optarg, "%d", &spawner_count) != 1 || spawner_count <= 0) {
+                    fprintf(stderr, "Invalid number of spawners: %s. Must be a positive integer.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_RECLAIM:
+                if (parse_reclaim_strategy(optarg) != 0) {
+                    fprintf(stderr, "Invalid reclaim strategy: %s. Must be trim, trim-threshold:<bytes>, dontneed or free.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_RECLAIM_PERCENT:
+                if (sscanf(optarg, "%d", &reclaim_percent) != 1 || reclaim_percent < 0 || reclaim_percent > 100) {
+                    fprintf(stderr, "Invalid reclaim percentage: %s. Must be between 0 and 100.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_THP:
+                if (strcmp(optarg, "madvise") == 0) {
+                    thp_mode = THP_MADVISE;
+                } else if (strcmp(optarg, "tunable") == 0) {
+                    thp_mode = THP_TUNABLE;
+                } else {
+                    fprintf(stderr, "Invalid THP mode: %s. Must be madvise or tunable.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_AFFINITY:
+                if (strcmp(optarg, "compact") == 0) {
+                    affinity_mode = AFFINITY_COMPACT;
+                } else if (strcmp(optarg, "scatter") == 0) {
+                    affinity_mode = AFFINITY_SCATTER;
+                } else {
+                    fprintf(stderr, "Invalid affinity: %s. Must be compact or scatter.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_NUMA:
+                numa_report = 1;
+                break;
+            case OPT_STACK_POOL:
+                stack_pool_enabled = 1;
+                break;
+            case OPT_TRACE:
+                trace_path = optarg;
+                break;
+            case OPT_SNAPSHOT:
+                snapshot_path = optarg;
+                break;
+            case OPT_FRAGMENTATION:
+                fragmentation_report = 1;
+                break;
+            case OPT_COUNTERS:
+                counters_enabled = 1;
+                break;
+            case OPT_TOUCH:
+                if (parse_touch_patterns(optarg) != 0) {
+                    fprintf(stderr, "Invalid touch patterns: %s. Must be up to %d of full, page, stride:<bytes>, "
+                                    "random:<percent>, stream or read.\n", optarg, TOUCH_MAX_PATTERNS);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_COMPARE:
+                if (optind >= *argc) {
+                    fprintf(stderr, "--compare needs an old and a new snapshot\n");
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                compare_paths[0] = optarg;
+                compare_paths[1] = argv[optind++];
+                break;
+            case OPT_STACK_GUARD: {
+                // strtoull() would take "-1" as the largest size
+                char *end;
+                errno = 0;
+                unsigned long long guard = strtoull(optarg, &end, 10);
+                if (optarg[0] == '-' || end == optarg || *end != '\0' || errno == ERANGE || guard > SIZE_MAX) {
+                    fprintf(stderr, "Invalid guard size: %s\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                stack_guard_size = (size_t)guard;
+                stack_guard_given = 1;
+                break;
+            }
+            case OPT_STACK_COMMIT:
+                if (strcmp(optarg, "lazy") == 0) {
+                    stack_commit_eager = 0;
+                } else if (strcmp(optarg, "eager") == 0) {
+                    stack_commit_eager = 1;
+                } else {
+                    fprintf(stderr, "Invalid stack commit: %s. Must be lazy or eager.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                if (sscanf(optarg, "%d", &attach_pid) != 1 || attach_pid <= 0) {
+                    fprintf(stderr, "Invalid pid: %s. Must be a positive integer.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (workload.free_percent + workload.realloc_percent > 100) {
+        fprintf(stderr, "Free and realloc percentage must not add up to more than 100.\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((workload.enabled || benchmark_ops > 0) && workload.size_dist == SIZE_DIST_FIXED && workload.size_min == 0) {
+        workload.size_min = malloc_size ? malloc_size : DEFAULT_WORKLOAD_SIZE;
+    }
+
+    // With the pool backend glibc only serves bookkeeping, keep that in the main arena. main() sets the
+    // limit after the glibc baseline has forked, the baseline runs with the default arenas
+    if (strcmp(allocator->name, "pool") == 0 && malloc_arena_max == 0) {
+        pool_arena_limit = 1;
+        malloc_arena_max = 1;
+    }
+
+    if (sweep_enabled) {
+        // Parameters that are not swept keep their single (possibly default) value
+        long defaults[SWEEP_PARAM_COUNT] = {
+            [SWEEP_THREADS] = num_threads,
+            [SWEEP_STACK_SIZE] = stack_size_given ? (long)stack_size : 0,
+            [SWEEP_ARENA_MAX] = malloc_arena_max,
+            [SWEEP_MMAP_THRESHOLD] = malloc_mmap_threshold,
+        };
+        for (int p = 0; p < SWEEP_PARAM_COUNT; p++) {
+            if (sweep_params[p].count == 0)
+                add_sweep_value(&sweep_params[p], defaults[p]);
+        }
+        if (watch_interval_ms > 0) {
+            fprintf(stderr, "--watch can not be combined with --sweep\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (pool_workers > 0 && (benchmark_ops > 0 || workload.producer_consumer)) {
+        // Both block until all logical threads run at once, which k < n workers can not do
+        fprintf(stderr, "--pool can not be combined with --benchmark or --producer-consumer\n");
+        exit(EXIT_FAILURE);
+    }
+    if (reclaim_strategy != RECLAIM_NONE && (pool_workers > 0 || workload.producer_consumer)) {
+        // The freed share must belong to threads that are still parked with their allocations
+        fprintf(stderr, "--reclaim can not be combined with --pool or --producer-consumer\n");
+        exit(EXIT_FAILURE);
+    }
+    if (spawner_count > 0 && (benchmark_ops > 0 || pool_workers > 0)) {
+        // A thread that could not be created would never reach the benchmark barrier
+        fprintf(stderr, "--spawners can not be combined with --benchmark or --pool\n");
+        exit(EXIT_FAILURE);
+    }
+    if (output_format != OUTPUT_TEXT && sweep_enabled) {
+        fprintf(stderr, "--format can not be combined with --sweep\n");
+        exit(EXIT_FAILURE);
+    }
+    if (thp_mode != THP_OFF && (attach_pid > 0 || sweep_enabled)) {
+        fprintf(stderr, "--thp can not be combined with --pid or --sweep\n");
+        exit(EXIT_FAILURE);
+    }
+    if (trace_path && (attach_pid > 0 || sweep_enabled)) {
+        fprintf(stderr, "--trace can not be combined with --pid or --sweep\n");
+        exit(EXIT_FAILURE);
+    }
+    if (touch_pattern_count > 0 && (!malloc_fill_enabled || workload.enabled || sweep_enabled)) {
+        fprintf(stderr, "--touch replaces the -f fill and can not be combined with -m, --workload or --sweep\n");
+        exit(EXIT_FAILURE);
+    }
+    if (counters_enabled && (!malloc_enabled || workload.enabled || attach_pid > 0 || sweep_enabled)) {
+        fprintf(stderr, "--counters measures the -m/-f mallocs and can not be combined with --workload, --pid or --sweep\n");
+        exit(EXIT_FAILURE);
+    }
+    if (fragmentation_report && (attach_pid > 0 || sweep_enabled)) {
+        // The bins can only be walked in the own process
+        fprintf(stderr, "--fragmentation can not be combined with --pid or --sweep\n");
+        exit(EXIT_FAILURE);
+    }
+    if (snapshot_path && sweep_enabled) {
+        fprintf(stderr, "--snapshot can not be combined with --sweep\n");
+        exit(EXIT_FAILURE);
+    }
+    if (stack_guard_given) {
+        // A guard beyond the stack it protects is a typo, and rounding it up to pages could wrap
+        size_t guard_limit = stack_size_given ? stack_size : default_thread_stack_size();
+        if (stack_guard_size > guard_limit) {
+            fprintf(stderr, "--stack-guard must not be larger than the stack size of %zu bytes\n", guard_limit);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (stack_pool_enabled && (attach_pid > 0 || sweep_enabled)) {
+        fprintf(stderr, "--stack-pool can not be combined with --pid or --sweep\n");
+        exit(EXIT_FAILURE);
+    }
+    if (affinity_mode != AFFINITY_OFF && attach_pid > 0) {
+        fprintf(stderr, "--affinity can not be combined with --pid\n");
+        exit(EXIT_FAILURE);
+    }
+    if (attach_pid > 0 && sweep_enabled) {
+        fprintf(stderr, "--pid can not be combined with --sweep\n");
+        exit(EXIT_FAILURE);
+    }
+    if (sweep_min_throughput > 0 && benchmark_ops == 0) {
+        fprintf(stderr, "--min-throughput needs --benchmark to measure the throughput\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Check if there are any non-option arguments left
+    if (optind < *argc) {
+        fprintf(stderr, "Unknown argument(s): ");
+        while (optind < *argc) {
+            fprintf(stderr, "%s ", argv[optind++]);
+        }
+        fprintf(stderr, "\n");
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void set_stack_size(pthread_attr_t *attr) {
+    if (stack_size_given) {
+        if (pthread_attr_setstacksize(attr, stack_size) != 0) {
+            fprintf(stderr, "Error setting stack size (%zu bytes). Using system default stack size.\n", stack_size);
+        }
+    }
+    if (stack_guard_given && pthread_attr_setguardsize(attr, stack_guard_size) != 0) {
+        fprintf(stderr, "Error setting guard size (%zu bytes). Using system default guard size.\n", stack_guard_size);
+    }
+}
+
+/*
+ * --stack-pool: the stacks of all threads are carved out of one reservation
+ * and handed to pthread_attr_setstack(). Every slot starts with the optional
+ * guard, below the stack as glibc places it. glibc neither caches nor frees
+ * stacks it was given, the reservation is unmapped once the threads are
+ * joined.
+ */
+struct stack_pool {
+    char *base;
+    size_t length;
+    size_t slot_size;
+    size_t guard_size;
+    size_t stack_size;
+    long slots;
+};
+
+struct stack_pool stack_pool;
+
+int create_stack_pool(long slots) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = stack_size_given ? stack_size : default_thread_stack_size();
+    stack_pool.stack_size = (size + page_size - 1) & ~(page_size - 1);
+    // One page like glibc unless --stack-guard is given
+    size_t guard = stack_guard_given ? stack_guard_size : page_size;
+    stack_pool.guard_size = (guard + page_size - 1) & ~(page_size - 1);
+    stack_pool.slot_size = stack_pool.guard_size + stack_pool.stack_size;
+    stack_pool.slots = slots;
+    if (slots > 0 && stack_pool.slot_size > SIZE_MAX / (size_t)slots) {
+        fprintf(stderr, "A stack pool of %ld stacks of %zu bytes does not fit the address space\n", slots,
+                stack_pool.slot_size);
+        return -1;
+    }
+    stack_pool.length = stack_pool.slot_size * (size_t)slots;
+
+    // Lazy commit reserves no swap, pages are charged when a thread first touches them
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | (stack_commit_eager ? 0 : MAP_NORESERVE);
+    void *base = mmap(NULL, stack_pool.length, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap stack pool");
+        return -1;
+    }
+    stack_pool.base = base;
+
+    for (long s = 0; s < slots; s++) {
+        char *slot = stack_pool.base + (size_t)s * stack_pool.slot_size;
+        if (stack_pool.guard_size > 0 && mprotect(slot, stack_pool.guard_size, PROT_NONE) != 0) {
+            perror("mprotect stack guard");
+            return -1;
+        }
+        if (stack_commit_eager &&
+            madvise(slot + stack_pool.guard_size, stack_pool.stack_size, MADV_POPULATE_WRITE) != 0) {
+            perror("madvise MADV_POPULATE_WRITE");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void destroy_stack_pool(void) {
+    if (stack_pool.base) {
+        munmap(stack_pool.base, stack_pool.length);
+    }
+    memset(&stack_pool, 0, sizeof(stack_pool));
+}
+
+// Gives the next thread created with attr the stack of slot, without a pool attr is left alone
+static void use_stack_slot(pthread_attr_t *attr, long slot) {
+    if (stack_pool.base) {
+        char *stack = stack_pool.base + (size_t)slot * stack_pool.slot_size + stack_pool.guard_size;
+        pthread_attr_setstack(attr, stack, stack_pool.stack_size);
+    }
+}
+
+struct handoff_queue *handoff_queues = NULL;
+
+static void assign_workload_role(struct thread_info_entry *entry, long i) {
+    entry->workload_role = WORKLOAD_ROLE_SOLO;
+    entry->handoff = NULL;
+    memset(&entry->workload_stats, 0, sizeof(entry->workload_stats));
+
+    // Pairs are (0,1), (2,3), ... a trailing odd thread runs on its own
+    if (!workload.enabled || !workload.producer_consumer || handoff_queues == NULL ||
+        (i % 2 == 0 && i + 1 >= num_threads)) {
+        return;
+    }
+    entry->workload_role = (i % 2 == 0) ? WORKLOAD_ROLE_PRODUCER : WORKLOAD_ROLE_CONSUMER;
+    entry->handoff = &handoff_queues[i / 2];
+}
+
+int create_handoff_queues(void) {
+    if (!workload.enabled || !workload.producer_consumer || num_threads < 2) {
+        return 0;
+    }
+
+    int pairs = num_threads / 2;
+    handoff_queues = calloc(pairs, sizeof(struct handoff_queue));
+    if (!handoff_queues) {
+        perror("calloc handoff queues");
+        return -1;
+    }
+    for (int i = 0; i < pairs; i++) {
+        pthread_mutex_init(&handoff_queues[i].lock, NULL);
+        pthread_cond_init(&handoff_queues[i].cond, NULL);
+    }
+    return 0;
+}
+
+void free_handoff_queues(void) {
+    if (!handoff_queues) {
+        return;
+    }
+    for (int i = 0; i < num_threads / 2; i++) {
+        pthread_mutex_destroy(&handoff_queues[i].lock);
+        pthread_cond_destroy(&handoff_queues[i].cond);
+        free(handoff_queues[i].items);
+    }
+    free(handoff_queues);
+    handoff_queues = NULL;
+}
+
+/*
+ * One zeroed block for the malloc info entries of all threads instead of a
+ * malloc per thread. Workload threads allocate their own once they are done.
+ */
+static int allocate_malloc_info_block(void) {
+    threads_ready = 0;
+    if (workload.enabled || malloc_count == 0) {
+        return 0;
+    }
+    malloc_info_block = calloc((size_t)num_threads * malloc_count, sizeof(struct malloc_info_entry));
+    if (!malloc_info_block) {
+        perror("calloc malloc info entries");
+        return -1;
+    }
+    return 0;
+}
+
+static int init_thread_info_entry(struct thread_info_entry *entry, long i) {
+    entry->thread_id = i;
+    entry->finished = 0;
+    entry->created = 0;
+    entry->cpu = -1;
+    memset(&entry->counters, 0, sizeof(entry->counters));
+    entry->touch_ns = 0;
+    entry->touch_accessed = 0;
+    entry->stack_start_address = 0;
+    entry->stack_end_address = 0;
+    entry->stack_size = 0;
+    // Workload threads publish their live objects once the workload is done
+    entry->malloc_entry_count = workload.enabled ? 0 : malloc_count;
+    entry->malloc_info_entries = malloc_info_block ? &malloc_info_block[i * malloc_count] : NULL;
+    assign_workload_role(entry, i);
+    entry->benchmark = NULL;
+    if (benchmark_ops > 0) {
+        entry->benchmark = calloc(1, sizeof(struct benchmark_result));
+        if (!entry->benchmark) {
+            perror("calloc benchmark result");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int create_threads(pthread_t *threads, struct thread_info_entry *entry) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+
+    set_stack_size(&attr);
+
+    if (create_handoff_queues() != 0 || allocate_malloc_info_block() != 0 ||
+        (stack_pool_enabled && create_stack_pool(num_threads) != 0)) {
+        pthread_attr_destroy(&attr);
+        return -1;
+    }
+    if (benchmark_ops > 0) {
+        benchmark_gate = num_threads;
+    }
+
+    for (long i = 0; i < num_threads; i++) {
+        if (init_thread_info_entry(&entry[i], i) != 0) {
+            pthread_attr_destroy(&attr);
+            return -1;
+        }
+
+        entry[i].created = 1;
+        use_stack_slot(&attr, i);
+        if (pthread_create(&threads[i], &attr, thread_function, (void*)&entry[i]) != 0) {
+            perror("pthread_create");
+            pthread_attr_destroy(&attr);
+            return -1;
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+
+    return 0;
+}
+
+void wait_for_threads_to_finish(void) {
+    int ready;
+    while ((ready = __atomic_load_n(&threads_ready, __ATOMIC_ACQUIRE)) < num_threads) {
+        futex_wait(&threads_ready, ready);
+    }
+}
+
+/*
+ * --pool mode: the num_threads logical threads run as tasks on pool_workers
+ * worker threads. Every worker owns a Chase-Lev deque, pops its own tasks
+ * from the bottom and steals from the top of the others once it runs dry.
+ * All tasks are pushed before the workers start, so the deques never grow.
+ */
+struct pool_task {
+    struct thread_info_entry *tinfo;
+    void **allocated_memory;
+    struct workload_state workload_state;
+};
+
+struct task_deque {
+    long top;
+    long bottom;
+    struct pool_task **tasks;
+} __attribute__((aligned(64)));
+
+struct task_pool_worker {
+    pthread_t thread;
+    int index;
+    pid_t tid;
+    unsigned long long stack_start_address;
+    unsigned long long stack_end_address;
+    size_t stack_size;
+    long executed;
+    long stolen;
+    struct task_deque deque;
+};
+
+struct task_pool {
+    struct task_pool_worker *workers;
+    struct pool_task *tasks;
+};
+
+struct task_pool task_pool;
+
+static struct pool_task *task_deque_pop(struct task_deque *deque) {
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, b, __ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+
+    if (t > b) {
+        __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    struct pool_task *task = deque->tasks[b];
+    if (t == b) {
+        // Last task, race the thieves for it
+        if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            task = NULL;
+        }
+        __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+// Returns NULL if the deque is empty, *lost is set if another thread won the race
+static struct pool_task *task_deque_steal(struct task_deque *deque, int *lost) {
+    long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+    if (t >= b) {
+        return NULL;
+    }
+    struct pool_task *task = deque->tasks[t];
+    if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        *lost = 1;
+        return NULL;
+    }
+    return task;
+}
+
+static struct pool_task *next_pool_task(struct task_pool_worker *worker) {
+    struct pool_task *task = task_deque_pop(&worker->deque);
+    if (task) {
+        return task;
+    }
+
+    // No task is ever added again, so a full round without a lost race means all deques are empty
+    int lost;
+    do {
+        lost = 0;
+        for (int i = 1; i < pool_workers; i++) {
+            struct task_pool_worker *victim = &task_pool.workers[(worker->index + i) % pool_workers];
+            task = task_deque_steal(&victim->deque, &lost);
+            if (task) {
+                worker->stolen++;
+                return task;
+            }
+        }
+    } while (lost);
+    return NULL;
+}
+
+static void run_pool_task(struct task_pool_worker *worker, struct pool_task *task) {
+    struct thread_info_entry *tinfo = task->tinfo;
+
+    // A task shares the thread and stack of the worker running it
+    tinfo->tid = worker->tid;
+    tinfo->stack_start_address = worker->stack_start_address;
+    tinfo->stack_size = worker->stack_size;
+    tinfo->stack_end_address = worker->stack_end_address;
+    tinfo->stack_peak_bytes = 0;
+
+    int ret = run_thread_work(tinfo, &task->allocated_memory, &task->workload_state);
+    if (ret != 0) {
+        fprintf(stderr, "Task %ld failed on pool worker %d\n", tinfo->thread_id, worker->index);
+    }
+    worker->executed++;
+    // Tasks share the painted stack, so what this one used is painted again for the next
+    if (stack_usage_method == STACK_USAGE_PAINT) {
+        struct thread_info_entry used = {
+            .stack_start_address = worker->stack_end_address - painted_stack_usage(tinfo),
+        };
+        paint_stack(&used);
+    }
+    mark_thread_ready(tinfo, ret == 0);
+}
+
+void *task_pool_worker_function(void *arg) {
+    struct task_pool_worker *worker = (struct task_pool_worker *)arg;
+    void *stack_addr = NULL;
+    size_t stack_size;
+    void *stack_end_addr = NULL;
+
+    pin_thread(worker - task_pool.workers);
+    if (get_stack_info(&stack_addr, &stack_size, &stack_end_addr) != 0) {
+        return NULL;
+    }
+    worker->tid = syscall(SYS_gettid);
+    worker->stack_start_address = (unsigned long long) stack_addr;
+    worker->stack_size = stack_size;
+    worker->stack_end_address = (unsigned long long) stack_end_addr;
+    if (stack_usage_method == STACK_USAGE_PAINT) {
+        struct thread_info_entry stack = {
+            .stack_start_address = worker->stack_start_address,
+            .stack_end_address = worker->stack_end_address,
+        };
+        paint_stack(&stack);
+    }
+
+    struct pool_task *task;
+    while ((task = next_pool_task(worker)) != NULL) {
+        run_pool_task(worker, task);
+    }
+
+    // Stay alive like the per task threads, so the map still shows the workers
+    wait_until_stopped();
+    return NULL;
+}
+
+int create_task_pool(struct thread_info_entry *entry) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    set_stack_size(&attr);
+
+    if (create_handoff_queues() != 0 || allocate_malloc_info_block() != 0 ||
+        (stack_pool_enabled && create_stack_pool(pool_workers) != 0)) {
+        pthread_attr_destroy(&attr);
+        return -1;
+    }
+
+    long per_worker = (num_threads + pool_workers - 1) / pool_workers;
+    task_pool.workers = calloc(pool_workers, sizeof(struct task_pool_worker));
+    task_pool.tasks = calloc(num_threads, sizeof(struct pool_task));
+    if (!task_pool.workers || !task_pool.tasks) {
+        perror("calloc task pool");
+        pthread_attr_destroy(&attr);
+        return -1;
+    }
+
+    for (int w = 0; w < pool_workers; w++) {
+        task_pool.workers[w].index = w;
+        task_pool.workers[w].deque.tasks = malloc(sizeof(struct pool_task *) * per_worker);
+        if (!task_pool.workers[w].deque.tasks) {
+            perror("malloc task deque");
+            pthread_attr_destroy(&attr);
+            return -1;
+        }
+    }
+
+    // Round robin, so every worker starts with a share and stealing only evens out the tail
+    for (long i = 0; i < num_threads; i++) {
+        if (init_thread_info_entry(&entry[i], i) != 0) {
+            pthread_attr_destroy(&attr);
+            return -1;
+        }
+        task_pool.tasks[i].tinfo = &entry[i];
+        struct task_deque *deque = &task_pool.workers[i % pool_workers].deque;
+        deque->tasks[deque->bottom++] = &task_pool.tasks[i];
+    }
+
+    for (int w = 0; w < pool_workers; w++) {
+        use_stack_slot(&attr, w);
+        if (pthread_create(&task_pool.workers[w].thread, &attr, task_pool_worker_function, &task_pool.workers[w]) != 0) {
+            perror("pthread_create");
+            pthread_attr_destroy(&attr);
+            return -1;
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+void stop_task_pool(void) {
+    running = 0;
+    futex_wake(&running, INT_MAX);
+
+    for (int w = 0; w < pool_workers; w++) {
+        if (task_pool.workers[w].thread) {
+            pthread_join(task_pool.workers[w].thread, NULL);
+        }
+        free(task_pool.workers[w].deque.tasks);
+    }
+    for (long i = 0; i < num_threads; i++) {
+        if (task_pool.tasks[i].allocated_memory != NULL) {
+            malloc_deallocate_function(task_pool.tasks[i].allocated_memory);
+        }
+        free_workload_state(&task_pool.tasks[i].workload_state);
+    }
+    free(task_pool.workers);
+    free(task_pool.tasks);
+    task_pool.workers = NULL;
+    task_pool.tasks = NULL;
+}
+
+void print_task_pool_summary(void) {
+    printf("---------------- Task Pool ------------------------\n");
+    for (int w = 0; w < pool_workers; w++) {
+        struct task_pool_worker *worker = &task_pool.workers[w];
+        printf("    Worker %d (TID: %d): %ld tasks, %ld stolen\n", w, worker->tid, worker->executed, worker->stolen);
+    }
+    printf("---------------------------------------------------\n");
+}
+
+/*
+ * Parallel spawn for --spawners: every spawner thread creates a contiguous
+ * slice of the threads. After the first failed pthread_create() all spawners
+ * stop and mark their remaining entries as not created.
+ */
+struct spawn_slice {
+    pthread_t thread;
+    long begin;
+    long end;
+    pthread_t *threads;
+    struct thread_info_entry *entries;
+};
+
+struct spawn_report {
+    int error;            // errno of the first failed pthread_create(), 0 if all were created
+    long failed_index;
+    double seconds;
+};
+
+struct spawn_report spawn_report;
+
+static void abandon_thread_entry(struct thread_info_entry *entry) {
+    entry->created = 0;
+    entry->malloc_entry_count = 0;
+    if (entry->workload_role == WORKLOAD_ROLE_PRODUCER) {
+        // Its consumer must not wait for a producer that never runs
+        handoff_queue_finish(entry->handoff);
+    }
+    mark_thread_ready(entry, 0);
+}
+
+static void *spawner_function(void *arg) {
+    struct spawn_slice *slice = (struct spawn_slice *)arg;
+    // Every spawner sets the stack slot of its threads in an attr of its own
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    set_stack_size(&attr);
+
+    for (long i = slice->begin; i < slice->end; i++) {
+        struct thread_info_entry *entry = &slice->entries[i];
+        if (init_thread_info_entry(entry, i) != 0 || __atomic_load_n(&spawn_report.error, __ATOMIC_RELAXED)) {
+            abandon_thread_entry(entry);
+            continue;
+        }
+
+        entry->created = 1;
+        entry->spawn_ns = now_ns();
+        use_stack_slot(&attr, i);
+        int err = pthread_create(&slice->threads[i], &attr, thread_function, entry);
+        entry->create_ns = now_ns() - entry->spawn_ns;
+        if (err != 0) {
+            int expected = 0;
+            if (__atomic_compare_exchange_n(&spawn_report.error, &expected, err, 0, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                spawn_report.failed_index = i;
+            }
+            abandon_thread_entry(entry);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    return NULL;
+}
+
+int spawn_threads(pthread_t *threads, struct thread_info_entry *entries) {
+    if (create_handoff_queues() != 0 || allocate_malloc_info_block() != 0 ||
+        (stack_pool_enabled && create_stack_pool(num_threads) != 0)) {
+        return -1;
+    }
+
+    int count = spawner_count < num_threads ? spawner_count : num_threads;
+    struct spawn_slice *slices = calloc(count, sizeof(struct spawn_slice));
+    if (!slices) {
+        perror("calloc spawn slices");
+        return -1;
+    }
+
+    memset(&spawn_report, 0, sizeof(spawn_report));
+    unsigned long long start = now_ns();
+    for (int s = 0; s < count; s++) {
+        slices[s].begin = (long)num_threads * s / count;
+        slices[s].end = (long)num_threads * (s + 1) / count;
+        slices[s].threads = threads;
+        slices[s].entries = entries;
+    }
+
+    // Spawners get small default stacks, they only call pthread_create()
+    pthread_attr_t spawner_attr;
+    pthread_attr_init(&spawner_attr);
+    pthread_attr_setstacksize(&spawner_attr, PTHREAD_STACK_MIN > 65536 ? PTHREAD_STACK_MIN : 65536);
+    int started = 0;
+    for (; started < count; started++) {
+        if (pthread_create(&slices[started].thread, &spawner_attr, spawner_function, &slices[started]) != 0) {
+            break;
+        }
+    }
+    // A missing spawner is replaced by the calling thread
+    for (int s = started; s < count; s++) {
+        spawner_function(&slices[s]);
+    }
+    for (int s = 0; s < started; s++) {
+        pthread_join(slices[s].thread, NULL);
+    }
+    spawn_report.seconds = (double)(now_ns() - start) / 1e9;
+
+    pthread_attr_destroy(&spawner_attr);
+    free(slices);
+    return 0;
+}
+
+static long read_proc_long(const char *path) {
+    long value = -1;
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        if (fscanf(fp, "%ld", &value) != 1)
+            value = -1;
+        fclose(fp);
+    }
+    return value;
+}
+
+static long count_own_mappings(void) {
+    char buffer[SMAPS_READ_BUFFER];
+    long lines = 0;
+    int fd = open("/proc/self/maps", O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t len;
+    while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t i = 0; i < len; i++) {
+            lines += buffer[i] == '\n';
+        }
+    }
+    close(fd);
+    return lines;
+}
+
+/*
+ * pthread_create() reports every resource shortage as EAGAIN, so the limits
+ * it can run into are compared with the current usage to name the likely one.
+ */
+static void print_spawn_limits(long created) {
+    struct rlimit nproc;
+    long threads_max = read_proc_long("/proc/sys/kernel/threads-max");
+    long max_map_count = read_proc_long("/proc/sys/vm/max_map_count");
+    long mappings = count_own_mappings();
+    int have_nproc = getrlimit(RLIMIT_NPROC, &nproc) == 0;
+    const char *likely = "memory (stack mmap or overcommit)";
+
+    printf("    Limits: ");
+    if (have_nproc && nproc.rlim_cur != RLIM_INFINITY) {
+        printf("RLIMIT_NPROC %llu, ", (unsigned long long)nproc.rlim_cur);
+        if ((unsigned long long)created + 1 >= (unsigned long long)nproc.rlim_cur)
+            likely = "RLIMIT_NPROC";
+    } else {
+        printf("RLIMIT_NPROC unlimited, ");
+    }
+    printf("kernel.threads-max %ld, vm.max_map_count %ld (%ld mappings in use)\n", threads_max, max_map_count,
+           mappings);
+    if (threads_max > 0 && created + 1 >= threads_max)
+        likely = "kernel.threads-max";
+    // Every thread needs two mappings, its stack and the guard page below
+    if (max_map_count > 0 && mappings + 2 > max_map_count)
+        likely = "vm.max_map_count";
+    printf("    Likely limit: %s\n", likely);
+}
+
+void print_spawn_summary(struct thread_info_entry *entries) {
+    struct latency_histogram *create_latency = calloc(2, sizeof(struct latency_histogram));
+    if (!create_latency) {
+        return;
+    }
+    struct latency_histogram *ready_latency = &create_latency[1];
+    unsigned long long max_create = 0, max_ready = 0;
+    long created = 0;
+
+    for (int i = 0; i < num_threads; i++) {
+        if (!entries[i].created) {
+            continue;
+        }
+        created++;
+        record_latency(create_latency, entries[i].create_ns);
+        if (entries[i].create_ns > max_create)
+            max_create = entries[i].create_ns;
+        if (entries[i].finished) {
+            unsigned long long ready = entries[i].ready_ns - entries[i].spawn_ns;
+            record_latency(ready_latency, ready);
+            if (ready > max_ready)
+                max_ready = ready;
+        }
+    }
+
+    printf("---------------- Thread Spawn ---------------------\n");
+    printf("    Spawned %ld of %d threads from %d spawner(s) in %.3f s (%.0f threads/s)\n", created, num_threads,
+           spawner_count < num_threads ? spawner_count : num_threads, spawn_report.seconds,
+           spawn_report.seconds > 0 ? created / spawn_report.seconds : 0.0);
+    printf("   ");
+    print_latency_line("pthread_create", create_latency);
+    printf(", max %llu ns\n", max_create);
+    printf("   ");
+    print_latency_line("time to ready", ready_latency);
+    printf(", max %llu ns\n", max_ready);
+    if (spawn_report.error) {
+        printf("    Spawn stopped at thread %ld: %s\n", spawn_report.failed_index, strerror(spawn_report.error));
+        print_spawn_limits(created);
+    }
+    printf("---------------------------------------------------\n");
+    free(create_latency);
+}
+
+struct pmap_entry *get_pmap_analysis(int pid, int *count) {
+    // Prefer reading smaps directly, only fall back to forking pmap if it is not accessible
+    FILE *smaps_fp = open_smaps_file(pid, "smaps");
+    if (smaps_fp) {
+        int capacity = 0;
+        struct pmap_entry *entries = parse_smaps_output(smaps_fp, NULL, &capacity, count);
+        fclose(smaps_fp);
+        if (entries && pid == getpid()) {
+            *count = drop_trace_ring_mappings(entries, *count);
+        }
+        return entries;
+    }
+
+    FILE *fp = execute_pmap_cmd(pid);
+    if (!fp) {
+        return NULL;
+    }
+
+    struct pmap_entry *entries = parse_pmap_output(fp, count);
+
+    pclose(fp);
+
+    if (!entries) {
+        return NULL;
+    }
+    if (pid == getpid()) {
+        *count = drop_trace_ring_mappings(entries, *count);
+    }
+    return entries;
+}
+
+struct pmap_diff_context {
+    struct attribution_index *index;
+    struct thread_info_entry *thread_entries;
+    unsigned long snapshot;
+    double elapsed;
+    int changes;
+};
+
+static void advance_reclaim_phase(int phase) {
+    __atomic_store_n(&reclaim_acks, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&reclaim_phase, phase, __ATOMIC_RELEASE);
+    futex_wake(&reclaim_phase, INT_MAX);
+
+    int acks;
+    while ((acks = __atomic_load_n(&reclaim_acks, __ATOMIC_ACQUIRE)) < reclaim_participants) {
+        futex_wait(&reclaim_acks, acks);
+    }
+}
+
+static size_t madvise_range(unsigned long long start, unsigned long long end, int advice) {
+    unsigned long long page_size = (unsigned long long)sysconf(_SC_PAGESIZE);
+    start = (start + page_size - 1) & ~(page_size - 1);
+    end &= ~(page_size - 1);
+    if (end <= start || madvise((void *)(uintptr_t)start, end - start, advice) != 0) {
+        return 0;
+    }
+    return end - start;
+}
+
+// The unused top chunk of an arena, its header stays untouched
+static size_t madvise_arena_top(struct arena_table *arenas, struct glibc_malloc_state *state, int advice) {
+    unsigned long long top = (unsigned long long)(uintptr_t)state->top;
+    struct arena_heap *heap = find_arena_heap(arenas, top);
+    if (!heap) {
+        return 0;
+    }
+    unsigned long long top_size = ((const size_t *)(uintptr_t)top)[1] & ~(unsigned long long)7;
+    unsigned long long heap_end = heap->arena_index == 0 ? heap->end_address : heap->start_address + heap->size;
+    if (top + top_size > heap_end) {
+        return 0;
+    }
+    return madvise_range(top + 2 * sizeof(size_t), top + top_size, advice);
+}
+
+/*
+ * Without a thread arena nothing points to main_arena. Its top chunk then ends
+ * at the program break and mallinfo2() reports its size as keepcost, as long
+ * as the brk heap was not given up for mmap()ed main arena memory.
+ */
+static size_t madvise_main_arena_top(struct arena_table *arenas, int advice) {
+    unsigned long long brk_end = (unsigned long long)(uintptr_t)sbrk(0);
+    struct arena_heap *heap = find_arena_heap(arenas, brk_end - 1);
+    if (!heap || heap->arena_index != 0 || heap->end_address != brk_end) {
+        printf("    The main arena top chunk was not found at the program break and is left alone\n");
+        return 0;
+    }
+    struct mallinfo2 mi = mallinfo2();
+    if (mi.keepcost > heap->size) {
+        return 0;
+    }
+    unsigned long long top = brk_end - mi.keepcost;
+    return madvise_range(top + 2 * sizeof(size_t), brk_end, advice);
+}
+
+/*
+ * MADV_DONTNEED/MADV_FREE on idle memory: every stack below the frame its
+ * thread is parked in, and the top chunk of every arena. The main arena is
+ * the one the ring of thread arenas points to that is not a thread arena.
+ */
+static size_t madvise_idle_pages(struct thread_info_entry *entries, int advice, size_t *stack_bytes) {
+    *stack_bytes = 0;
+    for (int i = 0; i < num_threads; i++) {
+        if (entries[i].finished && entries[i].parked_frame) {
+            *stack_bytes += madvise_range(entries[i].stack_start_address, entries[i].parked_frame - STACK_PAINT_SAFETY,
+                                          advice);
+        }
+    }
+
+    size_t arena_bytes = 0;
+    int pmap_entry_count = 0;
+    struct pmap_entry *pmap_entries = get_pmap_analysis(getpid(), &pmap_entry_count);
+    struct arena_table arenas;
+    if (pmap_entries && scan_arenas(&arenas, pmap_entries, pmap_entry_count) == 0) {
+        int main_reached = 0;
+        for (size_t a = 1; a < arenas.arena_count; a++) {
+            struct glibc_malloc_state *state = (struct glibc_malloc_state *)(uintptr_t)arenas.arenas[a].arena_address;
+            arena_bytes += madvise_arena_top(&arenas, state, advice);
+            if (find_arena(&arenas, (unsigned long long)(uintptr_t)state->next) < 0) {
+                arena_bytes += madvise_arena_top(&arenas, state->next, advice);
+                main_reached = 1;
+            }
+        }
+        if (!main_reached) {
+            arena_bytes += madvise_main_arena_top(&arenas, advice);
+        }
+        free_arena_table(&arenas);
+    }
+    free(pmap_entries);
+    return arena_bytes;
+}
+
+static const char *reclaim_strategy_name(void) {
+    switch (reclaim_strategy) {
+        case RECLAIM_TRIM:
+            return "malloc_trim(0)";
+        case RECLAIM_TRIM_THRESHOLD:
+            return "M_TRIM_THRESHOLD";
+        case RECLAIM_DONTNEED:
+            return "MADV_DONTNEED";
+        case RECLAIM_FREE:
+            return "MADV_FREE";
+        default:
+            return "none";
+    }
+}
+
+/*
+ * --reclaim: every thread frees reclaim_percent of its allocations, then the
+ * selected strategy is applied and finally the threads allocate and touch the
+ * freed share again. RSS is taken from smaps_rollup after every step.
+ */
+void run_reclaim_experiment(struct thread_info_entry *entries) {
+    struct smaps_counters allocated, freed, reclaimed, retouched;
+    size_t stack_bytes = 0, arena_bytes = 0;
+
+    reclaim_participants = 0;
+    for (int i = 0; i < num_threads; i++) {
+        reclaim_participants += entries[i].finished;
+    }
+
+    read_smaps_rollup(getpid(), &allocated);
+    unsigned long long strategy_ns = 0;
+    if (reclaim_strategy == RECLAIM_TRIM_THRESHOLD) {
+        // Takes effect when the chunks are freed, so it is set before
+        unsigned long long start = now_ns();
+        mallopt(M_TRIM_THRESHOLD, (int)reclaim_trim_threshold);
+        strategy_ns = now_ns() - start;
+    }
+
+    unsigned long long start = now_ns();
+    advance_reclaim_phase(RECLAIM_PHASE_FREE);
+    unsigned long long free_ns = now_ns() - start;
+    read_smaps_rollup(getpid(), &freed);
+
+    start = now_ns();
+    if (reclaim_strategy == RECLAIM_TRIM) {
+        malloc_trim(0);
+    } else if (reclaim_strategy == RECLAIM_DONTNEED || reclaim_strategy == RECLAIM_FREE) {
+        arena_bytes = madvise_idle_pages(entries, reclaim_strategy == RECLAIM_DONTNEED ? MADV_DONTNEED : MADV_FREE,
+                                         &stack_bytes);
+    }
+    if (reclaim_strategy != RECLAIM_TRIM_THRESHOLD) {
+        strategy_ns = now_ns() - start;
+    }
+    read_smaps_rollup(getpid(), &reclaimed);
+
+    advance_reclaim_phase(RECLAIM_PHASE_RETOUCH);
+    read_smaps_rollup(getpid(), &retouched);
+
+    unsigned long long retouch_ns = 0, retouch_max_ns = 0;
+    long retouch_faults = 0;
+    for (int i = 0; i < num_threads; i++) {
+        if (entries[i].finished) {
+            retouch_ns += entries[i].retouch_ns;
+            retouch_faults += entries[i].retouch_faults;
+            if (entries[i].retouch_ns > retouch_max_ns)
+                retouch_max_ns = entries[i].retouch_ns;
+        }
+    }
+
+    printf("---------------- Reclaim: %s ----------------\n", reclaim_strategy_name());
+    printf("    %d%% of the allocations freed in %d threads in %.3f ms\n", reclaim_percent, reclaim_participants,
+           free_ns / 1e6);
+    printf("    RSS kB: %d allocated, %d after free, %d after %s, %d after retouch\n", allocated.rss, freed.rss,
+           reclaimed.rss, reclaim_strategy_name(), retouched.rss);
+    printf("    Reclaimed %d kB RSS (%d kB by the free itself) in %.3f ms", allocated.rss - reclaimed.rss,
+           allocated.rss - freed.rss, strategy_ns / 1e6);
+    if (reclaimed.lazy_free > 0) {
+        printf(", %d kB LazyFree left to the kernel", reclaimed.lazy_free);
+    }
+    printf("\n");
+    if (reclaim_strategy == RECLAIM_DONTNEED || reclaim_strategy == RECLAIM_FREE) {
+        printf("    Advised %zu kB idle stack and %zu kB arena top chunk pages\n", stack_bytes / 1024, arena_bytes / 1024);
+    }
+    printf("    Retouch: %ld page faults, %.3f ms in total, %.3f ms slowest thread", retouch_faults, retouch_ns / 1e6,
+           retouch_max_ns / 1e6);
+    if (allocated.rss > reclaimed.rss) {
+        printf(", %.1f us per reclaimed MB", retouch_ns / 1e3 / ((allocated.rss - reclaimed.rss) / 1024.0));
+    }
+    printf("\n");
+    printf("---------------------------------------------------\n");
+}
+
+static double elapsed_seconds(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - since->tv_sec) + (double)(now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static void print_pmap_diff_entry(struct pmap_diff_context *ctx, char marker, const struct pmap_entry *p_entry,
+                                  int delta_kbytes, int delta_rss, int delta_dirty) {
+    if (ctx->changes++ == 0) {
+        printf("---------------- Snapshot %lu (+%.3f s) ---------------\n", ctx->snapshot, ctx->elapsed);
+    }
+
+    printf("%c %llx %8d %+8d %8d %+8d %8d %+8d %c%c%c %s",
+           marker,
+           p_entry->start_address,
+           p_entry->kbytes, delta_kbytes,
+           p_entry->rss, delta_rss,
+           p_entry->dirty, delta_dirty,
+           p_entry->r, p_entry->w, p_entry->x,
+           p_entry->mapping);
+
+    // Name the owner of the mapping, the same way create_output() groups it
+    if (query_attribution_index(ctx->index, p_entry->start_address, p_entry->end_address) == 0 &&
+        ctx->index->match_count > 0) {
+        const struct attribution_record *rec = ctx->index->matches[0];
+        printf("  (Thread %ld - %s)", ctx->thread_entries[rec->thread_index].thread_id,
+               rec->malloc_index < 0 ? "STACK" : "MALLOC");
+    }
+    printf("\n");
+}
+
+static int pmap_entries_differ(const struct pmap_entry *a, const struct pmap_entry *b) {
+    return a->end_address != b->end_address || a->rss != b->rss || a->dirty != b->dirty ||
+           a->r != b->r || a->w != b->w || a->x != b->x ||
+           strcmp(a->mapping, b->mapping) != 0;
+}
+
+/*
+ * Both snapshots are sorted by start address, so they are merged in a single
+ * linear pass: entries only in the new snapshot are printed as added (+),
+ * entries only in the old one as removed (-) and entries with the same start
+ * address but different size, RSS, Dirty or mode as changed (~).
+ */
+int diff_pmap_snapshots(struct pmap_entry *old_entries, int old_count,
+                        struct pmap_entry *new_entries, int new_count,
+                        struct pmap_diff_context *ctx) {
+    int o = 0, n = 0;
+    long long delta_kbytes = 0, delta_rss = 0, delta_dirty = 0;
+
+    ctx->changes = 0;
+    rewind_attribution_index(ctx->index);
+
+    while (o < old_count || n < new_count) {
+        if (n >= new_count || (o < old_count && old_entries[o].start_address < new_entries[n].start_address)) {
+            struct pmap_entry *p_old = &old_entries[o++];
+            print_pmap_diff_entry(ctx, '-', p_old, -p_old->kbytes, -p_old->rss, -p_old->dirty);
+            delta_kbytes -= p_old->kbytes;
+            delta_rss -= p_old->rss;
+            delta_dirty -= p_old->dirty;
+        } else if (o >= old_count || new_entries[n].start_address < old_entries[o].start_address) {
+            struct pmap_entry *p_new = &new_entries[n++];
+            print_pmap_diff_entry(ctx, '+', p_new, p_new->kbytes, p_new->rss, p_new->dirty);
+            delta_kbytes += p_new->kbytes;
+            delta_rss += p_new->rss;
+            delta_dirty += p_new->dirty;
+        } else {
+            struct pmap_entry *p_old = &old_entries[o++];
+            struct pmap_entry *p_new = &new_entries[n++];
+            if (pmap_entries_differ(p_old, p_new)) {
+                int d_kbytes = p_new->kbytes - p_old->kbytes;
+                int d_rss = p_new->rss - p_old->rss;
+                int d_dirty = p_new->dirty - p_old->dirty;
+                print_pmap_diff_entry(ctx, '~', p_new, d_kbytes, d_rss, d_dirty);
+                delta_kbytes += d_kbytes;
+                delta_rss += d_rss;
+                delta_dirty += d_dirty;
+            }
+        }
+    }
+
+    if (ctx->changes > 0) {
+        printf("total kB delta %+lld VSZ, %+lld RSS, %+lld Dirty (%d changed mappings)\n",
+               delta_kbytes, delta_rss, delta_dirty, ctx->changes);
+        fflush(stdout);
+    }
+    return ctx->changes;
+}
+
+static void stop_watching(int sig) {
+    (void)sig;
+    watching = 0;
+}
+
+static struct pmap_entry *find_pmap_entry(struct pmap_entry *pmap_entries, int pmap_entry_count, unsigned long long address) {
+    int lo = 0, hi = pmap_entry_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (pmap_entries[mid].end_address <= address)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < pmap_entry_count && pmap_entries[lo].start_address <= address) {
+        return &pmap_entries[lo];
+    }
+    return NULL;
+}
+
+/*
+ * Reads the per node page counts of every mapping from numa_maps into
+ * node_kbytes, NUMA_MAX_NODES values per pmap entry. Both lists are sorted
+ * by address and walked together. Returns the highest node seen + 1, or -1
+ * if the kernel has no numa_maps.
+ */
+static int read_numa_maps(int pid, struct pmap_entry *pmap_entries, int pmap_entry_count, long long *node_kbytes) {
+    char path[64], line[SMAPS_MAX_LINE_LEN];
+    snprintf(path, sizeof(path), "/proc/%d/numa_maps", pid);
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+
+    int nodes = 1, m = 0;
+    while (fgets(line, sizeof(line), file)) {
+        char *p = line;
+        unsigned long long start = strtoull(p, &p, 16);
+        while (m < pmap_entry_count && pmap_entries[m].start_address < start)
+            m++;
+        if (m == pmap_entry_count)
+            break;
+        if (pmap_entries[m].start_address != start)
+            continue;
+
+        long long page_kbytes = 4;
+        char *field = strstr(p, "kernelpagesize_kB=");
+        if (field)
+            page_kbytes = strtoll(field + 18, NULL, 10);
+        for (field = strstr(p, " N"); field; field = strstr(field + 2, " N")) {
+            char *end;
+            long node = strtol(field + 2, &end, 10);
+            if (end == field + 2 || *end != '=' || node < 0 || node >= NUMA_MAX_NODES)
+                continue;
+            node_kbytes[(size_t)m * NUMA_MAX_NODES + node] += strtoll(end + 1, NULL, 10) * page_kbytes;
+            if (node + 1 > nodes)
+                nodes = (int)node + 1;
+        }
+    }
+    fclose(file);
+    return nodes;
+}
+
+struct numa_row {
+    char name[32];
+    long long kbytes[NUMA_MAX_NODES];
+};
+
+static void print_numa_row(const struct numa_row *row, int nodes) {
+    long long total = 0;
+    for (int n = 0; n < nodes; n++)
+        total += row->kbytes[n];
+    if (total == 0)
+        return;
+    printf("    %-14s %10lld", row->name, total);
+    for (int n = 0; n < nodes; n++)
+        printf(" %9lld", row->kbytes[n]);
+    printf("\n");
+}
+
+// Only the last CPU a thread of another process ran on is known
+int read_thread_cpu(int pid, pid_t tid) {
+    char path[64], line[1024];
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/stat", pid, (int)tid);
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return -1;
+    char *fields = fgets(line, sizeof(line), file) ? strrchr(line, ')') : NULL;
+    fclose(file);
+    if (!fields)
+        return -1;
+
+    // processor is field 39, the state after the command name is field 3
+    int cpu = -1;
+    char *save = NULL;
+    char *token = strtok_r(fields + 1, " ", &save);
+    for (int field = 3; token; field++, token = strtok_r(NULL, " ", &save)) {
+        if (field == 39) {
+            cpu = atoi(token);
+            break;
+        }
+    }
+    return cpu;
+}
+
+/*
+ * Resident kB of the main heap, every arena, the thread stacks and all other
+ * mappings per NUMA node, and how much of each thread stack lives on the
+ * node of the CPU the thread runs on.
+ */
+void print_numa_summary(int pid, struct pmap_entry *pmap_entries, int pmap_entry_count,
+                        struct thread_info_entry *thread_entries, int thread_entry_count, struct arena_table *arenas) {
+    size_t arena_rows = arenas ? arenas->arena_count : 1;
+    size_t row_count = arena_rows + 2;
+    struct numa_row *rows = calloc(row_count, sizeof(struct numa_row));
+    struct region_class *classes = malloc(sizeof(struct region_class) * (pmap_entry_count ? pmap_entry_count : 1));
+    long long *node_kbytes = calloc((size_t)(pmap_entry_count ? pmap_entry_count : 1) * NUMA_MAX_NODES,
+                                    sizeof(long long));
+    if (!rows || !classes || !node_kbytes ||
+        classify_pmap_entries(pmap_entries, pmap_entry_count, thread_entries, thread_entry_count, arenas, classes) != 0) {
+        free(rows);
+        free(classes);
+        free(node_kbytes);
+        return;
+    }
+
+    int nodes = read_numa_maps(pid, pmap_entries, pmap_entry_count, node_kbytes);
+    int numa_maps_found = nodes > 0;
+    if (!numa_maps_found) {
+        // Without NUMA support in the kernel everything is on node 0
+        nodes = 1;
+        for (int m = 0; m < pmap_entry_count; m++)
+            node_kbytes[(size_t)m * NUMA_MAX_NODES] = pmap_entries[m].rss;
+    }
+    if (topology.node_count > nodes)
+        nodes = topology.node_count;
+
+    snprintf(rows[0].name, sizeof(rows[0].name), "main_heap");
+    for (size_t a = 1; a < arena_rows; a++)
+        snprintf(rows[a].name, sizeof(rows[a].name), "arena %d", arena_display_number(arenas, (int)a));
+    struct numa_row *stacks = &rows[arena_rows], *other = &rows[arena_rows + 1];
+    snprintf(stacks->name, sizeof(stacks->name), "thread_stack");
+    snprintf(other->name, sizeof(other->name), "other");
+
+    for (int m = 0; m < pmap_entry_count; m++) {
+        struct numa_row *row = other;
+        if (classes[m].kind == REGION_THREAD_STACK) {
+            row = stacks;
+        } else if (classes[m].kind == REGION_MAIN_HEAP) {
+            row = &rows[0];
+        } else if (classes[m].kind == REGION_ARENA_HEAP && arenas) {
+            struct arena_heap *heap = find_arena_heap(arenas, pmap_entries[m].start_address);
+            if (heap)
+                row = &rows[heap->arena_index];
+        }
+        for (int n = 0; n < nodes; n++)
+            row->kbytes[n] += node_kbytes[(size_t)m * NUMA_MAX_NODES + n];
+    }
+
+    long long local = 0, remote = 0;
+    int placed = 0;
+    for (int t = 0; t < thread_entry_count; t++) {
+        const struct thread_info_entry *entry = &thread_entries[t];
+        struct pmap_entry *stack = entry->stack_start_address
+                                       ? find_pmap_entry(pmap_entries, pmap_entry_count, entry->stack_start_address)
+                                       : NULL;
+        if (!stack || entry->cpu < 0 || entry->cpu >= CPU_SETSIZE)
+            continue;
+        int node = topology.cpu_node[entry->cpu];
+        const long long *kbytes = &node_kbytes[(size_t)(stack - pmap_entries) * NUMA_MAX_NODES];
+        for (int n = 0; n < nodes; n++) {
+            if (n == node)
+                local += kbytes[n];
+            else
+                remote += kbytes[n];
+        }
+        placed++;
+    }
+
+    printf("---------------- NUMA Placement -------------------\n");
+    printf("    %d node(s)%s, ", nodes, numa_maps_found ? "" : " (no numa_maps, RSS counted on node 0)");
+    if (affinity_mode == AFFINITY_OFF)
+        printf("threads not pinned\n");
+    else
+        printf("threads pinned %s over %d CPUs\n", affinity_mode == AFFINITY_COMPACT ? "compact" : "scatter",
+               topology.cpu_count);
+    printf("    %-14s %10s", "Region", "RSS kB");
+    for (int n = 0; n < nodes; n++) {
+        char column[16];
+        snprintf(column, sizeof(column), "N%d kB", n);
+        printf(" %9s", column);
+    }
+    printf("\n");
+    for (size_t r = 0; r < row_count; r++)
+        print_numa_row(&rows[r], nodes);
+    if (placed > 0 && local + remote > 0) {
+        printf("    Stacks of %d threads: %lld kB (%.1f%%) on the node of their CPU, %lld kB remote\n", placed, local,
+               100.0 * local / (local + remote), remote);
+    }
+    printf("---------------------------------------------------\n");
+
+    free(rows);
+    free(classes);
+    free(node_kbytes);
+}
+
+/*
+ * Prints the classified memory map of pid with its totals and arenas, or
+ * writes it as one snapshot to writer if a machine readable format is used.
+ */
+int report_memory_map(int pid, struct output_writer *writer, unsigned long snapshot, unsigned long long elapsed_ms,
+                      struct pmap_entry *pmap_entries, int pmap_entry_count,
+                      struct thread_info_entry *thread_entries, int thread_entry_count) {
+    struct arena_table arenas;
+    int arenas_found = scan_process_arenas(pid, &arenas, pmap_entries, pmap_entry_count) == 0;
+    int ret = 0;
+
+    if (writer) {
+        ret = write_report(writer, pid, snapshot, elapsed_ms, pmap_entries, pmap_entry_count, thread_entries,
+                           thread_entry_count, arenas_found ? &arenas : NULL);
+    } else {
+        struct page_scanner *pages = page_map_mode != PAGE_MAP_OFF ? open_page_scanner(pid) : NULL;
+        create_output(pmap_entries, pmap_entry_count, thread_entries, thread_entry_count, arenas_found ? &arenas : NULL,
+                      pages);
+        if (pages) {
+            close_page_scanner(pages);
+        }
+        print_pmap_totals(pmap_entries, pmap_entry_count, pid);
+        if (arenas_found) {
+            print_arena_summary(&arenas, thread_entries, thread_entry_count);
+            if (fragmentation_report) {
+                print_arena_fragmentation(&arenas);
+            }
+        }
+        if (numa_report) {
+            print_numa_summary(pid, pmap_entries, pmap_entry_count, thread_entries, thread_entry_count,
+                               arenas_found ? &arenas : NULL);
+        }
+    }
+    if (snapshot_path && ret == 0) {
+        ret = save_snapshot(snapshot_path, pid, pmap_entries, pmap_entry_count, thread_entries, thread_entry_count,
+                            arenas_found ? &arenas : NULL);
+        if (ret == 0 && !report_on_stdout()) {
+            printf("Snapshot of %d mappings written to %s\n", pmap_entry_count, snapshot_path);
+        }
+    }
+    if (arenas_found) {
+        free_arena_table(&arenas);
+    }
+    return ret;
+}
+
+/*
+ * Takes a snapshot every watch_interval_ms until SIGINT/SIGTERM and prints the
+ * difference to the previous one, with a writer every snapshot is written as
+ * a full report instead. The two snapshot buffers are swapped and reused, so
+ * a steady state snapshot does not allocate. On return *entries holds the
+ * latest snapshot.
+ */
+int watch_memory_map(int pid, struct pmap_entry **entries, int *count,
+                     struct thread_info_entry *thread_entries, int thread_entry_count, struct output_writer *writer) {
+    struct attribution_index index;
+    if (build_attribution_index(&index, thread_entries, thread_entry_count) != 0) {
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_watching;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    struct pmap_entry *old_entries = *entries;
+    int old_count = *count;
+    int old_capacity = *count;
+    struct pmap_entry *new_entries = NULL;
+    int new_count = 0;
+    int new_capacity = 0;
+    int ret = 0;
+
+    struct pmap_diff_context ctx = { .index = &index, .thread_entries = thread_entries };
+    struct timespec start, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = start;
+
+    if (!report_on_stdout()) {
+        printf("Watching every %d ms, press Ctrl+C to stop\n", watch_interval_ms);
+    }
+    if (!writer) {
+        printf("  %-12s %8s %8s %8s %8s %8s %8s %s%s%s %s\n",
+               "Address", "Kbytes", "Delta", "RSS", "Delta", "Dirty", "Delta", "R", "W", "X", "Mapping");
+    }
+    fflush(stdout);
+
+    while (watching) {
+        deadline.tv_nsec += (long)watch_interval_ms * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR || !watching) {
+            break;
+        }
+
+        FILE *fp = open_smaps_file(pid, "smaps");
+        if (!fp) {
+            perror("open smaps");
+            ret = -1;
+            break;
+        }
+        new_entries = parse_smaps_output(fp, new_entries, &new_capacity, &new_count);
+        fclose(fp);
+        if (!new_entries) {
+            ret = -1;
+            break;
+        }
+        if (pid == getpid()) {
+            new_count = drop_trace_ring_mappings(new_entries, new_count);
+        }
+
+        ctx.snapshot++;
+        ctx.elapsed = elapsed_seconds(&start);
+        if (writer) {
+            if (report_memory_map(pid, writer, (unsigned long)ctx.snapshot, (unsigned long long)(ctx.elapsed * 1000),
+                                  new_entries, new_count, thread_entries, thread_entry_count) != 0) {
+                ret = -1;
+                break;
+            }
+        } else {
+            diff_pmap_snapshots(old_entries, old_count, new_entries, new_count, &ctx);
+        }
+
+        struct pmap_entry *tmp_entries = old_entries;
+        int tmp_capacity = old_capacity;
+        old_entries = new_entries;
+        old_count = new_count;
+        old_capacity = new_capacity;
+        new_entries = tmp_entries;
+        new_capacity = tmp_capacity;
+    }
+
+    free(new_entries);
+    *entries = old_entries;
+    *count = old_count;
+    free_attribution_index(&index);
+    return ret;
+}
+
+void stop_threads(pthread_t *threads, struct thread_info_entry *entries) {
+    // Set stop signal for threads
+    running = 0;
+    futex_wake(&running, INT_MAX);
+    reclaim_phase = RECLAIM_PHASE_STOP;
+    futex_wake(&reclaim_phase, INT_MAX);
+
+    for (int i = 0; i < num_threads; i++) {
+        if (entries[i].created) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
+void free_thread_info_entries(struct thread_info_entry *entries) {
+    for (int i = 0; i < num_threads; i++) {
+          if (entries[i].malloc_info_entries != NULL && !malloc_info_block) {
+              free(entries[i].malloc_info_entries);
+              entries[i].malloc_info_entries = NULL;
+          }
+          free(entries[i].benchmark);
+          entries[i].benchmark = NULL;
+    }
+    free(malloc_info_block);
+    malloc_info_block = NULL;
+    free(entries);
+    entries = NULL;
+}
+
+/*
+ * Reads the user stack pointer of a thread. /proc/<pid>/task/<tid>/syscall
+ * ends with "<sp> <pc>" for a blocked thread, the kstkesp field of stat is
+ * only a fallback since newer kernels report 0 there.
+ */
+static int read_thread_stack_pointer(int pid, pid_t tid, unsigned long long *sp) {
+    char path[64];
+    char buf[512];
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/syscall", pid, tid);
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        ssize_t len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (len > 0) {
+            buf[len] = '\0';
+            char *last = strrchr(buf, ' ');
+            if (last && last > buf) {
+                *last = '\0';
+                char *sp_field = strrchr(buf, ' ');
+                if (sp_field && (*sp = strtoull(sp_field + 1, NULL, 16)) != 0) {
+                    return 0;
+                }
+            }
+        }
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/stat", pid, tid);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return -1;
+    }
+    buf[len] = '\0';
+
+    // Fields after the command name, which may contain spaces, start behind the last ')'
+    char *p = strrchr(buf, ')');
+    if (!p) {
+        return -1;
+    }
+    for (int field = 2; field < 29 && p; field++) {
+        p = strchr(p + 1, ' ');
+    }
+    if (!p || (*sp = strtoull(p + 1, NULL, 10)) == 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_tids(const void *a, const void *b) {
+    pid_t ta = *(const pid_t *)a;
+    pid_t tb = *(const pid_t *)b;
+    return (ta > tb) - (ta < tb);
+}
+
+/*
+ * Builds thread info entries for all threads of another process. The stack
+ * of a thread is the mapping its stack pointer points into, found by binary
+ * search over the sorted map.
+ */
+struct thread_info_entry *collect_attach_threads(int pid, struct pmap_entry *pmap_entries, int pmap_entry_count,
+                                                 int *thread_count, int *unresolved) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        perror(path);
+        return NULL;
+    }
+
+    size_t capacity = PMAP_INITIAL_CAPACITY, count = 0;
+    pid_t *tids = malloc(sizeof(pid_t) * capacity);
+    struct dirent *de;
+    while (tids && (de = readdir(dir)) != NULL) {
+        if (de->d_name[0] < '0' || de->d_name[0] > '9') {
+            continue;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            pid_t *new_tids = realloc(tids, sizeof(pid_t) * capacity);
+            if (!new_tids) {
+                free(tids);
+                tids = NULL;
+                break;
+            }
+            tids = new_tids;
+        }
+        tids[count++] = (pid_t)atoi(de->d_name);
+    }
+    closedir(dir);
+    if (!tids) {
+        fprintf(stderr, "Malloc thread ids failed!\n");
+        return NULL;
+    }
+    qsort(tids, count, sizeof(pid_t), compare_tids);
+
+    struct thread_info_entry *entries = calloc(count ? count : 1, sizeof(struct thread_info_entry));
+    if (!entries) {
+        free(tids);
+        return NULL;
+    }
+
+    *unresolved = 0;
+    for (size_t i = 0; i < count; i++) {
+        unsigned long long sp = 0;
+        entries[i].thread_id = (long)i;
+        entries[i].tid = tids[i];
+        entries[i].finished = 1;
+        entries[i].cpu = read_thread_cpu(pid, tids[i]);
+
+        struct pmap_entry *stack = NULL;
+        if (read_thread_stack_pointer(pid, tids[i], &sp) == 0) {
+            stack = find_pmap_entry(pmap_entries, pmap_entry_count, sp);
+        }
+        if (!stack) {
+            (*unresolved)++;
+            continue;
+        }
+        entries[i].stack_start_address = stack->start_address;
+        entries[i].stack_end_address = stack->end_address;
+        entries[i].stack_size = stack->end_address - stack->start_address;
+    }
+
+    free(tids);
+    *thread_count = (int)count;
+    return entries;
+}
+
+/*
+ * Analyzes a process that was not started by the playground: stacks come
+ * from the thread stack pointers, arena heaps from the map layout alone.
+ */
+int run_attach(int pid) {
+    int pmap_entry_count = 0;
+    struct pmap_entry *pmap_entries = get_pmap_analysis(pid, &pmap_entry_count);
+    if (!pmap_entries) {
+        return EXIT_FAILURE;
+    }
+
+    int thread_count = 0, unresolved = 0;
+    struct thread_info_entry *thread_entries = collect_attach_threads(pid, pmap_entries, pmap_entry_count,
+                                                                     &thread_count, &unresolved);
+    if (!thread_entries) {
+        free(pmap_entries);
+        return EXIT_FAILURE;
+    }
+
+    struct output_writer *writer = NULL;
+    int ret = 0;
+    if (output_format != OUTPUT_TEXT && (writer = open_output_writer()) == NULL) {
+        free(thread_entries);
+        free(pmap_entries);
+        return EXIT_FAILURE;
+    }
+
+    if (report_memory_map(pid, writer, 0, 0, pmap_entries, pmap_entry_count, thread_entries, thread_count) != 0) {
+        ret = EXIT_FAILURE;
+    }
+    if (!report_on_stdout()) {
+        printf("PID %d: %d threads, %d without a known stack pointer\n", pid, thread_count, unresolved);
+    }
+
+    if (ret == 0 && watch_interval_ms > 0) {
+        watch_memory_map(pid, &pmap_entries, &pmap_entry_count, thread_entries, thread_count, writer);
+    }
+
+    if (writer && close_output_writer(writer) != 0) {
+        ret = EXIT_FAILURE;
+    }
+    free(thread_entries);
+    free(pmap_entries);
+    return ret;
+}
+
+/*
+ * A configuration run quietly in a forked child: every --sweep point and the
+ * baselines the comparison modes measure this run against. The child starts
+ * from the settings of this process and applies the config on top, so the
+ * baselines take current_baseline_config() and change one field.
+ */
+struct baseline_config {
+    int num_threads;
+    size_t stack_size;    // 0 for the default
+    int arena_max;        // 0 for the default
+    int mmap_threshold;   // 0 for the default
+    int pool_workers;
+    int glibc_allocator;  // glibc malloc() instead of --allocator pool
+    int thp_disabled;     // PR_SET_THP_DISABLE, the baseline of --thp
+    int stack_pool;
+    int default_guard;    // glibc's guard page instead of --stack-guard
+    int touch_pattern;    // index into touch_patterns
+};
+
+// The footprint of a run, measured by a child or by this process for its own run
+struct baseline_result {
+    int ok;
+    long long vsz_kbytes;
+    long long rss_kbytes;
+    int mapping_count;
+    double ops_per_sec;
+    double tasks_per_sec;
+    double page_accesses_per_sec; // measured with --thp only
+    double create_ms;             // pthread_create() of all threads
+    unsigned long long touch_ns;  // summed over the threads
+    unsigned long long touch_block_bytes;
+    unsigned long long touch_accessed;
+    long long touch_rss_kbytes;   // of the mappings holding the -f blocks
+    long long touch_dirty_kbytes;
+};
+
+struct baseline_result pool_baseline;
+struct baseline_result allocator_baseline;
+struct baseline_result thp_baseline;
+struct baseline_result stack_pool_baseline;
+struct baseline_result touch_results[TOUCH_MAX_PATTERNS];
+
+// Two rows of a comparison mode, the baseline first and this run second
+struct comparison {
+    const char *column;   // what the rows differ in
+    const char *metric;   // the column only this mode shows
+    int decimals;
+    const char *saver;    // subject of the savings line
+    const char *labels[2];
+    const struct baseline_result *results[2];
+    double metrics[2];
+};
+
+static void print_comparison_row(const struct comparison *c, int row) {
+    const struct baseline_result *r = c->results[row];
+    if (!r->ok) {
+        printf("    %-30s %10s\n", c->labels[row], "failed");
+        return;
+    }
+    printf("    %-30s %10lld %10lld %8d %12.*f\n", c->labels[row], r->vsz_kbytes, r->rss_kbytes, r->mapping_count,
+           c->decimals, c->metrics[row]);
+}
+
+void print_comparison(const struct comparison *c) {
+    printf("    %-30s %10s %10s %8s %12s\n", c->column, "VSZ kB", "RSS kB", "Maps", c->metric);
+    print_comparison_row(c, 0);
+    print_comparison_row(c, 1);
+    const struct baseline_result *baseline = c->results[0], *run = c->results[1];
+    if (baseline->ok && run->ok) {
+        printf("    %s saves %lld kB VSZ, %lld kB RSS and %d mappings\n", c->saver,
+               baseline->vsz_kbytes - run->vsz_kbytes, baseline->rss_kbytes - run->rss_kbytes,
+               baseline->mapping_count - run->mapping_count);
+    }
+}
+
+void print_stack_pool_comparison(const struct baseline_result *pooled) {
+    char mode[64];
+    snprintf(mode, sizeof(mode), "stack pool (%zu kB guard, %s)", stack_pool.guard_size / 1024,
+             stack_commit_eager ? "eager" : "lazy");
+
+    printf("---------------- Stack Pool vs glibc Stacks -------\n");
+    printf("    %ld stacks of %zu kB in one reservation of %zu kB at %p\n", stack_pool.slots,
+           stack_pool.stack_size / 1024, stack_pool.length / 1024, (void *)stack_pool.base);
+    struct comparison c = {
+        .column = "Stacks",
+        .metric = "Create ms",
+        .decimals = 3,
+        .saver = "Stack pool",
+        .labels = { "glibc (default guard)", mode },
+        .results = { &stack_pool_baseline, pooled },
+        .metrics = { stack_pool_baseline.create_ms, pooled->create_ms },
+    };
+    print_comparison(&c);
+    printf("---------------------------------------------------\n");
+}
+
+/*
+ * Thread arena heaps grow with mprotect() in page steps, so a huge page
+ * rarely fits the heap when it is first touched. With --thp madvise the used
+ * part of every thread arena heap is collapsed into huge pages once the
+ * threads are done. Returns the bytes collapsed.
+ */
+static size_t collapse_arena_heaps(void) {
+    int pmap_entry_count = 0;
+    struct pmap_entry *pmap_entries = get_pmap_analysis(getpid(), &pmap_entry_count);
+    struct arena_table arenas;
+    size_t collapsed = 0;
+    if (pmap_entries && scan_arenas(&arenas, pmap_entries, pmap_entry_count) == 0) {
+        for (size_t h = 0; h < arenas.heap_count; h++) {
+            const struct arena_heap *heap = &arenas.heaps[h];
+            size_t size = (heap->size / thp_page_size()) * thp_page_size();
+            if (heap->arena_index > 0 && size > 0 &&
+                madvise((void *)(uintptr_t)heap->start_address, size, MADV_COLLAPSE) == 0) {
+                collapsed += size;
+            }
+        }
+        free_arena_table(&arenas);
+    }
+    free(pmap_entries);
+    return collapsed;
+}
+
+static int page_address_compare(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Reads one byte of every page of the thread allocations in a random order,
+ * so nearly every access needs another TLB entry. Returns accesses per
+ * second, 0 without allocations.
+ */
+static double measure_page_access_rate(struct thread_info_entry *entries) {
+    unsigned long long page_size = (unsigned long long)sysconf(_SC_PAGESIZE);
+    size_t count = 0, capacity = 1024;
+    unsigned long long *pages = malloc(capacity * sizeof(*pages));
+    if (!pages) {
+        return 0.0;
+    }
+
+    for (int t = 0; t < num_threads && count < THP_ACCESS_MAX_PAGES; t++) {
+        if (!entries[t].finished || !entries[t].malloc_info_entries)
+            continue;
+        for (size_t i = 0; i < entries[t].malloc_entry_count && count < THP_ACCESS_MAX_PAGES; i++) {
+            const struct malloc_info_entry *m = &entries[t].malloc_info_entries[i];
+            for (unsigned long long a = m->malloc_start_address; a < m->malloc_end_address;
+                 a = (a & ~(page_size - 1)) + page_size) {
+                if (count == capacity) {
+                    unsigned long long *grown = realloc(pages, capacity * 2 * sizeof(*pages));
+                    if (!grown) {
+                        free(pages);
+                        return 0.0;
+                    }
+                    pages = grown;
+                    capacity *= 2;
+                }
+                pages[count++] = a;
+            }
+        }
+    }
+
+    // Small allocations share pages, every page is read once per pass
+    qsort(pages, count, sizeof(*pages), page_address_compare);
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique == 0 || (pages[i] & ~(page_size - 1)) != (pages[unique - 1] & ~(page_size - 1)))
+            pages[unique++] = pages[i];
+    }
+    if (unique == 0) {
+        free(pages);
+        return 0.0;
+    }
+
+    struct workload_state rng_state;
+    memset(&rng_state, 0, sizeof(rng_state));
+    rng_state.rng = 0x9E3779B97F4A7C15ULL;
+    for (size_t i = unique - 1; i > 0; i--) {
+        size_t j = workload_random(&rng_state) % (i + 1);
+        unsigned long long tmp = pages[i];
+        pages[i] = pages[j];
+        pages[j] = tmp;
+    }
+
+    volatile unsigned char sink = 0;
+    unsigned char sum = 0;
+    // The first pass takes the page faults and is not timed
+    for (size_t i = 0; i < unique; i++) {
+        sum += *(volatile unsigned char *)(uintptr_t)pages[i];
+    }
+    size_t passes = (THP_ACCESS_MIN_COUNT + unique - 1) / unique;
+    unsigned long long start = now_ns();
+    for (size_t pass = 0; pass < passes; pass++) {
+        for (size_t i = 0; i < unique; i++) {
+            sum += *(volatile unsigned char *)(uintptr_t)pages[i];
+        }
+    }
+    unsigned long long elapsed = now_ns() - start;
+    sink = sum;
+    (void)sink;
+    free(pages);
+    return elapsed > 0 ? (double)(passes * unique) * 1e9 / (double)elapsed : 0.0;
+}
+
+static void print_thp_sysfs(const char *name) {
+    char path[128], line[256];
+    snprintf(path, sizeof(path), "/sys/kernel/mm/transparent_hugepage/%s", name);
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        printf("    %-8s unavailable\n", name);
+        return;
+    }
+    if (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0';
+        printf("    %-8s %s\n", name, line);
+    }
+    fclose(file);
+}
+
+/*
+ * AnonHugePages of every region kind, and the RSS and page access rate
+ * against the same configuration run with THP disabled by prctl().
+ */
+void print_thp_summary(struct pmap_entry *pmap_entries, int pmap_entry_count, struct thread_info_entry *thread_entries,
+                       const struct baseline_result *thp) {
+    static const enum region_kind kinds[4] = { REGION_MAIN_HEAP, REGION_ARENA_HEAP, REGION_THREAD_STACK,
+                                               REGION_OTHER };
+    long long rss[4] = { 0 }, huge[4] = { 0 };
+    int mappings[4] = { 0 };
+
+    struct region_class *classes = malloc(sizeof(struct region_class) * (pmap_entry_count ? pmap_entry_count : 1));
+    if (!classes) {
+        return;
+    }
+    struct arena_table arenas;
+    int arenas_found = scan_process_arenas(getpid(), &arenas, pmap_entries, pmap_entry_count) == 0;
+    int classified = classify_pmap_entries(pmap_entries, pmap_entry_count, thread_entries, num_threads,
+                                           arenas_found ? &arenas : NULL, classes) == 0;
+    for (int m = 0; classified && m < pmap_entry_count; m++) {
+        int k = classes[m].kind == REGION_OTHER ? 3 : (int)classes[m].kind - 1;
+        mappings[k]++;
+        rss[k] += pmap_entries[m].rss;
+        huge[k] += pmap_entries[m].anon_huge_pages;
+    }
+    if (arenas_found) {
+        free_arena_table(&arenas);
+    }
+    free(classes);
+    if (!classified) {
+        return;
+    }
+
+    printf("---------------- Transparent Huge Pages: %s ----------------\n",
+           thp_mode == THP_MADVISE ? "madvise" : THP_TUNABLE_SETTING);
+    print_thp_sysfs("enabled");
+    print_thp_sysfs("defrag");
+    if (thp_mode == THP_MADVISE) {
+        printf("    MADV_COLLAPSE of the thread arena heaps: %zu kB\n", thp_collapsed_bytes / 1024);
+    }
+    printf("    %-14s %8s %10s %16s %6s\n", "Region", "Maps", "RSS kB", "AnonHugePages kB", "THP %");
+    for (int k = 0; k < 4; k++) {
+        printf("    %-14s %8d %10lld %16lld %5.1f%%\n", region_kind_name(kinds[k]), mappings[k], rss[k], huge[k],
+               rss[k] > 0 ? 100.0 * huge[k] / rss[k] : 0.0);
+    }
+
+    if (!thp_baseline.ok) {
+        printf("    Baseline without THP failed\n");
+    } else {
+        long long inflation = thp->rss_kbytes - thp_baseline.rss_kbytes;
+        printf("    RSS: %lld kB without THP, %lld kB with THP, inflation %+lld kB (%+.1f%%)\n",
+               thp_baseline.rss_kbytes, thp->rss_kbytes, inflation,
+               thp_baseline.rss_kbytes > 0 ? 100.0 * inflation / thp_baseline.rss_kbytes : 0.0);
+        if (thp->page_accesses_per_sec > 0 && thp_baseline.page_accesses_per_sec > 0) {
+            printf("    Random page access: %.1f M/s without THP, %.1f M/s with THP, gain %+.1f%%\n",
+                   thp_baseline.page_accesses_per_sec / 1e6, thp->page_accesses_per_sec / 1e6,
+                   100.0 * (thp->page_accesses_per_sec / thp_baseline.page_accesses_per_sec - 1.0));
+        } else {
+            printf("    Random page access: no thread allocations to access, use -m, -f or --workload\n");
+        }
+    }
+    printf("---------------------------------------------------\n");
+}
+
+
+/*
+ * Fill time and bytes of the touch pattern, and the RSS and Dirty of the
+ * mappings that hold the -f blocks (arena heaps or mmap()ed blocks).
+ */
+static void measure_touch(struct baseline_result *result, struct pmap_entry *pmap_entries, int pmap_entry_count,
+                          struct thread_info_entry *thread_entries) {
+    result->touch_ns = 0;
+    result->touch_accessed = 0;
+    result->touch_block_bytes = 0;
+    for (int t = 0; t < num_threads; t++) {
+        result->touch_ns += thread_entries[t].touch_ns;
+        result->touch_accessed += thread_entries[t].touch_accessed;
+        for (size_t j = 0; j < thread_entries[t].malloc_entry_count; j++) {
+            result->touch_block_bytes += thread_entries[t].malloc_info_entries[j].malloc_size;
+        }
+    }
+
+    result->touch_rss_kbytes = 0;
+    result->touch_dirty_kbytes = 0;
+    // One sweep of the sorted blocks along the sorted map instead of every block for every mapping
+    struct attribution_index index;
+    if (build_attribution_index(&index, thread_entries, num_threads) != 0) {
+        return;
+    }
+    for (int m = 0; m < pmap_entry_count; m++) {
+        const struct pmap_entry *p = &pmap_entries[m];
+        if (query_attribution_index(&index, p->start_address, p->end_address) != 0) {
+            break;
+        }
+        for (size_t i = 0; i < index.match_count; i++) {
+            if (index.matches[i]->malloc_index >= 0) {
+                result->touch_rss_kbytes += p->rss;
+                result->touch_dirty_kbytes += p->dirty;
+                break;
+            }
+        }
+    }
+    free_attribution_index(&index);
+}
+
+static void measure_footprint(struct baseline_result *result, struct pmap_entry *pmap_entries, int pmap_entry_count,
+                              struct thread_info_entry *thread_entries, double seconds) {
+    memset(result, 0, sizeof(*result));
+    for (int m = 0; m < pmap_entry_count; m++) {
+        result->vsz_kbytes += pmap_entries[m].kbytes;
+        result->rss_kbytes += pmap_entries[m].rss;
+    }
+    result->mapping_count = pmap_entry_count;
+    result->ops_per_sec = benchmark_ops > 0 ? benchmark_ops_per_sec(thread_entries, num_threads) : 0.0;
+    result->tasks_per_sec = seconds > 0 ? num_threads / seconds : 0.0;
+    result->page_accesses_per_sec = thp_mode != THP_OFF ? measure_page_access_rate(thread_entries) : 0.0;
+    result->create_ms = thread_create_seconds * 1e3;
+    if (touch_pattern_count > 0 || counters_enabled) {
+        measure_touch(result, pmap_entries, pmap_entry_count, thread_entries);
+    }
+    result->ok = 1;
+}
+
+static void print_touch_line(int pattern, const struct baseline_result *r) {
+    const struct touch_pattern *p = &touch_patterns[pattern];
+    if (!r->ok) {
+        printf("    %-14s %12s\n", p->name, "failed");
+        return;
+    }
+    double gbytes_per_sec = r->touch_ns ? (double)r->touch_block_bytes / (double)r->touch_ns : 0.0;
+    printf("    %-14s %12.3f %10.3f %10.2f %10lld %10lld %7.1f%%\n", p->name, r->touch_accessed / (1024.0 * 1024.0),
+           r->touch_ns / 1e6 / (num_threads ? num_threads : 1), gbytes_per_sec, r->touch_rss_kbytes,
+           r->touch_dirty_kbytes,
+           r->touch_block_bytes ? 100.0 * (double)r->touch_rss_kbytes * 1024.0 / (double)r->touch_block_bytes : 0.0);
+}
+
+/*
+ * One line per --touch pattern: the first one ran in this process, every
+ * further one in a child of its own. GB/s is the block bytes covered per
+ * second of fill in one thread, Accessed the bytes actually written or read.
+ */
+void print_touch_summary(const struct baseline_result *active) {
+    touch_results[touch_active] = *active;
+    printf("---------------- Touch Patterns -------------------\n");
+    printf("    %d threads with %d blocks of %zu bytes, RSS and Dirty of the mappings holding them\n", num_threads,
+           malloc_count, malloc_size);
+    printf("    %-14s %12s %10s %10s %10s %10s %8s\n", "Pattern", "Accessed MB", "ms/thread", "GB/s", "RSS kB",
+           "Dirty kB", "RSS");
+    for (int i = 0; i < touch_pattern_count; i++) {
+        print_touch_line(i, &touch_results[i]);
+    }
+    printf("---------------------------------------------------\n");
+}
+
+// Allocations per second: the --benchmark loop if there is one, else the -m/-f mallocs or --workload ops
+static double allocator_throughput(const struct baseline_result *r) {
+    if (benchmark_ops > 0)
+        return r->ops_per_sec;
+    return r->tasks_per_sec * (double)(workload.enabled ? workload.ops : malloc_count);
+}
+
+void print_allocator_comparison(const struct baseline_result *pooled) {
+    char mode[32];
+    if (pool_arena_limit)
+        snprintf(mode, sizeof(mode), "glibc");
+    else
+        snprintf(mode, sizeof(mode), "glibc (%d arenas)", malloc_arena_max);
+
+    printf("---------------- Pool vs glibc Allocator ----------\n");
+    struct comparison c = {
+        .column = "Allocator",
+        .metric = benchmark_ops > 0 ? "ops/s" : "allocs/s",
+        .saver = "Pool",
+        .labels = { mode, "pool" },
+        .results = { &allocator_baseline, pooled },
+        .metrics = { allocator_throughput(&allocator_baseline), allocator_throughput(pooled) },
+    };
+    print_comparison(&c);
+    if (allocator_baseline.ok && pooled->ok && c.metrics[0] > 0) {
+        printf("    Pool runs at %.0f%% of the glibc throughput\n", 100.0 * c.metrics[1] / c.metrics[0]);
+    }
+    printf("---------------------------------------------------\n");
+}
+
+void print_pool_comparison(const struct baseline_result *pool) {
+    char mode[32];
+    snprintf(mode, sizeof(mode), "pool (%d workers)", pool_workers);
+
+    printf("---------------- Pool vs Thread per Task ----------\n");
+    struct comparison c = {
+        .column = "Mode",
+        .metric = "Tasks/s",
+        .saver = "Pool",
+        .labels = { "thread per task", mode },
+        .results = { &pool_baseline, pool },
+        .metrics = { pool_baseline.tasks_per_sec, pool->tasks_per_sec },
+    };
+    print_comparison(&c);
+    printf("---------------------------------------------------\n");
+}
+
+/*
+ * Runs one configuration: starts the threads, takes the snapshot and either
+ * prints the full output or, with a result given (sweep children), only
+ * fills in the footprint numbers.
+ */
+int run_playground(struct baseline_result *result) {
+    struct thread_info_entry *thread_info_entries = malloc(sizeof(struct thread_info_entry) * num_threads);
+    if (!thread_info_entries) {
+        perror("malloc thread_info entries failed!");
+        return EXIT_FAILURE;
+    }
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+    if (!threads) {
+        perror("malloc threads failed!");
+        free(thread_info_entries);
+        return EXIT_FAILURE;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int created;
+    if (pool_workers > 0)
+        created = create_task_pool(thread_info_entries);
+    else if (spawner_count > 0)
+        created = spawn_threads(threads, thread_info_entries);
+    else
+        created = create_threads(threads, thread_info_entries);
+    if (created != 0) {
+        return EXIT_FAILURE;
+    }
+    thread_create_seconds = elapsed_seconds(&start);
+
+    wait_for_threads_to_finish();
+    double seconds = elapsed_seconds(&start);
+    if (thp_mode == THP_MADVISE) {
+        thp_collapsed_bytes = collapse_arena_heaps();
+    }
+
+    int pmap_entry_count = 0;
+    struct pmap_entry *pmap_entries = get_pmap_analysis(getpid(), &pmap_entry_count);
+    if (!pmap_entries) {
+        free_thread_info_entries(thread_info_entries);
+        return EXIT_FAILURE;
+    }
+
+    int ret = 0;
+    if (result) {
+        measure_footprint(result, pmap_entries, pmap_entry_count, thread_info_entries, seconds);
+    } else {
+        struct output_writer *writer = NULL;
+        if (output_format != OUTPUT_TEXT && (writer = open_output_writer()) == NULL) {
+            ret = EXIT_FAILURE;
+        } else if (report_memory_map(getpid(), writer, 0, 0, pmap_entries, pmap_entry_count, thread_info_entries,
+                                     num_threads) != 0) {
+            ret = EXIT_FAILURE;
+        }
+
+        // The human readable summaries would corrupt a report on stdout
+        if (!report_on_stdout()) {
+            // The comparison modes set this run against their baselines
+            struct baseline_result footprint;
+            measure_footprint(&footprint, pmap_entries, pmap_entry_count, thread_info_entries, seconds);
+            if (benchmark_ops > 0) {
+                print_benchmark_summary(thread_info_entries, num_threads);
+            }
+            if (workload.enabled) {
+                print_workload_summary(thread_info_entries, num_threads);
+            }
+            if (counters_enabled) {
+                print_counter_summary(thread_info_entries, num_threads, footprint.touch_rss_kbytes);
+            }
+            if (touch_pattern_count > 0) {
+                print_touch_summary(&footprint);
+            }
+            if (strcmp(allocator->name, "pool") == 0) {
+                print_pool_summary();
+                print_allocator_comparison(&footprint);
+            }
+            if (stack_usage_method != STACK_USAGE_OFF) {
+                print_stack_usage_summary(thread_info_entries, num_threads);
+            }
+            if (spawner_count > 0) {
+                print_spawn_summary(thread_info_entries);
+            }
+            if (thp_mode != THP_OFF) {
+                print_thp_summary(pmap_entries, pmap_entry_count, thread_info_entries, &footprint);
+            }
+            if (reclaim_strategy != RECLAIM_NONE) {
+                run_reclaim_experiment(thread_info_entries);
+            }
+            if (stack_pool_enabled) {
+                print_stack_pool_comparison(&footprint);
+            }
+            if (pool_workers > 0) {
+                print_task_pool_summary();
+                print_pool_comparison(&footprint);
+            }
+        }
+
+        if (ret == 0 && watch_interval_ms > 0) {
+            watch_memory_map(getpid(), &pmap_entries, &pmap_entry_count, thread_info_entries, num_threads, writer);
+        }
+        if (writer && close_output_writer(writer) != 0) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    if (pool_workers > 0) {
+        stop_task_pool();
+    } else {
+        stop_threads(threads, thread_info_entries);
+    }
+    free(threads);
+    destroy_stack_pool();
+
+    free_thread_info_entries(thread_info_entries);
+    free_handoff_queues();
+    free(pmap_entries);
+
+    return ret;
+}
+
+static int run_baseline_child(const struct baseline_config *config, int fd) {
+    // The trace writer thread does not exist in a forked child
+    trace_enabled = 0;
+    if (config->thp_disabled && prctl(PR_SET_THP_DISABLE, 1, 0, 0, 0) != 0) {
+        perror("prctl PR_SET_THP_DISABLE");
+        return EXIT_FAILURE;
+    }
+    num_threads = config->num_threads;
+    pool_workers = config->pool_workers;
+    if (config->glibc_allocator) {
+        allocator = &allocator_backends[0];
+    }
+    touch_active = config->touch_pattern;
+    stack_pool_enabled = config->stack_pool;
+    if (config->default_guard) {
+        stack_guard_given = 0;
+    }
+    stack_size_given = config->stack_size > 0;
+    stack_size = config->stack_size;
+    if (config->arena_max > 0 && set_malloc_arena_number(config->arena_max) != 0) {
+        return EXIT_FAILURE;
+    }
+    malloc_arena_max = config->arena_max;
+    if (config->mmap_threshold > 0 && set_malloc_mmap_threshold_in_bytes(config->mmap_threshold) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    struct baseline_result result;
+    if (run_playground(&result) != 0) {
+        return EXIT_FAILURE;
+    }
+    // The result is far below PIPE_BUF, so the write is atomic
+    if (write(fd, &result, sizeof(result)) != (ssize_t)sizeof(result)) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// The settings of this process, the baselines change one field of it
+static void current_baseline_config(struct baseline_config *config) {
+    memset(config, 0, sizeof(*config));
+    config->num_threads = num_threads;
+    config->stack_size = stack_size_given ? stack_size : 0;
+    config->arena_max = malloc_arena_max;
+    config->mmap_threshold = malloc_mmap_threshold;
+    config->pool_workers = pool_workers;
+    config->stack_pool = stack_pool_enabled;
+    config->touch_pattern = touch_active;
+}
+
+/*
+ * Forks a child running config, the child does not inherit the mappings of
+ * the threads started later on. Returns its pid, its result arrives on *fd.
+ */
+static pid_t start_baseline(const struct baseline_config *config, int *fd) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        _exit(run_baseline_child(config, fds[1]));
+    }
+    close(fds[1]);
+    *fd = fds[0];
+    return pid;
+}
+
+// Reads the result of a child that exited successfully, any other leaves result->ok at 0
+static void finish_baseline(int exited, int status, int fd, struct baseline_result *result) {
+    memset(result, 0, sizeof(*result));
+    if (exited && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+        read(fd, result, sizeof(*result)) != (ssize_t)sizeof(*result)) {
+        memset(result, 0, sizeof(*result));
+    }
+    close(fd);
+}
+
+// Runs config in a forked child and waits for its result
+int run_baseline(const struct baseline_config *config, struct baseline_result *result) {
+    int fd;
+    pid_t pid = start_baseline(config, &fd);
+    if (pid < 0) {
+        memset(result, 0, sizeof(*result));
+        return -1;
+    }
+
+    int status = 0;
+    pid_t waited;
+    while ((waited = waitpid(pid, &status, 0)) < 0 && errno == EINTR) {
+    }
+    if (waited < 0) {
+        perror("waitpid");
+    }
+    finish_baseline(waited == pid, status, fd, result);
+    return waited == pid ? 0 : -1;
+}
+
+// The same configuration with one thread per task, compared with --pool
+int run_pool_baseline(void) {
+    struct baseline_config config;
+    current_baseline_config(&config);
+    config.pool_workers = 0;
+    return run_baseline(&config, &pool_baseline);
+}
+
+// The same configuration on glibc malloc() with its default arenas unless -a was given, compared with --allocator pool
+int run_allocator_baseline(void) {
+    struct baseline_config config;
+    current_baseline_config(&config);
+    config.glibc_allocator = 1;
+    if (pool_arena_limit) {
+        config.arena_max = 0;
+    }
+    return run_baseline(&config, &allocator_baseline);
+}
+
+// The same configuration on stacks glibc allocates with its default guard, compared with --stack-pool
+int run_stack_pool_baseline(void) {
+    struct baseline_config config;
+    current_baseline_config(&config);
+    config.stack_pool = 0;
+    config.default_guard = 1;
+    return run_baseline(&config, &stack_pool_baseline);
+}
+
+// The same configuration once per further --touch pattern, each in a child of its own
+int run_touch_baselines(void) {
+    for (int i = 1; i < touch_pattern_count; i++) {
+        struct baseline_config config;
+        current_baseline_config(&config);
+        config.touch_pattern = i;
+        if (run_baseline(&config, &touch_results[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// The same configuration with THP disabled for the process, compared with --thp
+int run_thp_baseline(void) {
+    struct baseline_config config;
+    current_baseline_config(&config);
+    config.thp_disabled = 1;
+    return run_baseline(&config, &thp_baseline);
+}
 
-    // Define the options
-    static struct option long_options[] = {
-        {"num-threads", required_argument, 0, 'n'},
-        {"thread-stack-size", required_argument, 0, 's'},
-        {"malloc-sparse-inside-thread", required_argument, 0, 'm'},
-        {"malloc-filled-inside-thread", required_argument, 0, 'f'},
-        {"count-of-mallocs", required_argument, 0, 'c'},
-        {"malloc-arena-max", required_argument, 0, 'a'},
-        {"mmap-threshold", required_argument, 0, 't'},
-        {"help", no_argument, 0, 'h'},
-        {0, 0, 0, 0}
-    };
+struct sweep_job {
+    pid_t pid;
+    int fd;
+    size_t index;
+};
 
-    while ((opt = getopt_long(*argc, argv, "n:s:m:f:c:a:t:h", long_options, &option_index)) != -1) {
-        switch (opt) {
-            case 'n':
-                if (sscanf(optarg, "%d", &num_threads) != 1 || num_threads <= 0) {
-                    fprintf(stderr, "Invalid number of threads: %s. Must be a positive integer.\n", optarg);
-                    print_usage(argv[0]);
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case 's':
-                stack_size_given = 1;
-                if (sscanf(optarg, "%zu", &stack_size) != 1 || stack_size < (size_t)PTHREAD_STACK_MIN) {
-                    fprintf(stderr, "Invalid stack size: %s. Must be at least %ld bytes.\n", optarg, PTHREAD_STACK_MIN);
-                    print_usage(argv[0]);
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case 'm':
-                malloc_enabled = 1;
-                malloc_fill_enabled = 0;
-                if (sscanf(optarg, "%zu", &malloc_size) != 1 || malloc_size <= 0) {
-                    fprintf(stderr, "Invalid malloc size: %s. Must be a positive integer.\n", optarg);
-                    print_usage(argv[0]);
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case 'f':
-                malloc_enabled = 1;
-                malloc_fill_enabled = 1;
-                if (sscanf(optarg, "%zu", &malloc_size) != 1 || malloc_size <= 0) {
-                    fprintf(stderr, "Invalid malloc size: %s. Must be a positive integer.\n", optarg);
-                    print_usage(argv[0]);
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case 'c':
-                if (sscanf(optarg, "%d", &malloc_count) != 1 || malloc_count <= 0) {
-                    fprintf(stderr, "Invalid count of mallocs: %s. Must be a positive integer.\n", optarg);
-                    print_usage(argv[0]);
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case 'a':
-                int arenas = 0;
-                if (sscanf(optarg, "%d", &arenas) != 1 || arenas <= 0) {
-                    fprintf(stderr, "Invalid number of arenas: %s. Must be a positive integer.\n", optarg);
-                    print_usage(argv[0]);
-                    exit(EXIT_FAILURE);
-                }
-                if (set_malloc_arena_number(arenas) != 0)
-                    exit(EXIT_FAILURE);
+static void print_sweep_value(long value, int width) {
+    if (value > 0)
+        printf(" %*ld", width, value);
+    else
+        printf(" %*s", width, "default");
+}
+
+static void print_sweep_result(const struct baseline_config *c, const struct baseline_result *r) {
+    printf("%8d", c->num_threads);
+    print_sweep_value((long)c->stack_size, 10);
+    print_sweep_value(c->arena_max, 8);
+    print_sweep_value(c->mmap_threshold, 10);
+    if (r->ok) {
+        printf(" %10lld %10lld %6d", r->vsz_kbytes, r->rss_kbytes, r->mapping_count);
+        if (benchmark_ops > 0)
+            printf(" %12.0f", r->ops_per_sec);
+        printf("\n");
+    } else {
+        printf(" %10s\n", "failed");
+    }
+}
+
+/*
+ * Forks one child per configuration of the cartesian product of all sweep
+ * values, keeping up to sweep_jobs children running at once. Each child runs
+ * the playground quietly and reports its footprint through a pipe.
+ */
+int run_sweep(void) {
+    size_t total = 1;
+    for (int p = 0; p < SWEEP_PARAM_COUNT; p++) {
+        total *= sweep_params[p].count;
+    }
+
+    struct baseline_config *configs = calloc(total, sizeof(struct baseline_config));
+    struct baseline_result *results = calloc(total, sizeof(struct baseline_result));
+    struct sweep_job *jobs = calloc(sweep_jobs, sizeof(struct sweep_job));
+    if (!configs || !results || !jobs) {
+        perror("calloc sweep results");
+        free(configs);
+        free(results);
+        free(jobs);
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < total; i++) {
+        size_t rest = i;
+        long values[SWEEP_PARAM_COUNT];
+        for (int p = SWEEP_PARAM_COUNT - 1; p >= 0; p--) {
+            values[p] = sweep_params[p].values[rest % sweep_params[p].count];
+            rest /= sweep_params[p].count;
+        }
+        current_baseline_config(&configs[i]);
+        configs[i].num_threads = (int)values[SWEEP_THREADS];
+        configs[i].stack_size = (size_t)values[SWEEP_STACK_SIZE];
+        configs[i].arena_max = (int)values[SWEEP_ARENA_MAX];
+        configs[i].mmap_threshold = (int)values[SWEEP_MMAP_THRESHOLD];
+    }
+
+    printf("Sweeping %zu configurations, %d in parallel\n", total, sweep_jobs);
+    fflush(stdout);
+
+    size_t next = 0, done = 0;
+    int running_jobs = 0;
+    while (done < total) {
+        while (next < total && running_jobs < sweep_jobs) {
+            int fd;
+            pid_t pid = start_baseline(&configs[next], &fd);
+            if (pid < 0) {
                 break;
-            case 't':
-                int mmap_threshold = 0;
-                if (sscanf(optarg, "%d", &mmap_threshold) != 1 || mmap_threshold <= 0) {
-                    fprintf(stderr, "Invalid size of mmap threshold: %s. Must be a positive integer.\n", optarg);
-                    print_usage(argv[0]);
-                    exit(EXIT_FAILURE);
+            }
+            for (int j = 0; j < sweep_jobs; j++) {
+                if (jobs[j].pid == 0) {
+                    jobs[j].pid = pid;
+                    jobs[j].fd = fd;
+                    jobs[j].index = next;
+                    break;
                 }
-                if (set_malloc_mmap_threshold_in_bytes(mmap_threshold) != 0)
-                    exit(EXIT_FAILURE);
+            }
+            next++;
+            running_jobs++;
+        }
+
+        if (running_jobs == 0) {
+            // Nothing could be started, count the rest as failed
+            done = total;
+            break;
+        }
+
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            perror("wait");
+            break;
+        }
+        for (int j = 0; j < sweep_jobs; j++) {
+            if (jobs[j].pid == pid) {
+                finish_baseline(1, status, jobs[j].fd, &results[jobs[j].index]);
+                jobs[j].pid = 0;
+                running_jobs--;
+                done++;
                 break;
-            case 'h':
-                print_usage(argv[0]);
-                exit(EXIT_SUCCESS);
-            default:
-                print_usage(argv[0]);
-                exit(EXIT_FAILURE);
+            }
         }
     }
 
-    // Check if there are any non-option arguments left
-    if (optind < *argc) {
-        fprintf(stderr, "Unknown argument(s): ");
-        while (optind < *argc) {
-            fprintf(stderr, "%s ", argv[optind++]);
+    printf("%8s %10s %8s %10s %10s %10s %6s", "Threads", "StackSize", "ArenaMax", "MmapThr", "VSZ kB", "RSS kB", "Maps");
+    if (benchmark_ops > 0)
+        printf(" %12s", "ops/s");
+    printf("\n");
+    printf("---------------------------------------------------------------------------------\n");
+
+    long best = -1;
+    for (size_t i = 0; i < total; i++) {
+        const struct baseline_result *r = &results[i];
+        print_sweep_result(&configs[i], r);
+        if (!r->ok || (sweep_min_throughput > 0 && r->ops_per_sec < sweep_min_throughput)) {
+            continue;
+        }
+        if (best < 0 || r->vsz_kbytes < results[best].vsz_kbytes ||
+            (r->vsz_kbytes == results[best].vsz_kbytes && r->rss_kbytes < results[best].rss_kbytes)) {
+            best = (long)i;
         }
-        fprintf(stderr, "\n");
-        print_usage(argv[0]);
-        exit(EXIT_FAILURE);
     }
+    printf("---------------------------------------------------------------------------------\n");
+
+    if (best >= 0) {
+        printf("Recommended (smallest VSZ");
+        if (sweep_min_throughput > 0)
+            printf(" with at least %.0f ops/s", sweep_min_throughput);
+        printf("):\n");
+        print_sweep_result(&configs[best], &results[best]);
+    } else {
+        printf("No configuration met the throughput floor of %.0f ops/s\n", sweep_min_throughput);
+    }
+
+    free(configs);
+    free(results);
+    free(jobs);
+    return best >= 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-void set_stack_size(pthread_attr_t *attr) {
-    if (stack_size_given) {
-        if (pthread_attr_setstacksize(attr, stack_size) != 0) {
-            fprintf(stderr, "Error setting stack size (%zu bytes). Using system default stack size.\n", stack_size);
+/*
+ * The glibcvsz.h API, the part of this file a service links in (make lib).
+ * Every registered thread owns its list of blocks and the lock guarding it,
+ * so registering a block only ever waits for a snapshot copying that list.
+ * The list stays dense for the snapshot, a hash of the block addresses next
+ * to it finds a block to unregister in constant time.
+ */
+struct registered_thread {
+    struct thread_info_entry entry;
+    size_t block_capacity;
+    size_t *block_slots; // linear probing, index + 1 of the block, 0 for a free slot
+    size_t slot_mask;
+    pthread_mutex_t lock;
+    struct registered_thread *next;
+};
+
+struct glibcvsz_snapshot {
+    struct pmap_entry *pmap_entries;
+    int pmap_entry_count;
+    struct thread_info_entry *thread_entries;
+    int thread_entry_count;
+    struct malloc_info_entry *blocks;
+    struct glibcvsz_mapping *mappings;
+    unsigned long number;
+};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER; // output_format is shared by all reports
+static struct registered_thread *registered_threads = NULL;
+static __thread struct registered_thread *registered_self = NULL;
+static unsigned long snapshot_count = 0;
+
+int glibcvsz_register_thread(long id) {
+    if (registered_self) {
+        registered_self->entry.thread_id = id;
+        return 0;
+    }
+    struct registered_thread *self = calloc(1, sizeof(struct registered_thread));
+    if (!self) {
+        return -1;
+    }
+    void *stack_addr, *stack_end_addr;
+    size_t stack_size;
+    if (get_stack_info(&stack_addr, &stack_size, &stack_end_addr) != 0) {
+        free(self);
+        errno = EINVAL;
+        return -1;
+    }
+    self->entry.thread_id = id;
+    self->entry.tid = syscall(SYS_gettid);
+    self->entry.stack_start_address = (unsigned long long)(uintptr_t)stack_addr;
+    self->entry.stack_end_address = (unsigned long long)(uintptr_t)stack_end_addr;
+    self->entry.stack_size = stack_size;
+    self->entry.cpu = sched_getcpu();
+    void *arena_probe = malloc(1);
+    self->entry.arena_probe_address = (unsigned long long)(uintptr_t)arena_probe;
+    free(arena_probe);
+    pthread_mutex_init(&self->lock, NULL);
+
+    pthread_mutex_lock(&registry_lock);
+    self->next = registered_threads;
+    registered_threads = self;
+    pthread_mutex_unlock(&registry_lock);
+    registered_self = self;
+    return 0;
+}
+
+void glibcvsz_unregister_thread(void) {
+    struct registered_thread *self = registered_self;
+    if (!self) {
+        return;
+    }
+    pthread_mutex_lock(&registry_lock);
+    for (struct registered_thread **link = &registered_threads; *link; link = &(*link)->next) {
+        if (*link == self) {
+            *link = self->next;
+            break;
         }
     }
+    pthread_mutex_unlock(&registry_lock);
+    registered_self = NULL;
+    pthread_mutex_destroy(&self->lock);
+    free(self->entry.malloc_info_entries);
+    free(self->block_slots);
+    free(self);
 }
 
-int create_threads(pthread_t *threads, struct thread_info_entry *entry) {
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
+// Blocks are at least 16 byte aligned, the low bits carry nothing
+static size_t block_home_slot(const struct registered_thread *self, unsigned long long address) {
+    return (size_t)(((address >> 4) * 0x9E3779B97F4A7C15ULL) >> 32) & self->slot_mask;
+}
 
-    set_stack_size(&attr);
+// The slot holding the block at address, or the free slot it would go to
+static size_t find_block_slot(const struct registered_thread *self, unsigned long long address) {
+    size_t slot = block_home_slot(self, address);
+    while (self->block_slots[slot] &&
+           self->entry.malloc_info_entries[self->block_slots[slot] - 1].malloc_start_address != address) {
+        slot = (slot + 1) & self->slot_mask;
+    }
+    return slot;
+}
 
-    for (long i = 0; i < num_threads; i++) {
-        entry[i].thread_id = i;
-        entry[i].finished = 0;
-        entry[i].malloc_entry_count = malloc_count;
-        entry[i].malloc_info_entries = malloc(sizeof(struct malloc_info_entry) * entry[i].malloc_entry_count);
+// Doubles the blocks and rehashes them into twice as many slots, so the table stays at most half full
+static int grow_registered_blocks(struct registered_thread *self) {
+    struct thread_info_entry *entry = &self->entry;
+    size_t capacity = self->block_capacity ? self->block_capacity * 2 : 64;
+    struct malloc_info_entry *blocks = realloc(entry->malloc_info_entries, sizeof(struct malloc_info_entry) * capacity);
+    if (!blocks) {
+        return -1;
+    }
+    entry->malloc_info_entries = blocks;
+    size_t *slots = calloc(capacity * 2, sizeof(size_t));
+    if (!slots) {
+        return -1;
+    }
+    self->block_capacity = capacity;
+    free(self->block_slots);
+    self->block_slots = slots;
+    self->slot_mask = capacity * 2 - 1;
+    for (size_t i = 0; i < entry->malloc_entry_count; i++) {
+        self->block_slots[find_block_slot(self, blocks[i].malloc_start_address)] = i + 1;
+    }
+    return 0;
+}
 
-        if (pthread_create(&threads[i], &attr, thread_function, (void*)&entry[i]) != 0) {
-            perror("pthread_create");
-            pthread_attr_destroy(&attr);
-            return -1;
+// Registering an address again replaces the block, e.g. after realloc() kept it in place
+int glibcvsz_register_allocation(const void *ptr, size_t size) {
+    struct registered_thread *self = registered_self;
+    if (!self || !ptr) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct thread_info_entry *entry = &self->entry;
+    unsigned long long address = (unsigned long long)(uintptr_t)ptr;
+    int ret = 0;
+    pthread_mutex_lock(&self->lock);
+    if (entry->malloc_entry_count == self->block_capacity) {
+        ret = grow_registered_blocks(self);
+    }
+    if (ret == 0) {
+        size_t slot = find_block_slot(self, address);
+        if (!self->block_slots[slot]) {
+            self->block_slots[slot] = ++entry->malloc_entry_count;
         }
+        struct malloc_info_entry *block = &entry->malloc_info_entries[self->block_slots[slot] - 1];
+        block->malloc_start_address = address;
+        block->malloc_end_address = address + size;
+        block->malloc_size = size;
     }
+    pthread_mutex_unlock(&self->lock);
+    return ret;
+}
 
-    pthread_attr_destroy(&attr);
+void glibcvsz_unregister_allocation(const void *ptr) {
+    struct registered_thread *self = registered_self;
+    if (!self || !self->block_slots) {
+        return;
+    }
+    struct thread_info_entry *entry = &self->entry;
+    pthread_mutex_lock(&self->lock);
+    size_t slot = find_block_slot(self, (unsigned long long)(uintptr_t)ptr);
+    if (self->block_slots[slot]) {
+        size_t index = self->block_slots[slot] - 1;
 
-    return 0;
+        // Backward shift deletion: pull up every following block its home slot does not keep in place
+        size_t hole = slot;
+        for (size_t next = (hole + 1) & self->slot_mask; self->block_slots[next]; next = (next + 1) & self->slot_mask) {
+            size_t home = block_home_slot(
+                self, entry->malloc_info_entries[self->block_slots[next] - 1].malloc_start_address);
+            if (((next - home) & self->slot_mask) >= ((next - hole) & self->slot_mask)) {
+                self->block_slots[hole] = self->block_slots[next];
+                hole = next;
+            }
+        }
+        self->block_slots[hole] = 0;
+
+        // The last block fills the gap in the list, its slot follows it
+        size_t last = --entry->malloc_entry_count;
+        if (index != last) {
+            entry->malloc_info_entries[index] = entry->malloc_info_entries[last];
+            self->block_slots[find_block_slot(self, entry->malloc_info_entries[index].malloc_start_address)] = index + 1;
+        }
+    }
+    pthread_mutex_unlock(&self->lock);
 }
 
-void wait_for_threads_to_finish(struct thread_info_entry *entries) {
-    for (int i = 0; i < num_threads; i++) {
-        while (!entries[i].finished) {
-            usleep(1000);
+void glibcvsz_snapshot_free(struct glibcvsz_snapshot *snapshot) {
+    if (!snapshot) {
+        return;
+    }
+    free(snapshot->pmap_entries);
+    free(snapshot->thread_entries);
+    free(snapshot->blocks);
+    free(snapshot->mappings);
+    free(snapshot);
+}
+
+// Copies the registered threads and their blocks, each list under its own lock only for the copy
+static int copy_registered_threads(struct glibcvsz_snapshot *snapshot) {
+    pthread_mutex_lock(&registry_lock);
+    size_t count = 0;
+    for (struct registered_thread *r = registered_threads; r; r = r->next) {
+        count++;
+    }
+    size_t *first_block = malloc(sizeof(size_t) * (count ? count : 1));
+    snapshot->thread_entries = calloc(count ? count : 1, sizeof(struct thread_info_entry));
+    int ret = first_block && snapshot->thread_entries ? 0 : -1;
+
+    size_t block_count = 0, block_capacity = 0;
+    for (struct registered_thread *r = registered_threads; r && ret == 0; r = r->next) {
+        struct thread_info_entry *entry = &snapshot->thread_entries[snapshot->thread_entry_count];
+        pthread_mutex_lock(&r->lock);
+        *entry = r->entry;
+        if (block_count + entry->malloc_entry_count > block_capacity) {
+            size_t capacity = (block_count + entry->malloc_entry_count) * 2;
+            struct malloc_info_entry *blocks = realloc(snapshot->blocks, sizeof(struct malloc_info_entry) * capacity);
+            if (blocks) {
+                snapshot->blocks = blocks;
+                block_capacity = capacity;
+            } else {
+                ret = -1;
+            }
         }
+        if (ret == 0 && entry->malloc_entry_count > 0) {
+            memcpy(&snapshot->blocks[block_count], entry->malloc_info_entries,
+                   sizeof(struct malloc_info_entry) * entry->malloc_entry_count);
+        }
+        pthread_mutex_unlock(&r->lock);
+        first_block[snapshot->thread_entry_count++] = block_count;
+        block_count += entry->malloc_entry_count;
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    // The blocks may have moved while they were collected
+    for (int t = 0; t < snapshot->thread_entry_count && ret == 0; t++) {
+        snapshot->thread_entries[t].malloc_info_entries = snapshot->blocks + first_block[t];
     }
+    free(first_block);
+    return ret;
 }
 
-struct pmap_entry *get_pmap_analysis(int pid, int *count) {
-    FILE *fp = execute_pmap_cmd(pid);
-    if (!fp) {
+struct glibcvsz_snapshot *glibcvsz_snapshot_take(void) {
+    struct glibcvsz_snapshot *snapshot = calloc(1, sizeof(struct glibcvsz_snapshot));
+    if (!snapshot) {
+        return NULL;
+    }
+    if (copy_registered_threads(snapshot) != 0) {
+        glibcvsz_snapshot_free(snapshot);
+        return NULL;
+    }
+    snapshot->pmap_entries = get_pmap_analysis(getpid(), &snapshot->pmap_entry_count);
+    if (!snapshot->pmap_entries) {
+        glibcvsz_snapshot_free(snapshot);
+        errno = EIO;
         return NULL;
     }
 
-    struct pmap_entry *entries = parse_pmap_output(fp, count);
+    size_t count = snapshot->pmap_entry_count > 0 ? (size_t)snapshot->pmap_entry_count : 1;
+    struct region_class *classes = malloc(sizeof(struct region_class) * count);
+    snapshot->mappings = calloc(count, sizeof(struct glibcvsz_mapping));
+    struct arena_table arenas;
+    int ret = -1;
+    if (classes && snapshot->mappings &&
+        scan_process_arenas(getpid(), &arenas, snapshot->pmap_entries, snapshot->pmap_entry_count) == 0) {
+        ret = classify_pmap_entries(snapshot->pmap_entries, snapshot->pmap_entry_count, snapshot->thread_entries,
+                                    snapshot->thread_entry_count, &arenas, classes);
+        free_arena_table(&arenas);
+    }
+    for (int m = 0; m < snapshot->pmap_entry_count && ret == 0; m++) {
+        const struct pmap_entry *p = &snapshot->pmap_entries[m];
+        struct glibcvsz_mapping *mapping = &snapshot->mappings[m];
+        mapping->start = p->start_address;
+        mapping->end = p->end_address;
+        mapping->rss_kbytes = p->rss;
+        mapping->dirty_kbytes = p->dirty;
+        mapping->swap_kbytes = p->swap;
+        mapping->perms[0] = p->r;
+        mapping->perms[1] = p->w;
+        mapping->perms[2] = p->x;
+        mapping->kind = (enum glibcvsz_region_kind)classes[m].kind;
+        mapping->thread = classes[m].kind == REGION_THREAD_STACK ? classes[m].thread_id : -1;
+        mapping->name = p->mapping;
+    }
+    free(classes);
+    if (ret != 0) {
+        glibcvsz_snapshot_free(snapshot);
+        return NULL;
+    }
+    pthread_mutex_lock(&report_lock);
+    snapshot->number = snapshot_count++;
+    pthread_mutex_unlock(&report_lock);
+    return snapshot;
+}
 
-    pclose(fp);
+size_t glibcvsz_snapshot_mappings(const struct glibcvsz_snapshot *snapshot, const struct glibcvsz_mapping **mappings) {
+    *mappings = snapshot->mappings;
+    return (size_t)snapshot->pmap_entry_count;
+}
 
-    if (!entries) {
-        return NULL;
+int glibcvsz_snapshot_write(const struct glibcvsz_snapshot *snapshot, int fd, enum glibcvsz_format format) {
+    if (format == GLIBCVSZ_TEXT && fd != STDOUT_FILENO) {
+        // The text report is printed through stdio
+        errno = EINVAL;
+        return -1;
     }
-    return entries;
+    int ret = -1;
+    pthread_mutex_lock(&report_lock);
+    enum output_format previous_format = output_format;
+    output_format = (enum output_format)format;
+    struct output_writer *writer = NULL;
+    int writer_fd = format == GLIBCVSZ_TEXT ? -1 : dup(fd);
+    if (format == GLIBCVSZ_TEXT || (writer_fd >= 0 && (writer = new_output_writer(writer_fd)) != NULL)) {
+        ret = report_memory_map(getpid(), writer, snapshot->number, 0, snapshot->pmap_entries,
+                                snapshot->pmap_entry_count, snapshot->thread_entries, snapshot->thread_entry_count);
+        if (writer && close_output_writer(writer) != 0) {
+            ret = -1;
+        }
+        fflush(stdout);
+    } else if (writer_fd >= 0) {
+        close(writer_fd);
+    }
+    output_format = previous_format;
+    pthread_mutex_unlock(&report_lock);
+    return ret;
 }
 
-void stop_threads(pthread_t *threads) {
-    // Set stop signal for threads
-    running = 0;
+/*
+ * The SIGUSR1 dump: the handler only counts the request and wakes the dump
+ * thread with a futex, both async-signal-safe, and the dump thread takes
+ * and writes the snapshot.
+ */
+static volatile int dump_requests = 0;
+static volatile int dump_stopping = 0;
+static int dump_started = 0;
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER; // start and stop may race each other
+static pthread_t dump_thread;
+static char dump_directory[PATH_MAX];
+static enum glibcvsz_format dump_format;
+static struct sigaction dump_previous_action;
 
-    for (int i = 0; i < num_threads; i++) {
-        pthread_join(threads[i], NULL);
+static void request_dump(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    __atomic_add_fetch(&dump_requests, 1, __ATOMIC_RELEASE);
+    futex_wake(&dump_requests, 1);
+    errno = saved_errno;
+}
+
+static void write_dump(unsigned long dump) {
+    static const char *extensions[] = { "txt", "json", "csv", "bin" };
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/glibcvsz-%d-%lu.%s", dump_directory, (int)getpid(), dump,
+             extensions[dump_format]);
+    struct glibcvsz_snapshot *snapshot = glibcvsz_snapshot_take();
+    int fd = snapshot ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+    if (fd < 0 || glibcvsz_snapshot_write(snapshot, fd, dump_format) != 0) {
+        fprintf(stderr, "glibcvsz: dump to %s failed\n", path);
     }
+    if (fd >= 0) {
+        close(fd);
+    }
+    glibcvsz_snapshot_free(snapshot);
 }
 
-void free_thread_info_entries(struct thread_info_entry *entries) {
-    for (int i = 0; i < num_threads; i++) {
-          if (entries[i].malloc_info_entries != NULL) {
-              free(entries[i].malloc_info_entries);
-              entries[i].malloc_info_entries = NULL;
-          }
+static void *dump_thread_function(void *arg) {
+    (void)arg;
+    // Counts from the reset in glibcvsz_start_dump_thread(), so no early signal is lost
+    int handled = 0;
+    unsigned long dumps = 0;
+    while (!dump_stopping) {
+        int requests = __atomic_load_n(&dump_requests, __ATOMIC_ACQUIRE);
+        if (requests == handled) {
+            futex_wait(&dump_requests, requests);
+            continue;
+        }
+        // Signals arriving during a dump are answered by one dump afterwards
+        handled = requests;
+        if (!dump_stopping) {
+            write_dump(dumps++);
+        }
     }
-    free(entries);
-    entries = NULL;
+    return NULL;
 }
 
-int main(int argc, char *argv[]) {
+int glibcvsz_start_dump_thread(const char *directory, enum glibcvsz_format format) {
+    pthread_mutex_lock(&dump_lock);
+    if (dump_started || format == GLIBCVSZ_TEXT || format > GLIBCVSZ_BINARY ||
+        strlen(directory) >= sizeof(dump_directory)) {
+        pthread_mutex_unlock(&dump_lock);
+        errno = EINVAL;
+        return -1;
+    }
+    snprintf(dump_directory, sizeof(dump_directory), "%s", directory);
+    dump_format = format;
+    dump_stopping = 0;
+    __atomic_store_n(&dump_requests, 0, __ATOMIC_RELEASE);
+    int ret = pthread_create(&dump_thread, NULL, dump_thread_function, NULL);
+    if (ret != 0) {
+        pthread_mutex_unlock(&dump_lock);
+        errno = ret;
+        return -1;
+    }
 
-    parse_arguments(&argc, argv);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_dump;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR1, &sa, &dump_previous_action) != 0) {
+        int saved_errno = errno;
+        dump_stopping = 1;
+        request_dump(SIGUSR1);
+        pthread_join(dump_thread, NULL);
+        pthread_mutex_unlock(&dump_lock);
+        errno = saved_errno;
+        return -1;
+    }
+    dump_started = 1;
+    pthread_mutex_unlock(&dump_lock);
+    return 0;
+}
 
-    struct thread_info_entry *thread_info_entries = malloc(sizeof(struct thread_info_entry) * num_threads);
-    if (!thread_info_entries) {
-        perror("malloc thread_info entries failed!");
-        return EXIT_FAILURE;
+void glibcvsz_stop_dump_thread(void) {
+    pthread_mutex_lock(&dump_lock);
+    if (dump_started) {
+        sigaction(SIGUSR1, &dump_previous_action, NULL);
+        dump_stopping = 1;
+        request_dump(SIGUSR1);
+        pthread_join(dump_thread, NULL);
+        dump_started = 0;
     }
+    pthread_mutex_unlock(&dump_lock);
+}
 
-    pthread_t threads[num_threads];
+#ifndef GLIBCVSZ_LIBRARY
+/*
+ * glibc reads its tunables once at startup, so --thp tunable executes the
+ * program again with the hugetlb tunable added to GLIBC_TUNABLES. A value
+ * the user already set is kept.
+ */
+static void apply_thp_tunable(char *argv[]) {
+    const char *tunables = getenv("GLIBC_TUNABLES");
+    if (tunables && strstr(tunables, "glibc.malloc.hugetlb")) {
+        return;
+    }
+    // Already executed once, the loader dropped the tunable (AT_SECURE), do not loop
+    if (getenv(THP_TUNABLE_MARKER)) {
+        fprintf(stderr, "GLIBC_TUNABLES was not passed on, running without %s\n", THP_TUNABLE_SETTING);
+        return;
+    }
 
-    if (create_threads(threads, thread_info_entries) != 0) {
-        return EXIT_FAILURE;
+    char value[1024];
+    int length;
+    if (tunables && *tunables)
+        length = snprintf(value, sizeof(value), "%s:%s", tunables, THP_TUNABLE_SETTING);
+    else
+        length = snprintf(value, sizeof(value), "%s", THP_TUNABLE_SETTING);
+    if (length < 0 || (size_t)length >= sizeof(value)) {
+        fprintf(stderr, "GLIBC_TUNABLES is too long to add %s\n", THP_TUNABLE_SETTING);
+        exit(EXIT_FAILURE);
+    }
+    if (setenv("GLIBC_TUNABLES", value, 1) != 0 || setenv(THP_TUNABLE_MARKER, "1", 1) != 0) {
+        perror("setenv GLIBC_TUNABLES");
+        exit(EXIT_FAILURE);
     }
+    fflush(stdout);
+    execv("/proc/self/exe", argv);
+    perror("execv");
+    exit(EXIT_FAILURE);
+}
 
-    wait_for_threads_to_finish(thread_info_entries);
+int main(int argc, char *argv[]) {
 
-    int pmap_entry_count = 0;
-    struct pmap_entry *pmap_entries = get_pmap_analysis(getpid(), &pmap_entry_count);
-    if (!pmap_entries) {
-        free_thread_info_entries(thread_info_entries);
+    set_snapshot_label(argc, argv);
+    parse_arguments(&argc, argv);
+    if (compare_paths[0]) {
+        return run_compare(compare_paths[0], compare_paths[1]);
+    }
+    if (thp_mode == THP_TUNABLE) {
+        apply_thp_tunable(argv);
+    }
+    if ((affinity_mode != AFFINITY_OFF || numa_report) && load_cpu_topology() != 0) {
         return EXIT_FAILURE;
     }
+    if (thp_mode == THP_MADVISE) {
+        // A brk heap grown in small steps rarely covers a whole huge page when it is first touched
+        mallopt(M_TOP_PAD, (int)(THP_TOP_PAD_PAGES * thp_page_size()));
+    }
 
-    create_output(pmap_entries, pmap_entry_count, thread_info_entries, num_threads);
-
-    stop_threads(threads);
+    int ret;
+    if (attach_pid > 0)
+        ret = run_attach(attach_pid);
+    else if (sweep_enabled)
+        ret = run_sweep();
+    else {
+        if (pool_workers > 0)
+            run_pool_baseline();
+        if (strcmp(allocator->name, "pool") == 0)
+            run_allocator_baseline();
+        if (thp_mode != THP_OFF)
+            run_thp_baseline();
+        if (stack_pool_enabled)
+            run_stack_pool_baseline();
+        if (touch_pattern_count > 1)
+            run_touch_baselines();
+        if (pool_arena_limit && set_malloc_arena_number(1) != 0)
+            return EXIT_FAILURE;
+        if (trace_path && start_trace(trace_path) != 0)
+            return EXIT_FAILURE;
+        ret = run_playground(NULL);
+        if (trace_path && finish_trace(!report_on_stdout()) != 0)
+            ret = EXIT_FAILURE;
+    }
 
-    free_thread_info_entries(thread_info_entries);
-    free(pmap_entries);
+    free(workload.histogram);
 
-    return 0;
+    return ret;
 }
+#endif